@@ -0,0 +1,393 @@
+/* ==========================================================================
+ * bench.c: Benchmark of Embedded Transport Protocol
+ *
+ * function:  1. Decode of package header by get_pack_u16() and the other
+ *               field functions, against a raw cast of a native struct as
+ *               the header was before the wire format, on aligned and
+ *               unaligned buffers.
+ *            2. Building and checking packages of several lengths, which
+ *               is header, checksum and copy of data, and parity with
+ *               PACK_FEC.
+ *            3. With PACK_FEC, checking packages with a byte error in data
+ *               or in length, which are corrected.
+ *            4. Requests and acks over a channel of random bit errors at
+ *               several rates, master resends on ack timeout, and goodput
+ *               is the data bytes per byte on the wire. Built with and
+ *               without PACK_FEC, it tells the rate that FEC pays off.
+ *            5. Exchanges with 1 to 10000 slaves in turn, master looks up
+ *               the state of slave in its peer table for every request and
+ *               ack, so the time stays flat if lookups are O(1). The state
+ *               of every slave is checked after.
+ *
+ * usage:     bench [-n count]
+ *               -n  Packages of each test, default 1000000
+ *
+ * build:     gcc -O2 -DPACK_CLOCK_EXTERN bench.c package.c trace.c
+ *            Add -DPACK_FEC=2 fec.c for FEC.
+ *            Add -DPACK_WIDE_ADDR for more than 253 slaves.
+ * ======================================================================== */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "package.h"
+
+// LOCAL_TIME() is given by the benchmark, it doesn't matter
+#if !defined PACK_CLOCK_EXTERN
+	#error "bench.c needs PACK_CLOCK_EXTERN, LOCAL_TIME() is given by pack_local_time()"
+#endif
+
+// Packages are checked by check_pack() straight from the wire
+#if defined PACK_FRAMING_COBS
+	#error "bench.c checks packages without framing, build it without PACK_FRAMING_COBS"
+#endif
+
+// Address of master and slave
+#define BENCH_MASTER_ADDR 1
+#define BENCH_SLAVE_ADDR  2
+// Packages in buffer of decode test
+#define BENCH_HEADERS 1024
+// Data length of FEC and channel tests
+#define BENCH_CHANNEL_LEN 64
+// Requests of channel test at each bit error rate
+#define BENCH_CHANNEL_REQUESTS 20000
+// Sendings of a request at most in channel test
+#define BENCH_CHANNEL_TRIES 20
+// Max ack delay of master in milliseconds
+#define BENCH_ACK_DELAY 1000
+// Most slaves of peer test, and entries of peer table that holds them
+#define BENCH_PEERS 10000
+#define BENCH_PEER_SIZE 16384
+
+// Header as a native struct, with padding and byte order of compiler
+struct bench_raw_header {
+	U8 premble[3];
+	U8 start;
+	U16 chksum;
+	U8 dest;
+	U8 src;
+	U16 seqno;
+	U16 len;
+};
+
+// ============================ Static Variables ============================
+static U32 count = 1000000;                // Packages of each test
+static volatile U32 sink;                  // Result of decode, kept from optimizer
+static struct pack_link master_link;       // Link of master
+static struct pack_link slave_link;        // Link of slave
+static U8 wire[MAX_FRAME_SIZE];            // The last package sent
+static U16 wire_len;                       // Length of the last package sent
+static double wire_bytes;                  // Bytes sent by all links
+static U32 now;                            // Local time in milliseconds
+static U32 rand_state = 1;                 // State of random generator
+static struct pack_peer peer_table[BENCH_PEER_SIZE]; // Peer table of master in peer test
+
+// Local time, for LOCAL_TIME()
+U32 pack_local_time(void)
+{
+	return now;
+}
+
+// Monotonic time in seconds
+static double get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Callback function for sending bytes, the package is kept for checking
+static void send_bytes(U8* buf, U16 len)
+{
+	memcpy(wire, buf, len);
+	wire_len = len;
+	wire_bytes += len;
+}
+
+// Random number, xorshift
+static U32 next_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+// Decode headers by a raw cast, as before the wire format
+static double decode_raw(const U8* buf, U16 stride)
+{
+	const struct bench_raw_header* pack;
+	double start = get_time();
+	U32 sum = 0;
+	U32 i;
+
+	for (i = 0; i < count; i++) {
+		pack = (const struct bench_raw_header*)(buf + (i % BENCH_HEADERS) * stride);
+		sum += pack->chksum + pack->dest + pack->src + pack->seqno + pack->len;
+	}
+	sink = sum;
+
+	return (get_time() - start) * 1e9 / count;
+}
+
+// Decode headers by the field functions of wire format
+static double decode_wire(const U8* buf, U16 stride)
+{
+	const struct pack_header* pack;
+	double start = get_time();
+	U32 sum = 0;
+	U32 i;
+
+	for (i = 0; i < count; i++) {
+		pack = (const struct pack_header*)(buf + (i % BENCH_HEADERS) * stride);
+		sum += get_pack_u16(pack->chksum) + get_pack_addr(pack->dest) + get_pack_addr(pack->src)
+		     + get_pack_seqno(pack->seqno) + get_pack_u16(pack->len);
+	}
+	sink = sum;
+
+	return (get_time() - start) * 1e9 / count;
+}
+
+// Test decode of header, on aligned buffer and on buffer of odd offset
+static void bench_header(void)
+{
+	static U8 buf[BENCH_HEADERS * 16 + 1];
+	U16 stride = 16;
+	U32 i;
+
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = (U8)(i * 7);
+	}
+
+	printf("header decode (ns per header)\n");
+	printf("  raw cast, aligned       %6.2f\n", decode_raw(buf, stride));
+	printf("  wire format, aligned    %6.2f\n", decode_wire(buf, stride));
+	printf("  wire format, unaligned  %6.2f\n", decode_wire(buf + 1, stride));
+}
+
+// Test building and checking packages of 'len' bytes of data
+static void bench_pack(U16 len)
+{
+	double send_time;
+	double check_time;
+	double start;
+	U32 i;
+
+	// Master builds the package, checksum included
+	select_pack_link(&master_link);
+	memset(master_link.send_data, 0x5A, len);
+	start = get_time();
+	for (i = 0; i < count; i++) {
+		master_send_pack(BENCH_SLAVE_ADDR, len);
+	}
+	send_time = (get_time() - start) * 1e9 / count;
+
+	// Slave checks the same package, it's a duplicate after the first
+	select_pack_link(&slave_link);
+	start = get_time();
+	for (i = 0; i < count; i++) {
+		memcpy(slave_link.recv_buf, wire, wire_len);
+		sink = check_pack();
+	}
+	check_time = (get_time() - start) * 1e9 / count;
+
+	printf("  %5u %10.1f %10.1f %10.1f\n", len, send_time, check_time,
+	       wire_len * 1e3 / check_time);
+}
+
+#if defined PACK_FEC
+// Time of checking a package of BENCH_CHANNEL_LEN bytes of data, with the
+// byte at 'offset' broken if it's not 0, in ns
+static double check_fec(U16 offset)
+{
+	double start;
+	U32 i;
+
+	select_pack_link(&master_link);
+	memset(master_link.send_data, 0x5A, BENCH_CHANNEL_LEN);
+	master_send_pack(BENCH_SLAVE_ADDR, BENCH_CHANNEL_LEN);
+	if (offset > 0) {
+		wire[offset] ^= 0x24;
+	}
+
+	select_pack_link(&slave_link);
+	start = get_time();
+	for (i = 0; i < count; i++) {
+		memcpy(slave_link.recv_buf, wire, wire_len);
+		sink = check_pack();
+	}
+	return (get_time() - start) * 1e9 / count;
+}
+
+// Test checking packages with a byte error, which are corrected
+static void bench_fec(void)
+{
+	const struct pack_header* pack = (const struct pack_header*)wire;
+
+	printf("FEC of %u bytes of data, %u bytes corrected at most (ns per package)\n",
+	       BENCH_CHANNEL_LEN, PACK_FEC);
+	printf("  clean                   %8.1f\n", check_fec(0));
+	printf("  a byte broken in data   %8.1f\n", check_fec((U16)(pack->data - wire) + BENCH_CHANNEL_LEN / 2));
+	printf("  a byte broken in length %8.1f\n", check_fec((U16)(pack->len - wire)));
+}
+#endif
+
+// Copy the package sent to 'link' with bits broken at 'ber', and check it
+static enum pack_recv_type_list pass_channel(struct pack_link* link, double ber)
+{
+	U32 threshold = (U32)(ber * 4294967295.0);
+	U16 i;
+	U8 bit;
+
+	select_pack_link(link);
+	memcpy(link->recv_buf, wire, wire_len);
+	for (i = 0; (threshold > 0) && (i < wire_len); i++) {
+		for (bit = 0; bit < 8; bit++) {
+			if (next_rand() < threshold) {
+				link->recv_buf[i] ^= (U8)(1 << bit);
+			}
+		}
+	}
+	wire_len = 0;
+
+	return check_pack();
+}
+
+// Test requests and acks of BENCH_CHANNEL_LEN bytes of data over a channel
+// of bit error rate 'ber'
+static void bench_channel(double ber)
+{
+	U32 done = 0;
+	U32 sends = 0;
+	U32 i;
+	U8 tries;
+
+	wire_bytes = 0;
+	for (i = 0; i < BENCH_CHANNEL_REQUESTS; i++) {
+		select_pack_link(&master_link);
+		memset(master_link.send_data, (U8)i, BENCH_CHANNEL_LEN);
+		master_send_pack(BENCH_SLAVE_ADDR, BENCH_CHANNEL_LEN);
+
+		for (tries = 0; tries < BENCH_CHANNEL_TRIES; tries++) {
+			sends++;
+			// Slave acks a new request, and resends the ack of a duplicate
+			if (pass_channel(&slave_link, ber) == PACK_RECV_NEW) {
+				memcpy(slave_link.send_data, slave_link.recv_data, BENCH_CHANNEL_LEN);
+				slave_send_pack(BENCH_CHANNEL_LEN);
+			}
+			if ((wire_len > 0) && (pass_channel(&master_link, ber) == PACK_RECV_NEW)) {
+				done++;
+				break;
+			}
+
+			// Master resends on ack timeout
+			select_pack_link(&master_link);
+			now += BENCH_ACK_DELAY + 1;
+			master_check_ack_delay();
+		}
+	}
+
+	printf("  %7.0e %9.1f%% %10.2f %8.3f\n", ber, done * 100.0 / BENCH_CHANNEL_REQUESTS,
+	       (double)sends / BENCH_CHANNEL_REQUESTS, done * BENCH_CHANNEL_LEN * 2.0 / wire_bytes);
+}
+
+// Test exchanges with 'peers' slaves in turn, return false if the state of
+// a slave is wrong after
+static bool bench_peers(U16 peers)
+{
+	const struct pack_peer* peer;
+	double start;
+	U32 i;
+
+	select_pack_link(&master_link);
+	master_set_peer_table(peer_table, BENCH_PEER_SIZE);
+	memset(master_link.send_data, 0x5A, BENCH_CHANNEL_LEN);
+
+	// Slave answers as every one of slaves in turn
+	start = get_time();
+	for (i = 0; i < count; i++) {
+		slave_link.local_addr = (pack_addr)(BENCH_SLAVE_ADDR + i % peers);
+		select_pack_link(&master_link);
+		master_send_pack(slave_link.local_addr, BENCH_CHANNEL_LEN);
+		select_pack_link(&slave_link);
+		memcpy(slave_link.recv_buf, wire, wire_len);
+		if (check_pack() == PACK_RECV_NEW) {
+			slave_send_pack(BENCH_CHANNEL_LEN);
+		}
+		select_pack_link(&master_link);
+		memcpy(master_link.recv_buf, wire, wire_len);
+		sink = check_pack();
+	}
+	printf("  %5u %10.1f\n", peers, (get_time() - start) * 1e9 / count);
+
+	// Every slave has its share of requests, and all are acked
+	for (i = 0; i < peers; i++) {
+		peer = master_get_peer((pack_addr)(BENCH_SLAVE_ADDR + i));
+		if ((peer == NULL) || (peer->send_count != count / peers + (i < count % peers))
+		|| (peer->ack_count != peer->send_count)) {
+			printf("FAIL: state of slave %u is wrong\n", BENCH_SLAVE_ADDR + i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Benchmark
+int main(int argc, char* argv[])
+{
+	U16 lens[] = { 1, 8, 64, MAX_DATA_LEN };
+	U16 peers[] = { 1, 100, 1000, BENCH_PEERS };
+	double bers[] = { 0, 1e-4, 3e-4, 1e-3, 2e-3, 5e-3 };
+	U16 i;
+
+	for (i = 1; i < argc; i++) {
+		if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+			count = (U32)atol(argv[++i]);
+		} else {
+			break;
+		}
+	}
+	if (i < argc || count < 1) {
+		printf("usage: bench [-n count]\n");
+		return 1;
+	}
+
+	select_pack_link(&master_link);
+	master_init_pack(BENCH_MASTER_ADDR, BENCH_ACK_DELAY, send_bytes);
+	select_pack_link(&slave_link);
+	slave_init_pack(BENCH_SLAVE_ADDR, BENCH_MASTER_ADDR, send_bytes);
+
+	bench_header();
+
+	printf("package (ns per package)\n");
+	printf("   data       send      check  check MB/s\n");
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		if (lens[i] <= MAX_DATA_LEN) {
+			bench_pack(lens[i]);
+		}
+	}
+
+#if defined PACK_FEC
+	bench_fec();
+#endif
+	printf("channel of bit errors, %u requests of %u bytes of data each way\n",
+	       BENCH_CHANNEL_REQUESTS, BENCH_CHANNEL_LEN);
+	printf("      BER      done  sends/req  goodput\n");
+	for (i = 0; i < sizeof(bers) / sizeof(bers[0]); i++) {
+		bench_channel(bers[i]);
+	}
+
+	printf("exchange with slaves in turn (ns per exchange)\n");
+	printf("  peers   exchange\n");
+	for (i = 0; i < sizeof(peers) / sizeof(peers[0]); i++) {
+		if ((peers[i] <= PACK_ADDR_COUNT - 2) && !bench_peers(peers[i])) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,420 @@
+/* ==========================================================================
+ * bulk.c: Bulk Transfer of Slave Memory for Embedded Transport Protocol
+ *
+ * function:  1. Master reads or writes 'length' bytes at 'offset' of a
+ *               memory region of slave, e.g. a log or a calibration table.
+ *            2. Data is split into chunks of the longest data part, and
+ *               streamed in bursts of up to BULK_WINDOW packages, which pay
+ *               one turnaround of bus per burst instead of per package.
+ *            3. Every burst is acknowledged by one bitmap of the chunks
+ *               received, the missing chunks are sent again in the next
+ *               burst.
+ *            4. Master drives a transfer by polling, slave answers from
+ *               read and write functions of application.
+ *            5. Transfer runs behind asynchronous requests of master, which
+ *               go between bursts, and an urgent one cuts a write burst
+ *               short at the next package.
+ * ======================================================================== */
+
+#include <string.h>
+#include "bulk.h"
+
+// State of master transfer
+enum bulk_state_list {
+	BULK_STATE_SEND,  // Sending read request or write burst
+	BULK_STATE_WAIT,  // Waiting for read stream or write status
+};
+
+// Bitmap of the first 'count' chunks
+static U32 chunk_mask(U8 count)
+{
+	return (count >= 32) ? 0xFFFFFFFFUL : (((U32)1 << count) - 1);
+}
+
+// Index of the lowest chunk in bitmap, which must not be 0
+static U8 lowest_chunk(U32 bitmap)
+{
+	U8 index = 0;
+
+	while ((bitmap & ((U32)1 << index)) == 0) {
+		index++;
+	}
+
+	return index;
+}
+
+// Length of chunk 'index' of the window at 'base' of 'length' bytes
+static U16 chunk_len(U32 base, U32 length, U16 chunk, U8 index)
+{
+	U32 left = length - base - (U32)index * chunk;
+
+	return (U16)((left < chunk) ? left : chunk);
+}
+
+// ============================ Master Functions ============================
+#if !defined PACK_ROLE_SLAVE
+// Complete the transfer
+static void finish_transfer(struct bulk_transfer* xfer, enum bulk_result_list result)
+{
+	struct pack_link* link = get_pack_link();
+
+	// Stop resending the last package of transfer
+	link->flag_master_need_ack = false;
+	link->master_retry_times = 0;
+
+	xfer->flag_busy = false;
+	master_hold_req(false);
+	if (xfer->func != NULL) {
+		xfer->func(xfer, result);
+	}
+}
+
+// Start the window at 'base' of transfer
+static void start_window(struct bulk_transfer* xfer)
+{
+	U32 left = xfer->length - xfer->base;
+	U32 count = (left + xfer->chunk - 1) / xfer->chunk;
+
+	xfer->window_count = (U8)((count < BULK_WINDOW) ? count : BULK_WINDOW);
+	xfer->done = 0;
+	xfer->pending = chunk_mask(xfer->window_count);
+	xfer->burst = 0;
+	xfer->retry_times = 0;
+	xfer->state = BULK_STATE_SEND;
+}
+
+// Go on after a burst, to the next window if the current one is done
+static void end_burst(struct bulk_transfer* xfer, bool flag_progress)
+{
+	U32 mask = chunk_mask(xfer->window_count);
+	U32 size;
+
+	// Waiting requests go before the next burst
+	master_hold_req(false);
+
+	if (xfer->done == mask) {
+		size = (U32)xfer->window_count * xfer->chunk;
+		xfer->base += (size < xfer->length - xfer->base) ? size : xfer->length - xfer->base;
+		if (xfer->base >= xfer->length) {
+			finish_transfer(xfer, BULK_OK);
+			return;
+		}
+		start_window(xfer);
+		return;
+	}
+
+	// Missing chunks are sent in the next burst
+	xfer->retry_times = flag_progress ? 0 : xfer->retry_times + 1;
+	if (xfer->retry_times > BULK_MAX_RETRY) {
+		finish_transfer(xfer, BULK_TIMEOUT);
+		return;
+	}
+	xfer->pending = mask & ~xfer->done;
+	xfer->state = BULK_STATE_SEND;
+}
+
+// Master sends the read request of the missing chunks of window
+static void send_read(struct bulk_transfer* xfer)
+{
+	U8* data = get_pack_link()->send_data;
+	U16 len = bulk_read_init(data);
+	U32 size = (U32)xfer->window_count * xfer->chunk;
+
+	bulk_read_put_region(data, xfer->region);
+	bulk_read_put_base(data, xfer->offset + xfer->base);
+	bulk_read_put_length(data, (size < xfer->length - xfer->base) ? size : xfer->length - xfer->base);
+	bulk_read_put_chunk(data, xfer->chunk);
+	bulk_read_put_want(data, xfer->pending);
+	master_send_pack(xfer->slave_addr, len);
+
+	xfer->burst = xfer->pending;
+	xfer->pending = 0;
+	xfer->burst_count++;
+	xfer->time_last = LOCAL_TIME();
+	xfer->state = BULK_STATE_WAIT;
+}
+
+// Master sends the next chunk of write burst
+static void send_chunk(struct bulk_transfer* xfer)
+{
+	U8* data = get_pack_link()->send_data;
+	U16 len = bulk_data_init(data);
+	U8 index = lowest_chunk(xfer->pending);
+	U16 n = chunk_len(xfer->base, xfer->length, xfer->chunk, index);
+
+	xfer->pending &= ~((U32)1 << index);
+	xfer->burst |= (U32)1 << index;
+	// An urgent request cuts the burst short, the rest go in the next one
+	if (master_get_req_depth(PACK_PRIO_URGENT) > 0) {
+		xfer->pending = 0;
+	}
+
+	bulk_data_put_region(data, xfer->region);
+	bulk_data_put_base(data, xfer->offset + xfer->base);
+	bulk_data_put_chunk(data, xfer->chunk);
+	bulk_data_put_index(data, index);
+	bulk_data_put_flags(data, (xfer->pending == 0) ? BULK_FLAG_LAST : 0);
+	memcpy(data + len, xfer->buf + xfer->base + (U32)index * xfer->chunk, n);
+	master_send_pack(xfer->slave_addr, len + n);
+
+	// Wait for status after the last one
+	if (xfer->pending == 0) {
+		xfer->burst_count++;
+		xfer->state = BULK_STATE_WAIT;
+	}
+}
+
+// Master starts to read or write 'length' bytes of 'buf' at 'offset' of
+// 'region' of slave 'slave_addr' on the selected link, return false if the
+// transfer is running. Then bulk_poll() must be called periodically, and
+// every new package from slave must be passed to bulk_take(). Requests of
+// master_submit_pack() are sent between bursts, the transfer goes on after
+// them.
+bool bulk_start(struct bulk_transfer* xfer, pack_addr slave_addr, enum bulk_op_list op,
+                U8 region, U32 offset, U8* buf, U32 length, bulk_done_func func, void* arg)
+{
+	if (xfer->flag_busy || buf == NULL || length == 0) {
+		return false;
+	}
+
+	xfer->flag_busy = true;
+	xfer->op = op;
+	xfer->region = region;
+	xfer->slave_addr = slave_addr;
+	xfer->offset = offset;
+	xfer->buf = buf;
+	xfer->length = length;
+	xfer->base = 0;
+	xfer->chunk = BULK_CHUNK_LEN;
+	xfer->func = func;
+	xfer->arg = arg;
+	xfer->burst_count = 0;
+	start_window(xfer);
+
+	bulk_poll(xfer);
+
+	return true;
+}
+
+// Master sends the packages of transfer when the lower layer is ready, and
+// handles ack timeout of the link
+void bulk_poll(struct bulk_transfer* xfer)
+{
+	struct pack_link* link = get_pack_link();
+
+	if (!xfer->flag_busy) {
+		return;
+	}
+
+	if (xfer->state == BULK_STATE_SEND) {
+		// Requests of application go first, then the burst holds them on the
+		// bus till its end
+		if (!link->flag_req_hold) {
+			if ((master_get_req_depth(PACK_PRIO_URGENT) > 0) || (master_get_req_depth(PACK_PRIO_NORMAL) > 0)) {
+				return;
+			}
+			master_hold_req(true);
+		}
+
+		if (xfer->op == BULK_OP_READ) {
+			if (is_pack_tx_ready()) {
+				send_read(xfer);
+			}
+		} else {
+			// Packages of write burst go back to back
+			while ((xfer->state == BULK_STATE_SEND) && is_pack_tx_ready()) {
+				send_chunk(xfer);
+			}
+		}
+		return;
+	}
+
+	if (link->flag_master_need_ack) {
+		// Nothing is back, resend the read request or the last package of
+		// write burst, slave answers from cache if it's a duplicate
+		if (master_check_ack_delay() > BULK_MAX_RETRY) {
+			finish_transfer(xfer, BULK_TIMEOUT);
+		}
+	} else if ((xfer->op == BULK_OP_READ)
+	&& ((U32)(LOCAL_TIME() - xfer->time_last) > link->master_ack_delay)) {
+		// The stream stopped before its last package
+		end_burst(xfer, (xfer->done & xfer->burst) != 0);
+		bulk_poll(xfer);
+	}
+}
+
+// Master takes a new package from slave, return false if it's not bulk
+bool bulk_take(struct bulk_transfer* xfer, const void* data, U16 len)
+{
+	U8 index;
+	U32 bit;
+
+	if (bulk_status_check(data, len)) {
+		// Status of another window is stale
+		if (!xfer->flag_busy || (xfer->state != BULK_STATE_WAIT)
+		|| (bulk_status_get_base(data) != xfer->offset + xfer->base)) {
+			return true;
+		}
+		if (bulk_status_get_result(data) != BULK_OK) {
+			finish_transfer(xfer, BULK_REFUSED);
+			return true;
+		}
+		if (xfer->op == BULK_OP_WRITE) {
+			bit = bulk_status_get_done(data) & xfer->burst & ~xfer->done;
+			xfer->done |= bit;
+			xfer->burst = 0;
+			end_burst(xfer, bit != 0);
+			bulk_poll(xfer);
+		}
+		return true;
+	}
+
+	if (bulk_data_check(data, len)) {
+		if (!xfer->flag_busy || (xfer->op != BULK_OP_READ) || (xfer->state != BULK_STATE_WAIT)
+		|| (bulk_data_get_base(data) != xfer->offset + xfer->base)
+		|| (bulk_data_get_chunk(data) != xfer->chunk)) {
+			return true;
+		}
+		index = bulk_data_get_index(data);
+		if ((index >= xfer->window_count)
+		|| (len - MSG_LEN_bulk_data != chunk_len(xfer->base, xfer->length, xfer->chunk, index))) {
+			return true;
+		}
+
+		// Chunk goes to its place, a duplicate is copied again
+		memcpy(xfer->buf + xfer->base + (U32)index * xfer->chunk,
+		       (const U8*)data + MSG_LEN_bulk_data, len - MSG_LEN_bulk_data);
+		xfer->done |= (U32)1 << index;
+		xfer->time_last = LOCAL_TIME();
+
+		if ((bulk_data_get_flags(data) & BULK_FLAG_LAST)
+		|| (xfer->done == chunk_mask(xfer->window_count))) {
+			end_burst(xfer, (xfer->done & xfer->burst) != 0);
+			bulk_poll(xfer);
+		}
+		return true;
+	}
+
+	return false;
+}
+#endif
+
+// ============================ Slave Functions =============================
+// Slave acks with its status
+static void send_status(U8 result, U32 base, U32 done)
+{
+	U8* data = get_pack_link()->send_data;
+	U16 len = bulk_status_init(data);
+
+	bulk_status_put_result(data, result);
+	bulk_status_put_base(data, base);
+	bulk_status_put_done(data, done);
+	slave_send_pack(len);
+}
+
+// Slave initializes its state with memory access functions of application
+void bulk_slave_init(struct bulk_slave* slave, bulk_read_func read, bulk_write_func write)
+{
+	memset(slave, 0, sizeof(*slave));
+	slave->read = read;
+	slave->write = write;
+}
+
+// Slave takes a new request from master and answers it, return false if it's
+// not bulk, so application answers it instead
+bool bulk_slave_take(struct bulk_slave* slave, const void* data, U16 len)
+{
+	const U8* chunk_data = (const U8*)data + MSG_LEN_bulk_data;
+	U32 count;
+	U32 offset;
+	U16 chunk;
+	U8 index;
+
+	if (bulk_read_check(data, len)) {
+		chunk = bulk_read_get_chunk(data);
+		slave->read_region = bulk_read_get_region(data);
+		slave->read_base = bulk_read_get_base(data);
+		slave->read_length = bulk_read_get_length(data);
+		slave->read_chunk = chunk;
+		slave->read_want = 0;
+
+		// The window must fit in a bitmap, with chunks this slave can send
+		count = (chunk > 0) ? (slave->read_length + chunk - 1) / chunk : 0;
+		if ((chunk == 0) || (chunk > BULK_CHUNK_LEN) || (count == 0) || (count > BULK_WINDOW)
+		|| (slave->read == NULL)) {
+			send_status(BULK_REFUSED, slave->read_base, 0);
+			return true;
+		}
+		slave->read_want = bulk_read_get_want(data) & chunk_mask((U8)count);
+		if (slave->read_want == 0) {
+			send_status(BULK_OK, slave->read_base, 0);
+			return true;
+		}
+
+		bulk_slave_poll(slave);
+		return true;
+	}
+
+	if (bulk_data_check(data, len)) {
+		chunk = bulk_data_get_chunk(data);
+		index = bulk_data_get_index(data);
+		offset = bulk_data_get_base(data);
+
+		// A burst of another window starts again
+		if ((bulk_data_get_region(data) != slave->write_region) || (offset != slave->write_base)) {
+			slave->write_region = bulk_data_get_region(data);
+			slave->write_base = offset;
+			slave->write_done = 0;
+			slave->write_result = BULK_OK;
+		}
+
+		// A chunk that can't be written refuses the whole transfer
+		if ((index < BULK_WINDOW) && (len - MSG_LEN_bulk_data <= chunk)
+		&& (slave->write != NULL)
+		&& slave->write(slave->write_region, offset + (U32)index * chunk, chunk_data, len - MSG_LEN_bulk_data)) {
+			slave->write_done |= (U32)1 << index;
+		} else {
+			slave->write_result = BULK_REFUSED;
+		}
+
+		// Only the last package of burst is acked
+		if (bulk_data_get_flags(data) & BULK_FLAG_LAST) {
+			send_status(slave->write_result, slave->write_base, slave->write_done);
+			slave->write_done = 0;
+			slave->write_result = BULK_OK;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+// Slave streams the rest of read burst when the lower layer is ready, it's
+// needed with PACK_TX_ASYNC only
+void bulk_slave_poll(struct bulk_slave* slave)
+{
+	U8* data = get_pack_link()->send_data;
+	U16 len;
+	U16 n;
+	U8 index;
+
+	while ((slave->read_want != 0) && is_pack_tx_ready()) {
+		index = lowest_chunk(slave->read_want);
+		slave->read_want &= ~((U32)1 << index);
+		n = chunk_len(0, slave->read_length, slave->read_chunk, index);
+
+		// Chunk is read into sending buffer in place
+		len = bulk_data_init(data);
+		if (!slave->read(slave->read_region, slave->read_base + (U32)index * slave->read_chunk, data + len, n)) {
+			slave->read_want = 0;
+			send_status(BULK_REFUSED, slave->read_base, 0);
+			return;
+		}
+		bulk_data_put_region(data, slave->read_region);
+		bulk_data_put_base(data, slave->read_base);
+		bulk_data_put_chunk(data, slave->read_chunk);
+		bulk_data_put_index(data, index);
+		bulk_data_put_flags(data, (slave->read_want == 0) ? BULK_FLAG_LAST : 0);
+		slave_send_pack(len + n);
+	}
+}
@@ -0,0 +1,155 @@
+/* ==========================================================================
+ * bulk.h: Bulk Transfer of Slave Memory for Embedded Transport Protocol
+ *
+ * function:  1. Master reads or writes 'length' bytes at 'offset' of a
+ *               memory region of slave, e.g. a log or a calibration table.
+ *            2. Data is split into chunks of the longest data part, and
+ *               streamed in bursts of up to BULK_WINDOW packages, which pay
+ *               one turnaround of bus per burst instead of per package.
+ *            3. Every burst is acknowledged by one bitmap of the chunks
+ *               received, the missing chunks are sent again in the next
+ *               burst.
+ *            4. Master drives a transfer by polling, slave answers from
+ *               read and write functions of application.
+ *            5. Transfer runs behind asynchronous requests of master, which
+ *               go between bursts, and an urgent one cuts a write burst
+ *               short at the next package.
+ *
+ * protocol:  Messages of message.h with commands BULK_CMD_READ, BULK_CMD_DATA
+ *            and BULK_CMD_STATUS, which are reserved for bulk transfer.
+ *            Read: master sends a read request of a window with a bitmap
+ *               of chunks wanted, slave streams them as data packages with
+ *               the seqno of request, and marks the last one.
+ *            Write: master streams a burst of data packages, slave acks the
+ *               last one by a status with the bitmap of chunks received in
+ *               the burst. The ack timeout of the last package resends it,
+ *               and slave resends its status from cache.
+ * ======================================================================== */
+
+#ifndef _BULK_H
+#define _BULK_H
+
+#include "package.h"
+#include "message.h"
+
+// Maximum chunks in a window, which is one bitmap, 32 at most
+#define BULK_WINDOW 32
+// Bursts without progress before master gives up a transfer
+#define BULK_MAX_RETRY 8
+
+// Commands of bulk messages
+#define BULK_CMD_READ   0xB0
+#define BULK_CMD_DATA   0xB1
+#define BULK_CMD_STATUS 0xB2
+
+// Flags of data message
+#define BULK_FLAG_LAST 0x01 // The last package of burst
+
+// Read request of master, for chunks in 'want' of the window at 'base'
+#define BULK_READ_FIELDS(FIELD, msg) \
+	FIELD(msg, U8, region) FIELD(msg, U32, base) FIELD(msg, U32, length) \
+	FIELD(msg, U16, chunk) FIELD(msg, U32, want)
+DEFINE_MSG(bulk_read, BULK_CMD_READ, 1, BULK_READ_FIELDS)
+
+// Data of chunk 'index' of the window at 'base', the data follows the fields
+#define BULK_DATA_FIELDS(FIELD, msg) \
+	FIELD(msg, U8, region) FIELD(msg, U32, base) FIELD(msg, U16, chunk) \
+	FIELD(msg, U8, index) FIELD(msg, U8, flags)
+DEFINE_MSG(bulk_data, BULK_CMD_DATA, 1, BULK_DATA_FIELDS)
+
+// Status of slave, chunks of the window at 'base' received in the burst
+#define BULK_STATUS_FIELDS(FIELD, msg) \
+	FIELD(msg, U8, result) FIELD(msg, U32, base) FIELD(msg, U32, done)
+DEFINE_MSG(bulk_status, BULK_CMD_STATUS, 1, BULK_STATUS_FIELDS)
+
+// Longest chunk in a data message
+#define BULK_CHUNK_LEN (MAX_DATA_LEN - MSG_LEN_bulk_data)
+
+// Result of a transfer, and of status message
+enum bulk_result_list {
+	BULK_OK,        // All bytes are transferred
+	BULK_REFUSED,   // Slave refused the region or offset
+	BULK_TIMEOUT,   // Slave doesn't answer, or no progress in BULK_MAX_RETRY bursts
+
+	BULK_RESULT_TOTAL,
+};
+
+// Operation of transfer
+enum bulk_op_list {
+	BULK_OP_READ,   // Read memory of slave
+	BULK_OP_WRITE,  // Write memory of slave
+};
+
+struct bulk_transfer;
+
+// Function type of callback function for transfer completion
+typedef void (*bulk_done_func)(struct bulk_transfer* xfer, enum bulk_result_list result);
+
+// Function types of memory access of slave application, return false if the
+// region or the range is refused
+typedef bool (*bulk_read_func)(U8 region, U32 offset, U8* buf, U16 len);
+typedef bool (*bulk_write_func)(U8 region, U32 offset, const U8* buf, U16 len);
+
+// Transfer of master, owned by application
+struct bulk_transfer {
+	bool flag_busy;          // If the transfer is running
+	U8 op;                   // Operation, one of bulk_op_list
+	U8 state;                // State of transfer
+	U8 region;               // Memory region of slave
+	pack_addr slave_addr;    // Address of slave
+	U32 offset;              // Offset in region of the first byte
+	U8* buf;                 // Data read or written
+	U32 length;              // Length of data
+	U32 base;                // Position in data of the current window
+	U16 chunk;               // Length of chunk
+	U8 window_count;         // Chunks in the current window
+	U32 done;                // Chunks of window transferred
+	U32 pending;             // Chunks to ask or send in the next burst
+	U32 burst;               // Chunks asked or sent in the current burst
+	U32 time_last;           // The last point-in-time that data arrived
+	U8 retry_times;          // Bursts without progress
+	bulk_done_func func;     // Callback function for completion
+	void* arg;               // Argument of application
+	U32 burst_count;         // Bursts sent, for statistics
+};
+
+// State of slave, owned by application
+struct bulk_slave {
+	bulk_read_func read;     // Read function of application
+	bulk_write_func write;   // Write function of application
+	U8 write_region;         // Region of the write burst
+	U32 write_base;          // Window of the write burst
+	U32 write_done;          // Chunks received in the write burst
+	U8 write_result;         // Result of the write burst
+	U8 read_region;          // Region of the read stream
+	U32 read_base;           // Window of the read stream
+	U32 read_length;         // Length of the window of read stream
+	U16 read_chunk;          // Length of chunk of read stream
+	U32 read_want;           // Chunks of read stream not sent yet
+};
+
+// =========================== Interface Functions ==========================
+// Master starts to read or write 'length' bytes of 'buf' at 'offset' of
+// 'region' of slave 'slave_addr' on the selected link, return false if the
+// transfer is running. Then bulk_poll() must be called periodically, and
+// every new package from slave must be passed to bulk_take(). Requests of
+// master_submit_pack() are sent between bursts, the transfer goes on after
+// them.
+bool bulk_start(struct bulk_transfer* xfer, pack_addr slave_addr, enum bulk_op_list op,
+                U8 region, U32 offset, U8* buf, U32 length, bulk_done_func func, void* arg);
+// Master sends the packages of transfer when the lower layer is ready, and
+// handles ack timeout of the link
+void bulk_poll(struct bulk_transfer* xfer);
+// Master takes a new package from slave, return false if it's not bulk
+bool bulk_take(struct bulk_transfer* xfer, const void* data, U16 len);
+// Slave initializes its state with memory access functions of application
+void bulk_slave_init(struct bulk_slave* slave, bulk_read_func read, bulk_write_func write);
+// Slave takes a new request from master and answers it, return false if it's
+// not bulk, so application answers it instead
+bool bulk_slave_take(struct bulk_slave* slave, const void* data, U16 len);
+// Slave streams the rest of read burst when the lower layer is ready, it's
+// needed with PACK_TX_ASYNC only
+void bulk_slave_poll(struct bulk_slave* slave);
+
+
+#endif
@@ -0,0 +1,511 @@
+/* ==========================================================================
+ * gateway.c: Multi-bus Gateway Engine of Embedded Transport Protocol (Linux)
+ *
+ * function:  1. Hosts a master link for every bus, e.g. a RS-485 segment.
+ *            2. Buses are sharded across worker threads, every bus is
+ *               pinned to one worker, which waits on its own epoll loop.
+ *            3. Requests of application are routed to the worker that owns
+ *               the bus, and completed by callback in that worker.
+ *            4. Reports CPU load and package rate of every worker.
+ *            5. Optionally publishes statistics of every bus to shared
+ *               memory, with PACK_STATS and stats.c.
+ *
+ * build:     gcc -DPACK_CLOCK_EXTERN app.c gateway.c package.c trace.c -lpthread
+ * ======================================================================== */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "gateway.h"
+#if defined PACK_STATS
+	#include "stats.h"
+#endif
+
+// clock() counts CPU time of all threads on Linux, it can't time acks
+#if !defined PACK_CLOCK_EXTERN
+	#error "gateway.c needs PACK_CLOCK_EXTERN, LOCAL_TIME() is given by pack_local_time()"
+#endif
+
+// Size of receiving buffer of bus, holds a package and the bytes after it
+#define GATEWAY_RX_SIZE (MAX_FRAME_SIZE * 4)
+// Maximum events handled in a loop of worker
+#define GATEWAY_MAX_EVENTS 64
+
+struct gateway_shard;
+
+// Request waiting in the queue of bus
+struct gateway_req {
+	pack_addr dest_addr;   // Destination address
+	U16 data_len;          // Length of data part
+	U32 deadline;          // The point-in-time that request must be completed
+	pack_req_func func;    // Callback function for request completion
+	void* arg;             // Argument for callback function
+	U8 data[MAX_DATA_LEN]; // Data part
+};
+
+// Bus driven by a master link
+struct gateway_bus {
+	int fd;                        // File descriptor of bus
+	bool flag_closed;              // If the bus is closed by peer
+	struct pack_link link;         // Master link on the bus
+	struct gateway_shard* shard;   // Worker owning the bus
+	struct gateway_bus* next;      // Next bus of the same worker
+
+	struct gateway_req queue[GATEWAY_BUS_QUEUE_SIZE]; // Requests from application
+	U16 queue_head;                // Index of the first request in queue
+	U16 queue_count;               // Number of requests in queue
+
+	U16 index;                     // Bus number
+	U16 rx_len;                    // Length of bytes in receiving buffer
+	U8 rx_buf[GATEWAY_RX_SIZE];    // Receiving buffer
+};
+
+// Worker thread
+struct gateway_shard {
+	pthread_t thread;              // Thread of worker
+	U16 index;                     // Index of worker
+	int epoll_fd;                  // Epoll of worker
+	int event_fd;                  // Event to wake up worker for new requests
+	pthread_mutex_t lock;          // Lock of request queues and statistics
+	struct gateway_bus* buses;     // Buses owned by worker
+
+	U32 send_count;                // Packages sent, only written by worker
+	U32 recv_count;                // Packages received, only written by worker
+	struct gateway_shard_stat stat; // Statistics for application
+};
+
+// ============================ Static Variables ============================
+static struct gateway_bus* buses[GATEWAY_MAX_BUSES];      // All buses
+static U16 bus_count;                                     // Number of buses
+static struct gateway_shard shards[GATEWAY_MAX_SHARDS];   // All workers
+static U16 shard_count;                                   // Number of workers
+static volatile bool flag_running;                        // If workers are running
+static __thread struct gateway_bus* cur_bus;              // Bus handled by this worker
+#if defined PACK_STATS
+static struct stats_segment* stats_seg;                   // Segment of statistics, NULL if not exported
+#endif
+
+
+// =========================== Interface Functions ==========================
+// Monotonic local time in milliseconds, for LOCAL_TIME()
+U32 pack_local_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (U32)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+#if defined PACK_TIMESTAMP
+// Monotonic time in microseconds, for STAMP_TIME()
+U32 pack_stamp_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (U32)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+#endif
+
+// Get time of clock in seconds
+static double get_time(clockid_t clock_id)
+{
+	struct timespec ts;
+
+	clock_gettime(clock_id, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Callback function for sending bytes to the bus handled by this worker
+static void send_bytes(U8* buf, U16 count)
+{
+	ssize_t ret;
+
+	while (count > 0) {
+		ret = write(cur_bus->fd, buf, count);
+		if (ret <= 0) {
+			break;
+		}
+		buf += ret;
+		count -= (U16)ret;
+	}
+#if defined PACK_TX_ASYNC
+	// The bytes are in the kernel once write() returns
+	tx_complete();
+#endif
+	cur_bus->shard->send_count++;
+}
+
+// Check every complete package in receiving buffer of bus
+static void take_packs(struct gateway_bus* bus)
+{
+	enum pack_recv_type_list result;
+	U16 pos = 0;
+	U16 used;
+
+	// Skip line noise between packages
+	while (scan_pack(bus->rx_buf + pos, bus->rx_len - pos, &used, &result)) {
+		bus->shard->recv_count++;
+		pos += used;
+	}
+	pos += used;
+
+	// Keep the bytes not checked yet
+	bus->rx_len -= pos;
+	memmove(bus->rx_buf, bus->rx_buf + pos, bus->rx_len);
+}
+
+// Read bytes from bus and check the packages
+static void read_bus(struct gateway_bus* bus)
+{
+	ssize_t ret;
+
+	ret = read(bus->fd, bus->rx_buf + bus->rx_len, GATEWAY_RX_SIZE - bus->rx_len);
+	if (ret <= 0) {
+		// Stop watching the bus closed by peer
+		if (ret == 0) {
+			bus->flag_closed = true;
+			epoll_ctl(bus->shard->epoll_fd, EPOLL_CTL_DEL, bus->fd, NULL);
+		}
+		return;
+	}
+	bus->rx_len += (U16)ret;
+
+	take_packs(bus);
+}
+
+// Pass requests of application to the link of bus while its queue has space
+static void feed_link(struct gateway_bus* bus)
+{
+	struct gateway_shard* shard = bus->shard;
+	struct gateway_req req;
+
+	while (bus->link.req_count[PACK_PRIO_NORMAL] < MAX_REQ_QUEUE_SIZE) {
+		// Take the first request out of the queue
+		pthread_mutex_lock(&shard->lock);
+		if (bus->queue_count == 0) {
+			pthread_mutex_unlock(&shard->lock);
+			break;
+		}
+		req = bus->queue[bus->queue_head];
+		bus->queue_head = (bus->queue_head + 1) % GATEWAY_BUS_QUEUE_SIZE;
+		bus->queue_count--;
+		pthread_mutex_unlock(&shard->lock);
+
+		// Callback may be called at once, without the lock
+		master_submit_pack(req.dest_addr, req.data, req.data_len, req.deadline, req.func, req.arg);
+	}
+}
+
+// Update statistics of worker every second
+static void update_stat(struct gateway_shard* shard, double* last_time, double* last_cpu, U32* last_packs)
+{
+	double now = get_time(CLOCK_MONOTONIC);
+	double cpu;
+	U32 packs;
+
+	if (now - *last_time < 1.0) {
+		return;
+	}
+
+	cpu = get_time(CLOCK_THREAD_CPUTIME_ID);
+	packs = shard->send_count + shard->recv_count;
+
+	pthread_mutex_lock(&shard->lock);
+	shard->stat.send_count = shard->send_count;
+	shard->stat.recv_count = shard->recv_count;
+	shard->stat.cpu_load = (float)((cpu - *last_cpu) / (now - *last_time));
+	shard->stat.pack_rate = (float)((packs - *last_packs) / (now - *last_time));
+	pthread_mutex_unlock(&shard->lock);
+
+	*last_time = now;
+	*last_cpu = cpu;
+	*last_packs = packs;
+}
+
+// Loop of worker thread
+static void* shard_main(void* arg)
+{
+	struct gateway_shard* shard = arg;
+	struct epoll_event events[GATEWAY_MAX_EVENTS];
+	struct gateway_bus* bus;
+	double last_time = get_time(CLOCK_MONOTONIC);
+	double last_cpu = get_time(CLOCK_THREAD_CPUTIME_ID);
+	U32 last_packs = 0;
+#if defined PACK_STATS
+	U32 stats_time_last = pack_local_time();
+	bool flag_publish;
+#endif
+	uint64_t value;
+	int count;
+	int i;
+
+	while (flag_running) {
+		count = epoll_wait(shard->epoll_fd, events, GATEWAY_MAX_EVENTS, GATEWAY_TICK);
+
+		// Read the buses with bytes arrived
+		for (i = 0; i < count; i++) {
+			bus = events[i].data.ptr;
+			if (bus == NULL) {
+				// New requests, they are fed below
+				if (read(shard->event_fd, &value, sizeof(value)) < 0) {
+					continue;
+				}
+			} else {
+				cur_bus = bus;
+				select_pack_link(&bus->link);
+				read_bus(bus);
+			}
+		}
+
+#if defined PACK_STATS
+		// Buses are published by their worker, without lock
+		flag_publish = (stats_seg != NULL)
+		&& (pack_local_time() - stats_time_last >= GATEWAY_STATS_PERIOD);
+		if (flag_publish) {
+			stats_time_last = pack_local_time();
+		}
+#endif
+
+		// Feed requests, and handle ack timeout and deadline of every bus
+		for (bus = shard->buses; bus != NULL; bus = bus->next) {
+			cur_bus = bus;
+			select_pack_link(&bus->link);
+			feed_link(bus);
+			master_poll_pack();
+#if defined PACK_STATS
+			if (flag_publish) {
+				stats_publish(stats_seg, bus->index);
+			}
+#endif
+		}
+
+		update_stat(shard, &last_time, &last_cpu, &last_packs);
+	}
+
+	return NULL;
+}
+
+// Add a bus with file descriptor 'fd', the gateway is master on it with
+// address 'master_addr', return the bus number or -1 if failed. Buses must
+// be added before gateway_start(), they are spread evenly over workers.
+int gateway_add_bus(int fd, pack_addr master_addr, U32 max_ack_delay)
+{
+	struct gateway_bus* bus;
+
+	if (flag_running || bus_count >= GATEWAY_MAX_BUSES) {
+		return -1;
+	}
+
+	bus = calloc(1, sizeof(struct gateway_bus));
+	if (bus == NULL) {
+		return -1;
+	}
+	bus->fd = fd;
+	bus->index = bus_count;
+
+	// Initialize the master link of bus
+	select_pack_link(&bus->link);
+	master_init_pack(master_addr, max_ack_delay, send_bytes);
+	select_pack_link(NULL);
+
+	buses[bus_count] = bus;
+
+	return bus_count++;
+}
+
+// Release epoll, event and lock of the first 'count' workers
+static void release_shards(U16 count)
+{
+	U16 i;
+
+	for (i = 0; i < count; i++) {
+		if (shards[i].epoll_fd >= 0) {
+			close(shards[i].epoll_fd);
+		}
+		if (shards[i].event_fd >= 0) {
+			close(shards[i].event_fd);
+		}
+		pthread_mutex_destroy(&shards[i].lock);
+	}
+}
+
+// Start 'shard_count' worker threads, return false if failed. Nothing of
+// workers is left if failed, the buses stay for another try.
+bool gateway_start(U16 count)
+{
+	struct gateway_shard* shard;
+	struct epoll_event event;
+	struct gateway_bus* bus;
+	cpu_set_t cpus;
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	U16 created = 0;
+	U16 i;
+
+	if (flag_running || count < 1 || count > GATEWAY_MAX_SHARDS) {
+		return false;
+	}
+
+	// Create epoll and event of workers
+	for (i = 0; i < count; i++) {
+		shard = &shards[i];
+		memset(shard, 0, sizeof(*shard));
+		shard->index = i;
+		shard->epoll_fd = epoll_create1(0);
+		shard->event_fd = eventfd(0, EFD_NONBLOCK);
+		pthread_mutex_init(&shard->lock, NULL);
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		if (shard->epoll_fd < 0 || shard->event_fd < 0
+		|| epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->event_fd, &event) < 0) {
+			release_shards(i + 1);
+			return false;
+		}
+	}
+
+	// Pin every bus to a worker in turn
+	for (i = 0; i < bus_count; i++) {
+		bus = buses[i];
+		shard = &shards[i % count];
+		bus->shard = shard;
+		bus->next = shard->buses;
+		shard->buses = bus;
+		shard->stat.bus_count++;
+		event.events = EPOLLIN;
+		event.data.ptr = bus;
+		if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, bus->fd, &event) < 0) {
+			release_shards(count);
+			return false;
+		}
+	}
+
+	// Start workers, each on its own CPU if there are enough
+	flag_running = true;
+	for (i = 0; i < count; i++) {
+		shard = &shards[i];
+		if (pthread_create(&shard->thread, NULL, shard_main, shard) != 0) {
+			break;
+		}
+		created++;
+		if (cpu_count > 0) {
+			CPU_ZERO(&cpus);
+			CPU_SET(i % cpu_count, &cpus);
+			pthread_setaffinity_np(shard->thread, sizeof(cpus), &cpus);
+		}
+	}
+	if (created < count) {
+		flag_running = false;
+		for (i = 0; i < created; i++) {
+			pthread_join(shards[i].thread, NULL);
+		}
+		release_shards(count);
+		return false;
+	}
+	shard_count = count;
+
+	return true;
+}
+
+// Submit a asynchronous request to the slave 'dest_addr' on 'bus', the
+// callback is called in the worker thread of the bus, return false if the
+// queue of bus is full. Deadline is in milliseconds of pack_local_time().
+bool gateway_submit(int bus_no, pack_addr dest_addr, const void* data, U16 data_len,
+                    U32 deadline, pack_req_func func, void* arg)
+{
+	struct gateway_bus* bus;
+	struct gateway_req* req;
+	uint64_t value = 1;
+
+	if (!flag_running || bus_no < 0 || bus_no >= bus_count
+	|| data_len < 1 || data_len > MAX_DATA_LEN) {
+		return false;
+	}
+	bus = buses[bus_no];
+
+	// Append the request to the queue of bus
+	pthread_mutex_lock(&bus->shard->lock);
+	if (bus->queue_count >= GATEWAY_BUS_QUEUE_SIZE) {
+		pthread_mutex_unlock(&bus->shard->lock);
+		return false;
+	}
+	req = &bus->queue[(bus->queue_head + bus->queue_count) % GATEWAY_BUS_QUEUE_SIZE];
+	req->dest_addr = dest_addr;
+	req->data_len = data_len;
+	req->deadline = deadline;
+	req->func = func;
+	req->arg = arg;
+	memcpy(req->data, data, data_len);
+	bus->queue_count++;
+	pthread_mutex_unlock(&bus->shard->lock);
+
+	// Wake up the worker
+	return write(bus->shard->event_fd, &value, sizeof(value)) == sizeof(value);
+}
+
+#if defined PACK_STATS
+// Publish statistics of buses to shared-memory segment 'name' of stats.h,
+// slot n for bus n, with 'max_peers' slaves each, return false if failed.
+// It must be called after buses are added, before gateway_start().
+bool gateway_export_stats(const char* name, U16 max_peers)
+{
+	if (flag_running || stats_seg != NULL) {
+		return false;
+	}
+
+	stats_seg = stats_create(name, bus_count, max_peers);
+
+	return stats_seg != NULL;
+}
+#endif
+
+// Get statistics of a worker thread
+void gateway_get_shard_stat(U16 shard, struct gateway_shard_stat* stat)
+{
+	if (shard >= shard_count) {
+		memset(stat, 0, sizeof(*stat));
+		return;
+	}
+
+	pthread_mutex_lock(&shards[shard].lock);
+	*stat = shards[shard].stat;
+	pthread_mutex_unlock(&shards[shard].lock);
+}
+
+// Stop all worker threads, and free the buses and the rest of gateway, so
+// buses can be added again. File descriptors of buses are left to the
+// application, requests not completed yet are dropped without callback.
+void gateway_stop(void)
+{
+	U16 i;
+
+	if (flag_running) {
+		flag_running = false;
+		for (i = 0; i < shard_count; i++) {
+			pthread_join(shards[i].thread, NULL);
+		}
+		release_shards(shard_count);
+		shard_count = 0;
+	}
+
+	for (i = 0; i < bus_count; i++) {
+		free(buses[i]);
+		buses[i] = NULL;
+	}
+	bus_count = 0;
+
+#if defined PACK_STATS
+	if (stats_seg != NULL) {
+		stats_detach(stats_seg);
+		stats_seg = NULL;
+	}
+#endif
+}
@@ -0,0 +1,69 @@
+/* ==========================================================================
+ * gateway.h: Multi-bus Gateway Engine of Embedded Transport Protocol (Linux)
+ *
+ * function:  1. Hosts a master link for every bus, e.g. a RS-485 segment.
+ *            2. Buses are sharded across worker threads, every bus is
+ *               pinned to one worker, which waits on its own epoll loop.
+ *            3. Requests of application are routed to the worker that owns
+ *               the bus, and completed by callback in that worker.
+ *            4. Reports CPU load and package rate of every worker.
+ *            5. Optionally publishes statistics of every bus to shared
+ *               memory, with PACK_STATS and stats.c.
+ *
+ * build:     gcc -DPACK_CLOCK_EXTERN app.c gateway.c package.c trace.c -lpthread
+ * ======================================================================== */
+
+#ifndef _GATEWAY_H
+#define _GATEWAY_H
+
+#include "package.h"
+
+// Maximum number of worker threads
+#define GATEWAY_MAX_SHARDS 64
+// Maximum number of buses
+#define GATEWAY_MAX_BUSES 1024
+// Maximum number of requests waiting for each bus, besides the requests
+// in the queue of its link
+#define GATEWAY_BUS_QUEUE_SIZE 8
+// Period of polling links in milliseconds, for ack timeout and deadline
+#define GATEWAY_TICK 1
+// Period of publishing statistics of buses in milliseconds
+#define GATEWAY_STATS_PERIOD 100
+
+// Statistics of a worker thread
+struct gateway_shard_stat {
+	U16 bus_count;     // Number of buses owned
+	U32 send_count;    // Total packages sent
+	U32 recv_count;    // Total packages received
+	float cpu_load;    // CPU time of worker per wall time in the last second
+	float pack_rate;   // Packages sent and received per second in the last second
+};
+
+// =========================== Interface Functions ==========================
+// Add a bus with file descriptor 'fd', the gateway is master on it with
+// address 'master_addr', return the bus number or -1 if failed. Buses must
+// be added before gateway_start(), they are spread evenly over workers.
+int gateway_add_bus(int fd, pack_addr master_addr, U32 max_ack_delay);
+// Start 'shard_count' worker threads, return false if failed. Nothing of
+// workers is left if failed, the buses stay for another try.
+bool gateway_start(U16 shard_count);
+// Submit a asynchronous request to the slave 'dest_addr' on 'bus', the
+// callback is called in the worker thread of the bus, return false if the
+// queue of bus is full. Deadline is in milliseconds of pack_local_time().
+bool gateway_submit(int bus, pack_addr dest_addr, const void* data, U16 data_len,
+                    U32 deadline, pack_req_func func, void* arg);
+#if defined PACK_STATS
+// Publish statistics of buses to shared-memory segment 'name' of stats.h,
+// slot n for bus n, with 'max_peers' slaves each, return false if failed.
+// It must be called after buses are added, before gateway_start().
+bool gateway_export_stats(const char* name, U16 max_peers);
+#endif
+// Get statistics of a worker thread
+void gateway_get_shard_stat(U16 shard, struct gateway_shard_stat* stat);
+// Stop all worker threads, and free the buses and the rest of gateway, so
+// buses can be added again. File descriptors of buses are left to the
+// application, requests not completed yet are dropped without callback.
+void gateway_stop(void);
+
+
+#endif
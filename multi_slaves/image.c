@@ -0,0 +1,301 @@
+/* ==========================================================================
+ * image.c: Cyclic Process Image of Embedded Transport Protocol
+ *
+ * function:  1. Application declares a process image, an output region and
+ *               an input region for each slave, instead of a message stream.
+ *            2. Master scans all slaves at a fixed period, each exchange
+ *               sends the outputs of a slave and takes its inputs back.
+ *            3. Every region is double-buffered, the writer publishes a new
+ *               snapshot without lock or waiting, readers copy the latest
+ *               one, and retry only if a snapshot is published meanwhile.
+ *            4. Slave takes the outputs and answers with its inputs, without
+ *               application on the path of the exchange.
+ *            5. Scan runs by asynchronous requests of normal class, urgent
+ *               requests of application still jump the queue.
+ * ======================================================================== */
+
+#include <string.h>
+#include "image.h"
+
+// Keep the order of memory access between snapshot number and buffers, x86
+// never reorders stores with stores or loads with loads
+#if defined X86 && defined __GNUC__
+	#define IMAGE_BARRIER() __asm__ __volatile__("" ::: "memory")
+#elif defined __GNUC__
+	#define IMAGE_BARRIER() __sync_synchronize()
+#else
+	#define IMAGE_BARRIER()
+#endif
+
+// ============================ Region Functions ============================
+// Initialize region 'buf' of 'len' bytes with IMAGE_BUFFER_SIZE(len) bytes
+// of 'data', the region reads as zero until the first snapshot
+void image_buffer_init(struct image_buffer* buf, U8* data, U16 len)
+{
+	buf->seq = 0;
+	buf->len = len;
+	buf->data = data;
+	memset(data, 0, IMAGE_BUFFER_SIZE(len));
+}
+
+// Publish a snapshot of the region from 'src', only one thread may write a
+// region, it never waits for readers
+void image_write(struct image_buffer* buf, const void* src)
+{
+	U32 seq = buf->seq;
+
+	// Fill the buffer that readers don't use, then make it the latest
+	memcpy(buf->data + ((seq + 1) & 1) * buf->len, src, buf->len);
+	IMAGE_BARRIER();
+	buf->seq = seq + 1;
+}
+
+// Copy the latest snapshot of the region to 'dst', return the number of
+// the snapshot, 0 if none yet, so a reader can tell a new one
+U32 image_read(const struct image_buffer* buf, void* dst)
+{
+	U32 seq;
+
+	// The buffer is reused by the publish after the next, so the copy is
+	// only torn if a snapshot is published while copying
+	do {
+		seq = buf->seq;
+		IMAGE_BARRIER();
+		memcpy(dst, buf->data + (seq & 1) * buf->len, buf->len);
+		IMAGE_BARRIER();
+	} while (buf->seq != seq);
+
+	return seq;
+}
+
+// Initialize a slave in process image, with the regions of 'output_len' and
+// 'input_len' bytes in 'output_data' and 'input_data' of IMAGE_BUFFER_SIZE()
+// bytes each
+void image_slave_init(struct image_slave* slave, pack_addr slave_addr,
+                      U8* output_data, U16 output_len, U8* input_data, U16 input_len)
+{
+	memset(slave, 0, sizeof(*slave));
+	slave->slave_addr = slave_addr;
+	image_buffer_init(&slave->output, output_data, output_len);
+	image_buffer_init(&slave->input, input_data, input_len);
+}
+
+// ============================ Master Functions ============================
+#if !defined PACK_ROLE_SLAVE
+static void feed_cycle(struct image_scan* scan);
+
+// Complete the cycle when every exchange submitted is done, and the rest
+// are not going to be submitted
+static void check_cycle(struct image_scan* scan)
+{
+	if ((scan->done < scan->next) || (scan->flag_running && (scan->next < scan->slave_count))) {
+		return;
+	}
+
+	scan->flag_cycle_busy = false;
+	scan->cycle_time = (U32)(LOCAL_TIME() - scan->cycle_start);
+	if (scan->cycle_time > scan->cycle_time_max) {
+		scan->cycle_time_max = scan->cycle_time;
+	}
+	if (scan->cycle_time > scan->period) {
+		scan->overrun_count++;
+	}
+}
+
+// Callback function for exchange completion, the inputs are published if
+// they answer the outputs of this cycle
+static void finish_exchange(pack_addr dest_addr, enum pack_req_result_list result,
+                            const void* data, U16 data_len, void* arg)
+{
+	struct image_slave* slave = arg;
+	struct image_scan* scan = slave->scan;
+
+	if ((result == PACK_REQ_ACK) && image_input_check(data, data_len)
+	&& (image_input_get_cycle(data) == scan->cycle_count)
+	&& (data_len - MSG_LEN_image_input == slave->input.len)) {
+		image_write(&slave->input, (const U8*)data + MSG_LEN_image_input);
+		slave->cycle_last = scan->cycle_count;
+		slave->exchange_count++;
+	} else {
+		slave->fail_count++;
+		// The exchange in flight is given up at the end of cycle, but it
+		// may still be answered
+		if (dest_addr == get_pack_link()->master_send_addr_last) {
+			scan->flag_guard = true;
+		}
+	}
+
+	// The slot of request is free, the next exchange goes at once, unless
+	// this completes in the submitting of feed_cycle(), which goes on itself
+	scan->done++;
+	feed_cycle(scan);
+}
+
+// Check if the end of the current cycle is reached
+static bool cycle_expired(const struct image_scan* scan)
+{
+	return (U32)((U32)LOCAL_TIME() - (scan->cycle_start + scan->period)) < 0x80000000UL;
+}
+
+// Submit the exchanges of cycle while the queue of requests has room, they
+// expire at the end of period. A submit may complete exchanges at once, their
+// callbacks don't submit again, so the stack doesn't grow with slave count.
+static void feed_cycle(struct image_scan* scan)
+{
+	U8 data[MAX_DATA_LEN];
+	struct image_slave* slave;
+	U16 len;
+
+	if (scan->flag_feeding) {
+		return;
+	}
+	scan->flag_feeding = true;
+
+	while (scan->flag_running && scan->flag_cycle_busy && (scan->next < scan->slave_count)) {
+		// The rest of cycle fails without a request, they would be timeout
+		// at once
+		if (cycle_expired(scan)) {
+			while (scan->next < scan->slave_count) {
+				scan->slaves[scan->next].fail_count++;
+				scan->next++;
+				scan->done++;
+			}
+			break;
+		}
+
+		slave = &scan->slaves[scan->next];
+		len = image_output_init(data);
+		image_output_put_cycle(data, scan->cycle_count);
+		image_read(&slave->output, data + len);
+
+		// An ack may complete in the sending, so the slave is taken first
+		scan->next++;
+		if (!master_submit_pack(slave->slave_addr, data, len + slave->output.len,
+		                        scan->cycle_start + scan->period, finish_exchange, slave)) {
+			scan->next--;
+			break;
+		}
+	}
+
+	scan->flag_feeding = false;
+	if (scan->flag_cycle_busy) {
+		check_cycle(scan);
+	}
+}
+
+// Master starts to scan 'slave_count' slaves in 'slaves' every 'period' of
+// local time on the selected link, return false if the scan is busy, or a
+// region is longer than IMAGE_MAX_REGION_LEN
+bool image_start(struct image_scan* scan, struct image_slave* slaves, U16 slave_count, U32 period)
+{
+	U16 i;
+
+	if (scan->flag_running || scan->flag_cycle_busy || (slaves == NULL) || (slave_count == 0) || (period == 0)) {
+		return false;
+	}
+	for (i = 0; i < slave_count; i++) {
+		if ((slaves[i].output.len > IMAGE_MAX_REGION_LEN) || (slaves[i].input.len > IMAGE_MAX_REGION_LEN)) {
+			return false;
+		}
+		slaves[i].scan = scan;
+	}
+
+	scan->flag_running = true;
+	scan->flag_guard = false;
+	scan->flag_feeding = false;
+	scan->slaves = slaves;
+	scan->slave_count = slave_count;
+	scan->next = 0;
+	scan->done = 0;
+	scan->period = period;
+	scan->cycle_count = 0;
+	scan->cycle_time = 0;
+	scan->cycle_time_max = 0;
+	scan->overrun_count = 0;
+
+	image_poll(scan);
+
+	return true;
+}
+
+// Master stops the scan after the exchanges in queue
+void image_stop(struct image_scan* scan)
+{
+	scan->flag_running = false;
+	if (scan->flag_cycle_busy) {
+		check_cycle(scan);
+	}
+}
+
+// Master starts the cycle when its period is due, and feeds the exchanges of
+// cycle to the queue of requests
+void image_poll(struct image_scan* scan)
+{
+	struct pack_link* link = get_pack_link();
+	U32 now = LOCAL_TIME();
+
+	if (!scan->flag_running) {
+		return;
+	}
+
+	if (!scan->flag_cycle_busy) {
+		// Keep the bus clear for the ack of a given up exchange
+		if (scan->flag_guard) {
+			if ((U32)(now - link->master_send_time_last) <= link->master_ack_delay) {
+				return;
+			}
+			scan->flag_guard = false;
+		}
+
+		// Cycles start on a grid of period, a cycle later than a period
+		// starts a new grid
+		if (scan->cycle_count == 0) {
+			scan->cycle_start = now;
+		} else if ((U32)(now - scan->cycle_start) >= scan->period) {
+			scan->cycle_start += scan->period;
+			if ((U32)(now - scan->cycle_start) >= scan->period) {
+				scan->cycle_start = now;
+			}
+		} else {
+			return;
+		}
+		scan->flag_cycle_busy = true;
+		scan->cycle_count++;
+		scan->next = 0;
+		scan->done = 0;
+	}
+
+	feed_cycle(scan);
+}
+#endif
+
+// ============================= Slave Functions ============================
+// Slave takes a new request from master and answers it with its inputs,
+// return false if it's not an image message, so application answers it
+bool image_slave_take(struct image_slave* slave, const void* data, U16 len)
+{
+	U8* send = get_pack_link()->send_data;
+	U32 cycle;
+	U16 send_len;
+
+	if (!image_output_check(data, len)) {
+		return false;
+	}
+
+	// Outputs of another length are not taken, the inputs are answered
+	cycle = image_output_get_cycle(data);
+	if (len - MSG_LEN_image_output == slave->output.len) {
+		image_write(&slave->output, (const U8*)data + MSG_LEN_image_output);
+		slave->cycle_last = cycle;
+		slave->exchange_count++;
+	} else {
+		slave->fail_count++;
+	}
+
+	send_len = image_input_init(send);
+	image_input_put_cycle(send, cycle);
+	image_read(&slave->input, send + send_len);
+	slave_send_pack(send_len + slave->input.len);
+
+	return true;
+}
@@ -0,0 +1,119 @@
+/* ==========================================================================
+ * image.h: Cyclic Process Image of Embedded Transport Protocol
+ *
+ * function:  1. Application declares a process image, an output region and
+ *               an input region for each slave, instead of a message stream.
+ *            2. Master scans all slaves at a fixed period, each exchange
+ *               sends the outputs of a slave and takes its inputs back.
+ *            3. Every region is double-buffered, the writer publishes a new
+ *               snapshot without lock or waiting, readers copy the latest
+ *               one, and retry only if a snapshot is published meanwhile.
+ *            4. Slave takes the outputs and answers with its inputs, without
+ *               application on the path of the exchange.
+ *            5. Scan runs by asynchronous requests of normal class, urgent
+ *               requests of application still jump the queue.
+ *
+ * protocol:  Messages of message.h with commands IMAGE_CMD_OUTPUT and
+ *            IMAGE_CMD_INPUT, which are reserved for process image.
+ *            Master sends the outputs of slave with the number of cycle,
+ *            slave acks with its inputs and the same number. The request
+ *            expires at the end of cycle, so stale outputs are never sent.
+ * ======================================================================== */
+
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+#include "package.h"
+#include "message.h"
+
+// Commands of image messages
+#define IMAGE_CMD_OUTPUT 0xC0
+#define IMAGE_CMD_INPUT  0xC1
+
+// Outputs of slave in cycle 'cycle', the data follows the fields
+#define IMAGE_OUTPUT_FIELDS(FIELD, msg) FIELD(msg, U32, cycle)
+DEFINE_MSG(image_output, IMAGE_CMD_OUTPUT, 1, IMAGE_OUTPUT_FIELDS)
+
+// Inputs of slave for the outputs of cycle 'cycle', the data follows the fields
+#define IMAGE_INPUT_FIELDS(FIELD, msg) FIELD(msg, U32, cycle)
+DEFINE_MSG(image_input, IMAGE_CMD_INPUT, 1, IMAGE_INPUT_FIELDS)
+
+// Longest region of a slave
+#define IMAGE_MAX_REGION_LEN (MAX_DATA_LEN - MSG_LEN_image_output)
+
+// Bytes of memory of a region of 'len' bytes, for the 2 buffers
+#define IMAGE_BUFFER_SIZE(len) (2 * (len))
+
+// Double-buffered region, one writer and any readers. Snapshot 'seq' is in
+// buffer (seq & 1), the writer fills the other buffer and publishes it by
+// incrementing 'seq', so a reader is only disturbed by the next publish.
+struct image_buffer {
+	volatile U32 seq;        // Snapshots published, 0 if none yet
+	U16 len;                 // Length of region
+	U8* data;                // IMAGE_BUFFER_SIZE(len) bytes of application
+};
+
+// Slave in process image, master has one for every slave, and a slave has
+// one for itself. Outputs go from master to slave, inputs from slave back.
+struct image_slave {
+	pack_addr slave_addr;    // Address of slave
+	struct image_buffer output; // Outputs of slave
+	struct image_buffer input;  // Inputs of slave
+	U32 cycle_last;          // Cycle of the last exchange
+	U32 exchange_count;      // Exchanges done
+	U32 fail_count;          // Exchanges failed, inputs are kept
+	struct image_scan* scan; // Scan of master
+};
+
+// Scan of master, owned by application
+struct image_scan {
+	bool flag_running;       // If the scan is running
+	bool flag_cycle_busy;    // If the current cycle is not done
+	bool flag_guard;         // If the next cycle waits for the ack timeout of a given up exchange
+	bool flag_feeding;       // If exchanges are being submitted, completions don't submit again
+	struct image_slave* slaves; // Slaves in process image
+	U16 slave_count;         // Number of slaves
+	U16 next;                // The next slave to submit in cycle
+	U16 done;                // Exchanges completed in cycle
+	U32 period;              // Period of cycle in local time
+	U32 cycle_start;         // The point-in-time that the current cycle started
+	U32 cycle_count;         // Cycles started
+	U32 cycle_time;          // Time of the last cycle
+	U32 cycle_time_max;      // Maximum time of cycle
+	U32 overrun_count;       // Cycles not done in the period
+};
+
+// =========================== Interface Functions ==========================
+// Initialize region 'buf' of 'len' bytes with IMAGE_BUFFER_SIZE(len) bytes
+// of 'data', the region reads as zero until the first snapshot
+void image_buffer_init(struct image_buffer* buf, U8* data, U16 len);
+// Publish a snapshot of the region from 'src', only one thread may write a
+// region, it never waits for readers
+void image_write(struct image_buffer* buf, const void* src);
+// Copy the latest snapshot of the region to 'dst', return the number of
+// the snapshot, 0 if none yet, so a reader can tell a new one
+U32 image_read(const struct image_buffer* buf, void* dst);
+// Initialize a slave in process image, with the regions of 'output_len' and
+// 'input_len' bytes in 'output_data' and 'input_data' of IMAGE_BUFFER_SIZE()
+// bytes each
+void image_slave_init(struct image_slave* slave, pack_addr slave_addr,
+                      U8* output_data, U16 output_len, U8* input_data, U16 input_len);
+
+// Master starts to scan 'slave_count' slaves in 'slaves' every 'period' of
+// local time on the selected link, return false if the scan is busy, or a
+// region is longer than IMAGE_MAX_REGION_LEN. Then image_poll() must be
+// called periodically, every tick of local time for a steady period.
+bool image_start(struct image_scan* scan, struct image_slave* slaves, U16 slave_count, U32 period);
+// Master stops the scan after the exchanges in queue, the scan can't start
+// again till they complete
+void image_stop(struct image_scan* scan);
+// Master starts the cycle when its period is due, and feeds the exchanges of
+// cycle to the queue of requests. master_poll_pack() must be called too, for
+// ack timeout and deadline of exchanges.
+void image_poll(struct image_scan* scan);
+// Slave takes a new request from master and answers it with its inputs,
+// return false if it's not an image message, so application answers it
+bool image_slave_take(struct image_slave* slave, const void* data, U16 len);
+
+
+#endif
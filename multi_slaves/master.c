@@ -89,6 +89,7 @@ void print_pack_count_info()
 
 	printf("PACK_SEND_NEW:         %u\n", pack_count_info->send_pack_count[PACK_SEND_NEW]);
 	printf("PACK_SEND_RETRY:       %u\n", pack_count_info->send_pack_count[PACK_SEND_RETRY]);
+	printf("PACK_SEND_FAST_RETRY:  %u\n", pack_count_info->send_pack_count[PACK_SEND_FAST_RETRY]);
 	putchar('\n');
 	printf("PACK_RECV_NEW:         %u\n", pack_count_info->recv_pack_count[PACK_RECV_NEW]);
 	printf("PACK_RECV_RETRY:       %u\n", pack_count_info->recv_pack_count[PACK_RECV_RETRY]);
@@ -119,7 +120,7 @@ int main(void)
 	fd = fopen(FILE_FOR_RECV, "w");
 	fclose(fd);
 
-	U8 dest_addr;
+	pack_addr dest_addr;
 
 	// Initialize protocol
 	master_init_pack(100, 7000, send_bytes);
@@ -149,10 +150,10 @@ int main(void)
 			if (check_result == PACK_RECV_NEW) {
 				// Print the package
 				printf("<Master Recv> dest: %d, src: %d, seqno: %d, len: %d, cmd: %c, data: %c\n",
-				((struct pack_header*)recv_buf)->dest,
-				((struct pack_header*)recv_buf)->src,
-				((struct pack_header*)recv_buf)->seqno,
-				((struct pack_header*)recv_buf)->len,
+				get_pack_addr(((struct pack_header*)recv_buf)->dest),
+				get_pack_addr(((struct pack_header*)recv_buf)->src),
+				get_pack_seqno(((struct pack_header*)recv_buf)->seqno),
+				get_pack_u16(((struct pack_header*)recv_buf)->len),
 				data_recv->cmd,
 				data_recv->cmd_data[0]);
 			}
@@ -11,53 +11,111 @@
  *            6. Support variable-length data part.
  *            7. Application can define their own data structure.
  *            8. Statistics for every sent and received package.
+ *            9. Asynchronous requests of master with completion callbacks,
+ *               in priority classes, urgent ones jump the queue.
+ *           10. Slave answers duplicate requests from its cache of recent acks.
+ *           11. Trace of every sent and received package.
+ *           12. Reentrant, a process can drive many links, one per thread.
+ *           13. Resynchronizes on the next package after line noise.
+ *           14. Optional COBS framing with unambiguous frame boundaries.
+ *           15. Optional forward error correction of received packages.
+ *           16. Fast resend of master on stale acks, before ack timeout.
+ *           17. Airtime model of bus, for ack timeout by package size, bus
+ *               load and airtime budgets of slaves.
+ *           18. Optional asynchronous sending with 2 buffers, for DMA or
+ *               interrupt-driven lower layer.
+ *           19. Master repeats a package with new header in constant time,
+ *               by patching the checksum incrementally.
+ *           20. Optional 16-bit addresses, and a hashed peer table of master
+ *               for the state of thousands of slaves.
+ *           21. Seqno compared by serial number arithmetic, slave drops
+ *               delayed duplicates, optional 32-bit seqno.
+ *           22. Optional histogram of ack delay, and statistics published
+ *               to shared memory for monitoring tools.
+ *           23. Optional timestamps in packages, master estimates clock
+ *               offset of slaves NTP-like, and splits round-trip time into
+ *               wire time and service time of slave.
+ *           24. Optional compact header for short data, negotiated with
+ *               each slave, both formats are accepted.
  * ======================================================================== */
 
 #include <stdio.h>
 #include <string.h>
 #include "package.h"
+#if defined PACK_TRACE
+	#include "trace.h"
+#endif
+#if defined PACK_FRAMING_COBS
+	#include "cobs.h"
+#endif
+#if defined PACK_FEC
+	#include "fec.h"
+#endif
+
+// Record a event to trace ring if it's enabled
+#if defined PACK_TRACE
+	#define TRACE_PACK(type, verdict, buf, len) \
+		if (cur_link->trace != NULL) { \
+			trace_pack(cur_link->trace, type, verdict, buf, len); \
+		}
+#else
+	#define TRACE_PACK(type, verdict, buf, len)
+#endif
+
+// Role of the machine, resolved at compile time if it is defined
+#if defined PACK_ROLE_MASTER
+	#define IS_MASTER (true)
+#elif defined PACK_ROLE_SLAVE
+	#define IS_MASTER (false)
+#else
+	#define IS_MASTER (cur_link->flag_is_master)
+#endif
+
+// Monitor only checks integrity of package, it's removed if role is fixed
+#if defined PACK_ROLE_MASTER || defined PACK_ROLE_SLAVE
+	#define IS_MONITOR (false)
+#else
+	#define IS_MONITOR (cur_link->flag_is_monitor)
+#endif
+
+// Microseconds of a tick of local time, LOCAL_TIME_PER_SEC must divide 1000000
+#define US_PER_TICK ((U32)(1000000UL / LOCAL_TIME_PER_SEC))
 
 // ============================ Static Variables ============================
-static U8 send_buf[MAX_BUF_SIZE];  // Sending buffer
-static bool flag_is_master;        // If the machine is master
-static U8 local_addr;              // Local address
-static U8 master_addr;             // Master address
-static U32 master_max_ack_delay;   // The max wait time that master waiting for ack
-static send_bytes_func send_bytes; // Callback function for sending bytes
-
-static U16 slave_recv_seqno_last;  // The last seqno that slave received
-static U16 master_send_seqno_last; // The last seqno that master sent
-static bool flag_master_need_ack;  // If master is waiting for ack
-static U32 master_send_time_last;  // The last point-in-time that master sent package
-static U16 master_retry_times;     // The resend times of master
-static U8 master_send_addr_last;   // The last slave address that master sent package
-static struct pack_count pack_count_info; // Statistics for sent and received packages
+#if defined PACK_TRACE
+static struct pack_link default_link = { .trace = &pack_trace }; // Default link
+#else
+static struct pack_link default_link; // Default link
+#endif
+static PACK_THREAD_LOCAL struct pack_link* cur_link = &default_link; // Selected link
 
 // ============================ Global Variables ============================
 // Receiving buffer for lower layer to store received data
-U8 recv_buf[MAX_BUF_SIZE];
+U8* const recv_buf = default_link.recv_buf;
 
 // Sending data address for application to store its sending data
-void* send_data = ((struct pack_header*)send_buf)->data;
+void* const send_data = default_link.send_buf + sizeof(struct pack_header);
 // Receiving data address for application to read its receiving data
-const void* recv_data = ((struct pack_header*)recv_buf)->data;
+const void* const recv_data = default_link.recv_buf + sizeof(struct pack_header);
 
 
 // =========================== Interface Functions ==========================
+#ifndef PACK_CHECKSUM
 // Compute Checksum for 'count' bytes beginning at location 'addr'
 static U16 checksum(const U8* addr, U16 count)
 {
 	register U32 sum = 0;
 
-	// Calculate the sum as 16-bit digital
+	// Calculate the sum as little-endian 16-bit digital
 	while (count > 1) {
-		sum += *(U16*)addr++;
+		sum += get_pack_u16(addr);
+		addr += 2;
 		count -= 2;
 	}
 
 	// Deal with odd-numbered situation
 	if (count > 0) {
-		sum += *(U8*)addr;
+		sum += *addr;
 	}
 
 	// Add the high bit overflow to the low 16-bit
@@ -69,130 +127,1015 @@ static U16 checksum(const U8* addr, U16 count)
 	return (U16)(~sum);
 }
 
+// Patch checksum 'sum' for a 16-bit word of the summed bytes changed from
+// 'old_word' to 'new_word', without summing the bytes again, it's equation 3
+// of RFC 1624: HC' = ~(~HC + ~m + m'), which gives the same result as
+// checksum() because the sum never folds to 0 for the nonzero 'len' field
+static U16 checksum_patch(U16 sum, U16 old_word, U16 new_word)
+{
+	U32 value = (U32)(U16)~sum + (U16)~old_word + new_word;
+
+	// Add the high bit overflow to the low 16-bit
+	value = (value & 0xFFFF) + (value >> 16);
+	value = (value & 0xFFFF) + (value >> 16);
+
+	return (U16)(~value);
+}
+#define PACK_CHECKSUM checksum
+#else
+U16 PACK_CHECKSUM(const U8* addr, U16 count);
+// The checksum of application can't be patched, it's summed again
+#define CHECKSUM_EXTERN
+#endif
+
+// Stamp the 16-bit word at 'p' in the summed part of package 'pack' with
+// 'value', the checksum is patched for it, or left to be summed again if
+// the checksum is defined by application
+static void stamp_pack_u16(struct pack_header* pack, U8* p, U16 value)
+{
+#if !defined CHECKSUM_EXTERN
+	put_pack_u16(pack->chksum, checksum_patch(get_pack_u16(pack->chksum), get_pack_u16(p), value));
+#else
+	(void)pack;
+#endif
+	put_pack_u16(p, value);
+}
+
+#if defined PACK_TIMESTAMP
+// Stamp the 32-bit field at 'p' in the summed part of package 'pack' with
+// 'value', the checksum is patched for it like stamp_pack_u16()
+static void stamp_pack_u32(struct pack_header* pack, U8* p, U32 value)
+{
+	stamp_pack_u16(pack, p, (U16)value);
+	stamp_pack_u16(pack, p + 2, (U16)(value >> 16));
+}
+#endif
+
+// Stamp the seqno of package 'pack' with 'seqno', the checksum is patched
+// for it like stamp_pack_u16()
+static void stamp_pack_seqno(struct pack_header* pack, pack_seqno seqno)
+{
+#if defined PACK_WIDE_SEQNO
+	stamp_pack_u16(pack, pack->seqno, (U16)seqno);
+	stamp_pack_u16(pack, pack->seqno + 2, (U16)(seqno >> 16));
+#else
+	stamp_pack_u16(pack, pack->seqno, seqno);
+#endif
+}
+
 // Initialize variables
 static void init_data(void)
 {
-	memset(send_buf, 0, sizeof(send_buf));
-	flag_is_master = false;
-	local_addr = 0;
-	master_addr = 0;
-	master_max_ack_delay = 0;
-	send_bytes = NULL;
+	memset(cur_link->send_buf, 0, sizeof(cur_link->send_buf));
+	cur_link->flag_is_master = false;
+	cur_link->flag_is_monitor = false;
+	cur_link->local_addr = 0;
+	cur_link->master_addr = 0;
+	cur_link->master_max_ack_delay = 0;
+	cur_link->send_bytes = NULL;
+	cur_link->bus_baud = 0;
+	cur_link->bus_bits_per_byte = 0;
+	cur_link->bus_turnaround = 0;
+	cur_link->bus_busy_time = 0;
+	cur_link->bus_load_time_last = LOCAL_TIME();
+
+	cur_link->slave_recv_seqno_last = 0;
+	cur_link->master_send_seqno_last = 0;
+#if defined PACK_COMPACT
+	cur_link->flag_compact = false;
+	cur_link->flag_recv_compact = false;
+#endif
+	cur_link->flag_master_need_ack = false;
+	cur_link->master_send_time_last = 0;
+#if defined PACK_STATS
+	cur_link->master_send_time_first = 0;
+#endif
+#if defined PACK_TIMESTAMP
+	cur_link->master_send_stamp = 0;
+	cur_link->flag_master_stamp_valid = false;
+	cur_link->slave_recv_stamp = 0;
+#endif
+	cur_link->master_ack_delay = 0;
+	cur_link->master_retry_times = 0;
+	cur_link->master_send_addr_last = 0;
+	cur_link->master_fast_retry_acks = 0;
+	cur_link->master_stale_ack_count = 0;
+	memset(&cur_link->pack_count_info, 0, sizeof(cur_link->pack_count_info));
+#if defined PACK_TX_ASYNC
+	cur_link->tx_next = 0;
+	cur_link->flag_tx_busy = false;
+	cur_link->tx_wait_len = 0;
+	cur_link->flag_master_tx_done = false;
+#endif
+#if !defined PACK_ROLE_MASTER
+	memset(cur_link->slave_cache, 0, sizeof(cur_link->slave_cache));
+#endif
 
-	slave_recv_seqno_last = 0;
-	master_send_seqno_last = 0;
-	flag_master_need_ack = false;
-	master_send_time_last = 0;
-	master_retry_times = 0;
-	master_send_addr_last = 0;
-	memset(&pack_count_info, 0, sizeof(pack_count_info));
+#if !defined PACK_ROLE_SLAVE
+	memset(cur_link->req_head, 0, sizeof(cur_link->req_head));
+	memset(cur_link->req_count, 0, sizeof(cur_link->req_count));
+	cur_link->req_prio = PACK_PRIO_NORMAL;
+	cur_link->flag_req_in_flight = false;
+	cur_link->flag_req_err_seen = false;
+	cur_link->flag_req_hold = false;
+	memset(cur_link->peer_buf, 0, sizeof(cur_link->peer_buf));
+	cur_link->peers = cur_link->peer_buf;
+	cur_link->peer_size = MAX_PEER_SIZE;
+	cur_link->peer_count = 0;
+#endif
 
-	memset(recv_buf, 0, sizeof(recv_buf));
-	send_data = ((struct pack_header*)send_buf)->data;
-	recv_data = ((struct pack_header*)recv_buf)->data;
+	memset(cur_link->recv_buf, 0, sizeof(cur_link->recv_buf));
+	cur_link->send_data = cur_link->send_buf + sizeof(struct pack_header);
+	cur_link->recv_data = cur_link->recv_buf + sizeof(struct pack_header);
 }
 
 // Initialize protocol
-static void init_pack(bool is_master, U8 my_addr, U8 _master_addr, U32 max_ack_delay, send_bytes_func func)
+static void init_pack(bool is_master, pack_addr my_addr, pack_addr _master_addr, U32 max_ack_delay, send_bytes_func func)
 {
 	// Initialize variables
 	init_data();
+#if defined PACK_FEC
+	fec_init();
+#endif
 	// Config the protocol parameters with the given values
-	flag_is_master = is_master;
-	local_addr = my_addr;
-	master_addr = _master_addr;
-	master_max_ack_delay = max_ack_delay;
-	send_bytes = func;
+	cur_link->flag_is_master = is_master;
+	cur_link->local_addr = my_addr;
+	cur_link->master_addr = _master_addr;
+	cur_link->master_max_ack_delay = max_ack_delay;
+	cur_link->send_bytes = func;
+}
+
+// Select the link that interface functions work on in current thread, NULL
+// for the default link, the link must be initialized before use
+void select_pack_link(struct pack_link* link)
+{
+	cur_link = (link != NULL) ? link : &default_link;
+}
+
+// Get the link selected in current thread
+struct pack_link* get_pack_link(void)
+{
+	return cur_link;
+}
+
+// Attach a trace ring to the selected link, NULL to stop trace, the default
+// link is traced to 'pack_trace' if PACK_TRACE is defined
+void set_pack_trace(struct trace_ring* ring)
+{
+	cur_link->trace = ring;
 }
 
 // Master initialize protocol
-void master_init_pack(U8 my_addr, U32 max_ack_delay, send_bytes_func func)
+void master_init_pack(pack_addr my_addr, U32 max_ack_delay, send_bytes_func func)
 {
 	init_pack(true, my_addr, my_addr, max_ack_delay, func);
 }
 
 // Slave initialize protocol
-void slave_init_pack(U8 my_addr, U8 master_add, send_bytes_func func)
+void slave_init_pack(pack_addr my_addr, pack_addr master_add, send_bytes_func func)
 {
 	init_pack(false, my_addr, master_add, 0, func);
 }
 
+#if !defined PACK_ROLE_MASTER && !defined PACK_ROLE_SLAVE
+// Monitor initialize protocol, it never sends package
+void monitor_init_pack(void)
+{
+	init_pack(false, 0, 0, 0, NULL);
+	cur_link->flag_is_monitor = true;
+}
+#endif
+
+#if !defined PACK_ROLE_MASTER
+// Find the cached ack for seqno in O(1), return NULL if not cached
+static struct pack_cache* find_ack(pack_seqno seqno)
+{
+	struct pack_cache* entry = &cur_link->slave_cache[seqno & (SLAVE_CACHE_SIZE - 1)];
+
+	return (entry->seqno == seqno) ? entry : NULL;
+}
+
+// Cache the ack package for seqno, the oldest one in its slot is replaced
+static void cache_ack(pack_seqno seqno, const U8* buf, U16 len)
+{
+	struct pack_cache* entry = &cur_link->slave_cache[seqno & (SLAVE_CACHE_SIZE - 1)];
+
+	entry->seqno = seqno;
+	entry->len = len;
+	memcpy(entry->buf, buf, len);
+}
+#endif
+
+// Airtime in microseconds of 'count' bytes on the bus, 0 if not modeled
+static U32 bytes_airtime(U16 count)
+{
+	if (cur_link->bus_baud == 0) {
+		return 0;
+	}
+
+	// Baud is divided by 100 first, so bits of 429 KB can't overflow
+	return (U32)count * cur_link->bus_bits_per_byte * 10000 / (cur_link->bus_baud / 100);
+}
+
+#if !defined PACK_ROLE_SLAVE
+// Find the state of slave in peer table, and add it if 'flag_add' is true,
+// return NULL if it's not found or the table is full. The table is open
+// addressed with linear probing, it's never filled over 3/4, so a probe
+// ends soon at a free entry. Multiplying by an odd number maps addresses
+// in a range of table size to different entries.
+static struct pack_peer* find_peer(pack_addr slave_addr, bool flag_add)
+{
+	U16 mask = cur_link->peer_size - 1;
+	U16 index = (U16)(slave_addr * 0x9E37U) & mask;
+	struct pack_peer* peer;
+
+	while (true) {
+		peer = &cur_link->peers[index];
+		if (!peer->flag_used) {
+			break;
+		}
+		if (peer->slave_addr == slave_addr) {
+			return peer;
+		}
+		index = (index + 1) & mask;
+	}
+
+	if (!flag_add || (cur_link->peer_count >= cur_link->peer_size - (cur_link->peer_size + 3) / 4)) {
+		return NULL;
+	}
+
+	memset(peer, 0, sizeof(*peer));
+	peer->slave_addr = slave_addr;
+	peer->flag_used = true;
+	cur_link->peer_count++;
+
+	return peer;
+}
+
+// Add tokens to budget for the time since the last adding
+static void fill_budget(struct pack_peer* budget)
+{
+	U32 now = LOCAL_TIME();
+	U32 time = (U32)(now - budget->time_last);
+	U32 gain;
+
+	budget->time_last = now;
+
+	// A long idle fills the budget, and the products below can't overflow
+	if (time >= LOCAL_TIME_PER_SEC * 60) {
+		budget->tokens = budget->burst;
+		return;
+	}
+
+	time *= US_PER_TICK;
+	gain = time / 1000 * budget->share + time % 1000 * budget->share / 1000;
+	budget->tokens = (budget->burst - budget->tokens > gain) ? budget->tokens + gain : budget->burst;
+}
+
+// Check if slave has budget for a request with 'data_len' bytes of data and
+// the longest ack, a full budget is enough for any request
+static bool has_budget(pack_addr slave_addr, U16 data_len)
+{
+	struct pack_peer* budget = find_peer(slave_addr, false);
+
+	if ((budget == NULL) || (budget->share == 0)) {
+		return true;
+	}
+
+	fill_budget(budget);
+
+	return (budget->tokens == budget->burst)
+	|| (budget->tokens >= get_pack_airtime(data_len) + get_pack_airtime(MAX_DATA_LEN)
+	    + 2 * cur_link->bus_turnaround);
+}
+#endif
+
+// Count the airtime of a package sent to or received from the bus, it's
+// charged to the budget of slave if the machine is master
+static void use_airtime(pack_addr slave_addr, U32 airtime)
+{
+#if !defined PACK_ROLE_SLAVE
+	struct pack_peer* budget;
+#endif
+
+	if (cur_link->bus_baud == 0) {
+		return;
+	}
+
+	// The bus is idle for turnaround after each package
+	airtime += cur_link->bus_turnaround;
+	cur_link->bus_busy_time += airtime;
+
+#if !defined PACK_ROLE_SLAVE
+	if (IS_MASTER) {
+		budget = find_peer(slave_addr, false);
+		if ((budget != NULL) && (budget->share > 0)) {
+			fill_budget(budget);
+			budget->tokens = (budget->tokens > airtime) ? budget->tokens - airtime : 0;
+		}
+	}
+#else
+	(void)slave_addr;
+#endif
+}
+
+#if defined PACK_TX_ASYNC
+// Hand the frame in the next buffer to lower layer, the interrupt that calls
+// tx_complete() must be masked
+static void start_tx(U16 len)
+{
+	U8* frame = cur_link->tx_buf[cur_link->tx_next];
+
+	// Mark before sending, in case tx_complete() is called by send_bytes
+	cur_link->flag_tx_busy = true;
+	cur_link->tx_next ^= 1;
+	cur_link->send_bytes(frame, len);
+}
+
+// Lower layer tells that the bytes of the last send_bytes_func are out, the
+// next frame is sent from here if it's waiting, can be called in interrupt
+void tx_complete(void)
+{
+	U16 len = cur_link->tx_wait_len;
+
+	cur_link->flag_tx_busy = false;
+	if (len > 0) {
+		cur_link->tx_wait_len = 0;
+		start_tx(len);
+	} else {
+		// The last package is out, ack timeout of master starts from now
+		cur_link->master_send_time_last = LOCAL_TIME();
+		cur_link->flag_master_tx_done = true;
+	}
+}
+#endif
+
+// Check if a package can be sent now without replacing the frame waiting for
+// the bus, it's always true without PACK_TX_ASYNC, for senders of bursts
+bool is_pack_tx_ready(void)
+{
+#if defined PACK_TX_ASYNC
+	return cur_link->tx_wait_len == 0;
+#else
+	return true;
+#endif
+}
+
+// Send a package to slave or master 'dest_addr' to lower layer, encoded as
+// a frame if COBS is enabled
+static void send_frame(const U8* buf, U16 len, pack_addr dest_addr)
+{
+#if defined PACK_TX_ASYNC
+	U8* frame;
+
+	// A frame waiting for the bus is replaced by the new one, so its buffer
+	// is free to fill while the other one is on the bus
+	PACK_TX_LOCK();
+	cur_link->tx_wait_len = 0;
+	frame = cur_link->tx_buf[cur_link->tx_next];
+	PACK_TX_UNLOCK();
+
+	#if defined PACK_FRAMING_COBS
+	len = cobs_encode(buf, len, frame);
+	frame[len++] = COBS_DELIMITER;
+	#else
+	memcpy(frame, buf, len);
+	#endif
+
+	// Send it at once if the bus is free, or after the frame on the bus. Ack
+	// timeout of master waits for tx_complete() of this frame, the frame on
+	// the bus may be done while this one is filled, which must not count.
+	PACK_TX_LOCK();
+	cur_link->flag_master_tx_done = false;
+	if (cur_link->flag_tx_busy) {
+		cur_link->tx_wait_len = len;
+	} else {
+		start_tx(len);
+	}
+	PACK_TX_UNLOCK();
+#elif defined PACK_FRAMING_COBS
+	len = cobs_encode(buf, len, cur_link->frame_buf);
+	cur_link->frame_buf[len++] = COBS_DELIMITER;
+	cur_link->send_bytes(cur_link->frame_buf, len);
+#else
+	cur_link->send_bytes((U8*)buf, len);
+#endif
+
+	use_airtime(dest_addr, bytes_airtime(len));
+}
+
+// The seqno of master after 'seqno', 0 and SEQNO_FIRST are skipped on
+// wraparound
+static pack_seqno next_seqno(pack_seqno seqno)
+{
+	seqno++;
+	if (seqno == 0) {
+		seqno = SEQNO_FIRST + 1;
+	}
+
+	return seqno;
+}
+
+static void transmit_pack(enum pack_send_type_list type);
+
+#if defined PACK_COMPACT
+// Check if the new package in sending buffer goes in compact header
+static bool use_compact(const struct pack_header* pack)
+{
+#if !defined PACK_ROLE_SLAVE
+	struct pack_peer* peer;
+	pack_seqno ahead;
+#endif
+
+	if (!cur_link->flag_compact || (get_pack_u16(pack->len) > COMPACT_MAX_DATA_LEN)) {
+		return false;
+	}
+
+	// Slave acks in the header of request
+	if (!IS_MASTER) {
+		return cur_link->flag_recv_compact;
+	}
+
+#if !defined PACK_ROLE_SLAVE
+	// Slave restores seqno from the last one it acked, so it must be known
+	// and not far behind
+	peer = find_peer(get_pack_addr(pack->dest), true);
+	if ((peer == NULL) || (peer->seqno_last == 0)) {
+		return false;
+	}
+	ahead = (pack_seqno)(get_pack_seqno(pack->seqno) - peer->seqno_last);
+	if ((ahead == 0) || (ahead > 255 - COMPACT_SEQNO_BEHIND)) {
+		return false;
+	}
+
+	// Slave that never acked in compact header is probed now and then, it
+	// drops the probe if it doesn't know the format, and acks the resending
+	if (!peer->flag_compact) {
+		return (peer->compact_probe++ % COMPACT_PROBE_PERIOD) == 0;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Make the compact package of the new package in sending buffer in its
+// buffer, return the length of compact package
+static U16 make_compact(const struct pack_header* pack)
+{
+	struct pack_compact_header* compact = (struct pack_compact_header*)cur_link->compact_buf;
+	U16 len = get_pack_u16(pack->len);
+
+	compact->premble = PACK_PREMBLE;
+	compact->start = PACK_START_COMPACT;
+	memcpy(compact->chksum, pack->chksum, sizeof(compact->chksum));
+	memcpy(compact->dest, pack->dest, PACK_ADDR_LEN);
+	memcpy(compact->src, pack->src, PACK_ADDR_LEN);
+	compact->seqno = (U8)get_pack_seqno(pack->seqno);
+	compact->len_flags = (U8)len;
+	// Parity of FEC follows data part, it's of the package in full header
+	memcpy(compact->data, pack->data, len + PACK_FEC_LEN);
+
+	// Count the compact package
+	cur_link->pack_count_info.compact_send_count++;
+
+	return sizeof(struct pack_compact_header) + len + PACK_FEC_LEN;
+}
+
+// Expand the compact package in recv_buf to full header in place, return the
+// length of compact package
+static U16 expand_pack(void)
+{
+	struct pack_compact_header* compact = (struct pack_compact_header*)cur_link->recv_buf;
+	struct pack_header* pack = (struct pack_header*)cur_link->recv_buf;
+	U8 chksum[2];
+	pack_addr dest = get_pack_addr(compact->dest);
+	pack_addr src = get_pack_addr(compact->src);
+	pack_seqno base;
+	pack_seqno seqno;
+	U16 len = compact->len_flags;
+
+	// Unknown flags make the length wrong
+	if (len > COMPACT_LEN_MASK) {
+		len = 0;
+	}
+	memcpy(chksum, compact->chksum, sizeof(chksum));
+
+	// Master takes the seqno at or before the last sent, the others take it
+	// ahead of the last received, by a few before at most
+	if (IS_MASTER) {
+		base = cur_link->master_send_seqno_last;
+		seqno = (pack_seqno)(base - (U8)((U8)base - compact->seqno));
+	} else {
+		base = (pack_seqno)(cur_link->slave_recv_seqno_last - COMPACT_SEQNO_BEHIND);
+		seqno = (pack_seqno)(base + (U8)(compact->seqno - (U8)base));
+	}
+
+	// Data part moves first, the header grows over it
+	if ((len >= 1) && (len <= MAX_DATA_LEN)) {
+		memmove(pack->data, compact->data, len + PACK_FEC_LEN);
+	}
+	pack->premble[0] = PACK_PREMBLE;
+	pack->premble[1] = PACK_PREMBLE;
+	pack->premble[2] = PACK_PREMBLE;
+	pack->start = PACK_START;
+	memcpy(pack->chksum, chksum, sizeof(chksum));
+	put_pack_addr(pack->dest, dest);
+	put_pack_addr(pack->src, src);
+	put_pack_seqno(pack->seqno, seqno);
+	put_pack_u16(pack->len, len);
+#if defined PACK_FEC
+	// Compact header has no parity of its own, the package parity covers it
+	fec_encode(pack->chksum, FEC_HEAD_LEN, pack->head_fec);
+#endif
+
+	// Count the compact package
+	cur_link->pack_count_info.compact_recv_count++;
+
+	return sizeof(struct pack_compact_header) + len + PACK_FEC_LEN;
+}
+#endif
+
 // Original send package function
-static void send_pack(U8 dest_addr, U16 data_len, bool is_new_pack)
+static void send_pack(pack_addr dest_addr, U16 data_len, enum pack_send_type_list type)
 {
 	// Mapping the sending buffer with struct pack_header
-	struct pack_header* pack = (struct pack_header*)send_buf;
+	struct pack_header* pack = (struct pack_header*)cur_link->send_buf;
+	pack_seqno seqno;
 
 	// See if it is a new package
-	if (is_new_pack) {
+	if (type == PACK_SEND_NEW) {
 		// Fill data in accordance with the package structure
 		pack->premble[0] = PACK_PREMBLE;
 		pack->premble[1] = PACK_PREMBLE;
 		pack->premble[2] = PACK_PREMBLE;
 		pack->start = PACK_START;
-		pack->src = local_addr;
+		put_pack_addr(pack->src, cur_link->local_addr);
 		// Set the dest address and seqno
-		if (flag_is_master) {
-			pack->dest = dest_addr;
+		if (IS_MASTER) {
+			put_pack_addr(pack->dest, dest_addr);
 			// Master's seqno will incremente by 1
-			pack->seqno++;
-			if (pack->seqno == 0) {
-				pack->seqno = 1;
-			}
+			seqno = next_seqno(get_pack_seqno(pack->seqno));
 		} else {
-			pack->dest = master_addr;
+			put_pack_addr(pack->dest, cur_link->master_addr);
 			// slave's seqno just take the last
-			pack->seqno = slave_recv_seqno_last;
+			seqno = cur_link->slave_recv_seqno_last;
 		}
-		pack->len = data_len;
-		pack->chksum = checksum((const U8*)&pack->seqno, pack->len + CHECKSUM_HEAD_LEN);
+		put_pack_seqno(pack->seqno, seqno);
+#if defined PACK_TIMESTAMP
+		// Slave tells how long it took from the request to this ack
+		put_pack_u32(pack->stamp, STAMP_TIME());
+		put_pack_u32(pack->service, IS_MASTER ? 0 : get_pack_u32(pack->stamp) - cur_link->slave_recv_stamp);
+#endif
+		put_pack_u16(pack->len, data_len);
+		put_pack_u16(pack->chksum, PACK_CHECKSUM(pack->dest, data_len + CHECKSUM_HEAD_LEN));
+#if defined PACK_FEC
+		// Append parity after data part, the header has its own
+		fec_encode(pack->chksum, FEC_HEAD_LEN, pack->head_fec);
+		fec_encode(pack->chksum, data_len + FEC_HEAD_LEN, pack->data + data_len);
+#endif
 
 		// Count the new sending package
-		pack_count_info.send_pack_count[PACK_SEND_NEW]++;
+		cur_link->pack_count_info.send_pack_count[PACK_SEND_NEW]++;
 	} else {
-		// Count the resending package
-		pack_count_info.send_pack_count[PACK_SEND_RETRY]++;
+		// Count the resending package by its reason
+		cur_link->pack_count_info.send_pack_count[type]++;
 	}
 
+	transmit_pack(type);
+}
+
+// Send the package in sending buffer to lower layer, and update the state of
+// master or slave for it
+static void transmit_pack(enum pack_send_type_list type)
+{
+	struct pack_header* pack = (struct pack_header*)cur_link->send_buf;
+	const U8* frame = cur_link->send_buf;
+	U16 frame_len = sizeof(struct pack_header) + get_pack_u16(pack->len) + PACK_FEC_LEN;
+#if !defined PACK_ROLE_SLAVE
+	struct pack_peer* peer;
+#endif
+
+#if defined PACK_COMPACT
+	// Resending is always in full header, which resynchronizes seqno
+	if ((type == PACK_SEND_NEW) && use_compact(pack)) {
+		frame = cur_link->compact_buf;
+		frame_len = make_compact(pack);
+	}
+#endif
 	// Send package
-	send_bytes(send_buf, sizeof(struct pack_header) + pack->len);
+	send_frame(frame, frame_len, get_pack_addr(pack->dest));
+	TRACE_PACK((type == PACK_SEND_NEW) ? TRACE_SEND_NEW : TRACE_SEND_RETRY, 0,
+	           cur_link->send_buf, sizeof(struct pack_header) + get_pack_u16(pack->len) + PACK_FEC_LEN);
+
+#if !defined PACK_ROLE_MASTER
+	// Slave caches the new ack for duplicate requests
+	if (!IS_MASTER && (type == PACK_SEND_NEW)) {
+		cache_ack(get_pack_seqno(pack->seqno), cur_link->send_buf,
+		          sizeof(struct pack_header) + get_pack_u16(pack->len) + PACK_FEC_LEN);
+	}
+#endif
 
 	// Master must check if ack is timeout
-	if (flag_is_master) {
+	if (IS_MASTER) {
 		// Mark the master is waiting for ack
-		flag_master_need_ack = true;
+		cur_link->flag_master_need_ack = true;
+#if defined PACK_TX_ASYNC
+		// Ack timeout starts after the package is out, so it covers the
+		// airtime of the longest ack only
+		cur_link->master_ack_delay = cur_link->master_max_ack_delay
+		+ (get_pack_airtime(MAX_DATA_LEN) + 2 * cur_link->bus_turnaround + US_PER_TICK - 1) / US_PER_TICK;
+#else
 		// Record the last point-in-time that master sent package
-		master_send_time_last = LOCAL_TIME();
+		cur_link->master_send_time_last = LOCAL_TIME();
+		// Ack timeout covers the airtime of package and the longest ack
+		cur_link->master_ack_delay = cur_link->master_max_ack_delay
+		+ (get_pack_airtime(get_pack_u16(pack->len)) + get_pack_airtime(MAX_DATA_LEN)
+		+ 2 * cur_link->bus_turnaround + US_PER_TICK - 1) / US_PER_TICK;
+#endif
+#if defined PACK_STATS
+		// Ack delay in histogram counts from the first sending
+		if (type == PACK_SEND_NEW) {
+			cur_link->master_send_time_first = LOCAL_TIME();
+		}
+#endif
+#if defined PACK_TIMESTAMP
+		// An ack after resending may answer any sending, it's not sampled
+		cur_link->master_send_stamp = get_pack_u32(pack->stamp);
+		cur_link->flag_master_stamp_valid = (type == PACK_SEND_NEW);
+#endif
 		// Record the last seqno that master sent
-		master_send_seqno_last = pack->seqno;
+		cur_link->master_send_seqno_last = get_pack_seqno(pack->seqno);
 		// Record the last slave address that master sent package
-		master_send_addr_last = pack->dest;
+		cur_link->master_send_addr_last = get_pack_addr(pack->dest);
+#if !defined PACK_ROLE_SLAVE
+		// Count the new package in the state of slave
+		if (type == PACK_SEND_NEW) {
+			peer = find_peer(cur_link->master_send_addr_last, true);
+			if (peer != NULL) {
+				peer->send_count++;
+			}
+		}
+#endif
+		// Count stale acks for this sending only
+		cur_link->master_stale_ack_count = 0;
 	}
 }
 
 // Master send package
-void master_send_pack(U8 dest_addr, U16 data_len)
+void master_send_pack(pack_addr dest_addr, U16 data_len)
 {
-	send_pack(dest_addr, data_len, true);
+	send_pack(dest_addr, data_len, PACK_SEND_NEW);
 }
 
 // Slave send package
 void slave_send_pack(U16 data_len)
 {
-	send_pack(0, data_len, true);
+	send_pack(0, data_len, PACK_SEND_NEW);
+}
+
+// Master sends the last package again as a new one to slave 'dest_addr',
+// e.g. to repeat a command or to fail over to a backup slave. Only 'dest'
+// and 'seqno' are stamped, and the checksum is patched for them instead of
+// summed again, so it costs the same time for any length of data part.
+void master_repeat_pack(pack_addr dest_addr)
+{
+	struct pack_header* pack = (struct pack_header*)cur_link->send_buf;
+
+	// Nothing was sent yet
+	if (get_pack_u16(pack->len) == 0) {
+		return;
+	}
+
+#if defined PACK_WIDE_ADDR
+	stamp_pack_u16(pack, pack->dest, dest_addr);
+#else
+	// 'dest' and 'src' are summed as a 16-bit word
+	stamp_pack_u16(pack, pack->dest, (U16)(dest_addr | (pack->src[0] << 8)));
+#endif
+	stamp_pack_seqno(pack, next_seqno(get_pack_seqno(pack->seqno)));
+#if defined PACK_TIMESTAMP
+	stamp_pack_u32(pack, pack->stamp, STAMP_TIME());
+#endif
+#if defined CHECKSUM_EXTERN
+	put_pack_u16(pack->chksum, PACK_CHECKSUM(pack->dest, get_pack_u16(pack->len) + CHECKSUM_HEAD_LEN));
+#endif
+#if defined PACK_FEC
+	// Parity covers the header too, encode it again
+	fec_encode(pack->chksum, FEC_HEAD_LEN, pack->head_fec);
+	fec_encode(pack->chksum, get_pack_u16(pack->len) + FEC_HEAD_LEN, pack->data + get_pack_u16(pack->len));
+#endif
+
+	// Count the new sending package
+	cur_link->pack_count_info.send_pack_count[PACK_SEND_NEW]++;
+	transmit_pack(PACK_SEND_NEW);
+}
+
+// Master continues from seqno 'seqno', the next new package is sent with
+// the seqno after it, e.g. to resume the seqno kept over a restart
+void master_set_pack_seqno(pack_seqno seqno)
+{
+	put_pack_seqno(((struct pack_header*)cur_link->send_buf)->seqno, seqno);
 }
 
-// Resend the last package
-static void resend_pack(void)
+// Resend the last package, 'type' is the reason
+static void resend_pack(enum pack_send_type_list type)
 {
-	send_pack(0, 0, false);
+	send_pack(0, 0, type);
 }
 
+// Master resends at once if enough stale acks are received while waiting
+// for ack, an intact ack with an old seqno tells the last package is lost
+static void check_fast_retry(const struct pack_header* pack, U16 len)
+{
+	if (!cur_link->flag_master_need_ack || (cur_link->master_fast_retry_acks == 0)) {
+		return;
+	}
+
+	// A broken ack tells nothing, its seqno may be wrong, and an ack ahead of
+	// the last sent seqno is not stale
+	if (!seqno_before(get_pack_seqno(pack->seqno), cur_link->master_send_seqno_last)
+	|| (len < 1) || (len > MAX_DATA_LEN)
+	|| (get_pack_u16(pack->chksum) != PACK_CHECKSUM(pack->dest, len + CHECKSUM_HEAD_LEN))) {
+		return;
+	}
+
+	cur_link->master_stale_ack_count++;
+	if (cur_link->master_stale_ack_count >= cur_link->master_fast_retry_acks) {
+		// Increment the resend times of master by 1
+		cur_link->master_retry_times++;
+		// Resend the last sent package
+		resend_pack(PACK_SEND_FAST_RETRY);
+	}
+}
+
+#if defined PACK_STATS
+// Count 'ticks' in histogram 'hist' of PACK_HIST_SIZE buckets
+static void count_hist(U32* hist, U32 ticks)
+{
+	U8 bucket = 0;
+
+	// Bucket is the number of bits of ticks
+	while ((ticks != 0) && (bucket < PACK_HIST_SIZE - 1)) {
+		ticks >>= 1;
+		bucket++;
+	}
+	hist[bucket]++;
+}
+#endif
+
+#if defined PACK_TIMESTAMP && !defined PACK_ROLE_SLAVE
+// Sample the timestamps of ack 'pack' for slave 'peer', NTP-like: master sent
+// the request at t1, slave received it at t2 and acked at t3, and master
+// received the ack at t4 now
+static void count_stamp(struct pack_peer* peer, const struct pack_header* pack)
+{
+	U32 round = STAMP_TIME() - cur_link->master_send_stamp; // t4 - t1
+	U32 service = get_pack_u32(pack->service);             // t3 - t2
+	U32 wire;
+
+	// Take one ack for each sending, the others may be cached or streamed
+	if (!cur_link->flag_master_stamp_valid || (service > round)) {
+		return;
+	}
+	cur_link->flag_master_stamp_valid = false;
+	wire = round - service;
+
+	// Offset is ((t2 - t1) - (t4 - t3)) / 2, which is t2 - t1 - wire / 2,
+	// right modulo 2^32 for clocks of any start
+	if ((peer->stamp_count == 0) || (wire <= peer->clock_delay) || (peer->clock_age >= PACK_CLOCK_AGE)) {
+		peer->clock_offset = get_pack_u32(pack->stamp) - service - cur_link->master_send_stamp - wire / 2;
+		peer->clock_delay = wire;
+		peer->clock_age = 0;
+	} else {
+		peer->clock_age++;
+	}
+
+	// Times are smoothed by 1/8 like round-trip time of TCP
+	if (peer->stamp_count == 0) {
+		peer->wire_time = wire;
+		peer->service_time = service;
+	} else {
+		peer->wire_time = (peer->wire_time * 7 + wire) / 8;
+		peer->service_time = (peer->service_time * 7 + service) / 8;
+	}
+	if (service > peer->service_time_max) {
+		peer->service_time_max = service;
+	}
+	peer->stamp_count++;
+}
+#endif
+
+#if !defined PACK_ROLE_SLAVE
+// Check if the point-in-time 'deadline' is reached, safe on time wraparound
+static bool time_reached(U32 deadline)
+{
+	return (U32)((U32)LOCAL_TIME() - deadline) < 0x80000000UL;
+}
+
+// Remove the first request from queue of class 'prio' and call its callback
+// function
+static void finish_req(U8 prio, enum pack_req_result_list result, const void* data, U16 data_len)
+{
+	struct pack_req* req = &cur_link->req_queue[prio][cur_link->req_head[prio]];
+	struct pack_req_count* count = &cur_link->pack_count_info.req_count_info[prio];
+	U32 latency = (U32)LOCAL_TIME() - req->time_submit;
+	pack_addr dest_addr = req->dest_addr;
+	pack_req_func func = req->func;
+	void* arg = req->arg;
+
+	// Free the slot before callback, so that callback can submit again
+	cur_link->req_head[prio] = (cur_link->req_head[prio] + 1) % MAX_REQ_QUEUE_SIZE;
+	cur_link->req_count[prio]--;
+	cur_link->flag_req_in_flight = false;
+	cur_link->flag_req_err_seen = false;
+
+	// Count the latency of class
+	count->done_count++;
+	count->latency_sum += latency;
+	if (latency > count->latency_max) {
+		count->latency_max = latency;
+	}
+#if defined PACK_STATS
+	count_hist(count->latency_hist, latency);
+#endif
+
+	if (func != NULL) {
+		func(dest_addr, result, data, data_len, arg);
+	}
+}
+
+// Send the first request whose slave has budget in the highest class, urgent
+// requests are not limited by budget. Requests out of deadline are timeout.
+static void start_req(void)
+{
+	struct pack_req* queue;
+	struct pack_req temp;
+	U8 head;
+	U8 index = 0;
+	U8 prio;
+	U8 i;
+	U8 j;
+
+	while (!cur_link->flag_req_in_flight && !cur_link->flag_req_hold) {
+		// Timeout the first request of queue out of deadline
+		for (prio = 0; prio < PACK_PRIO_TOTAL; prio++) {
+			if ((cur_link->req_count[prio] > 0)
+			&& time_reached(cur_link->req_queue[prio][cur_link->req_head[prio]].deadline)) {
+				break;
+			}
+		}
+		if (prio < PACK_PRIO_TOTAL) {
+			finish_req(prio, PACK_REQ_TIMEOUT, NULL, 0);
+			continue;
+		}
+
+		// Find the first request whose slave has budget, from the highest
+		// class, the others wait
+		for (prio = 0; prio < PACK_PRIO_TOTAL; prio++) {
+			queue = cur_link->req_queue[prio];
+			head = cur_link->req_head[prio];
+			for (i = 0; i < cur_link->req_count[prio]; i++) {
+				index = (head + i) % MAX_REQ_QUEUE_SIZE;
+				if ((prio == PACK_PRIO_URGENT) || has_budget(queue[index].dest_addr, queue[index].data_len)) {
+					break;
+				}
+			}
+			if (i < cur_link->req_count[prio]) {
+				break;
+			}
+		}
+		if (prio == PACK_PRIO_TOTAL) {
+			break;
+		}
+
+		// Move it to the head, the others keep their order
+		if (i > 0) {
+			temp = queue[index];
+			for (j = i; j > 0; j--) {
+				queue[(head + j) % MAX_REQ_QUEUE_SIZE] = queue[(head + j - 1) % MAX_REQ_QUEUE_SIZE];
+			}
+			queue[head] = temp;
+		}
+
+		// Copy data part to sending buffer and send it as a new package
+		memcpy(cur_link->send_data, queue[head].data, queue[head].data_len);
+		cur_link->req_prio = prio;
+		cur_link->flag_req_in_flight = true;
+		send_pack(queue[head].dest_addr, queue[head].data_len, PACK_SEND_NEW);
+	}
+}
+#endif
+
+#if defined PACK_FEC
+// Correct byte errors of the fields from 'chksum' to 'len' of header 'pack'
+// in place by the parity of header, return the number of bytes corrected
+static U8 correct_head(struct pack_header* pack)
+{
+	U8 code[FEC_HEAD_LEN + PACK_FEC_LEN];
+	U8 count;
+
+	// The parity is before the fields, the codeword ends with it
+	memcpy(code, pack->chksum, FEC_HEAD_LEN);
+	memcpy(code + FEC_HEAD_LEN, pack->head_fec, PACK_FEC_LEN);
+	if (!fec_decode(code, sizeof(code), &count) || (count == 0)) {
+		return 0;
+	}
+	memcpy(pack->chksum, code, FEC_HEAD_LEN);
+
+	return count;
+}
+
+// Get the data length of header 'pack' as corrected by the parity of header,
+// for finding the end of package, the header is not changed
+static U16 get_fec_len(const struct pack_header* pack)
+{
+	struct pack_header head;
+
+	memcpy(&head, pack, sizeof(head));
+	correct_head(&head);
+
+	return get_pack_u16(head.len);
+}
+
+// Correct byte errors of the received package in place by its parity, the
+// header is corrected first by its own parity, so is the length that finds
+// the parity of package
+static void correct_pack(void)
+{
+	struct pack_header* pack = (struct pack_header*)cur_link->recv_buf;
+	U16 len;
+	U8 head_count;
+	U8 count = 0;
+
+	head_count = correct_head(pack);
+	len = get_pack_u16(pack->len);
+
+	// Parity can't be found by a length broken beyond the parity of header,
+	// the package will be dropped
+	if ((len >= 1) && (len <= MAX_DATA_LEN)
+	&& !fec_decode(pack->chksum, len + FEC_HEAD_LEN + PACK_FEC_LEN, &count)) {
+		count = 0;
+	}
+
+	if (head_count + count > 0) {
+		// Count the corrected package and bytes
+		cur_link->pack_count_info.fec_pack_count++;
+		cur_link->pack_count_info.fec_byte_count += head_count + count;
+	}
+}
+#endif
+
+#if !defined PACK_ROLE_MASTER
+// Check if a request with 'seqno' other than the last received is a delayed
+// duplicate for slave, whose seqno is shortly before the last received. The
+// first seqno of master is always new, for restart of master.
+static bool is_stale_seqno(pack_seqno seqno)
+{
+	pack_seqno last = cur_link->slave_recv_seqno_last;
+
+	return (last != 0) && (seqno != SEQNO_FIRST) && seqno_before(seqno, last)
+	&& ((pack_seqno)(last - seqno) <= SLAVE_SEQNO_WINDOW);
+}
+#endif
+
 // Check validity of the received package
 enum pack_recv_type_list check_pack(void)
 {
 	enum pack_recv_type_list ret = PACK_RECV_NEW;
-	struct pack_header* pack = (struct pack_header*)recv_buf;
+	struct pack_header* pack = (struct pack_header*)cur_link->recv_buf;
+	pack_seqno seqno;
+	U16 len;
+#if !defined PACK_ROLE_MASTER
+	struct pack_cache* entry;
+#endif
+#if !defined PACK_ROLE_SLAVE
+	struct pack_peer* peer;
+#endif
+#if defined PACK_COMPACT
+	U16 compact_len = 0;
+
+	// Both formats are accepted, the compact one is checked in full header
+	if (cur_link->recv_buf[1] == PACK_START_COMPACT) {
+		compact_len = expand_pack();
+	}
+#endif
+
+#if defined PACK_FEC
+	// Correct the package before any field is believed
+	correct_pack();
+#endif
+	// Decode the multi-byte fields of header
+	seqno = get_pack_seqno(pack->seqno);
+	len = get_pack_u16(pack->len);
+
+	// Count the airtime, a broken length is taken as the longest
+#if defined PACK_COMPACT
+	if (compact_len > 0) {
+		use_airtime(get_pack_addr(pack->src), bytes_airtime(compact_len));
+	} else
+#endif
+	use_airtime(get_pack_addr(pack->src), get_pack_airtime((len > MAX_DATA_LEN) ? MAX_DATA_LEN : len));
 
 	do {
 		// Check the premble
@@ -200,7 +1143,7 @@ enum pack_recv_type_list check_pack(void)
 		|| pack->premble[1] != PACK_PREMBLE
 		|| pack->premble[2] != PACK_PREMBLE) {
 			// Count the premble error package
-			pack_count_info.recv_pack_count[PACK_RECV_PREMBLE_ERR]++;
+			cur_link->pack_count_info.recv_pack_count[PACK_RECV_PREMBLE_ERR]++;
 			ret = PACK_RECV_PREMBLE_ERR;
 			break;
 		}
@@ -208,115 +1151,576 @@ enum pack_recv_type_list check_pack(void)
 		// Check the start code
 		if (pack->start != PACK_START) {
 			// Count the start code error package
-			pack_count_info.recv_pack_count[PACK_RECV_START_ERR]++;
+			cur_link->pack_count_info.recv_pack_count[PACK_RECV_START_ERR]++;
 			ret = PACK_RECV_START_ERR;
 			break;
 		}
 
-		// Check the dest address
-		if (pack->dest != local_addr) {
-			// Count the dest address error package
-			pack_count_info.recv_pack_count[PACK_RECV_DEST_ERR]++;
-			ret = PACK_RECV_DEST_ERR;
-			break;
-		}
-
-		if (flag_is_master) {
-			// Check if the src address is the last slave address that master sent
-			if (pack->src != master_send_addr_last) {
-				// Count the src address error package
-				pack_count_info.recv_pack_count[PACK_RECV_SRC_ERR]++;
-				ret = PACK_RECV_SRC_ERR;
-				break;
-			}
-			// Master check if the seqno is same as the last sent
-			if (pack->seqno != master_send_seqno_last) {
-				// Count the seqno error package
-				pack_count_info.recv_pack_count[PACK_RECV_SEQNO_ERR]++;
-				ret = PACK_RECV_SEQNO_ERR;
+		// Monitor accepts packages of every address and seqno
+		if (!IS_MONITOR) {
+			// Check the dest address
+			if (get_pack_addr(pack->dest) != cur_link->local_addr) {
+				// Count the dest address error package
+				cur_link->pack_count_info.recv_pack_count[PACK_RECV_DEST_ERR]++;
+				ret = PACK_RECV_DEST_ERR;
 				break;
 			}
-		} else {
-			// Check if the src address is the master address
-			if (pack->src != master_addr) {
-				// Count the src address error package
-				pack_count_info.recv_pack_count[PACK_RECV_SRC_ERR]++;
-				ret = PACK_RECV_SRC_ERR;
-				break;
+
+			if (IS_MASTER) {
+				// Check if the src address is the last slave address that master sent
+				if (get_pack_addr(pack->src) != cur_link->master_send_addr_last) {
+					// Count the src address error package
+					cur_link->pack_count_info.recv_pack_count[PACK_RECV_SRC_ERR]++;
+					ret = PACK_RECV_SRC_ERR;
+					break;
+				}
+				// Master check if the seqno is same as the last sent
+				if (seqno != cur_link->master_send_seqno_last) {
+					// Count the seqno error package
+					cur_link->pack_count_info.recv_pack_count[PACK_RECV_SEQNO_ERR]++;
+					ret = PACK_RECV_SEQNO_ERR;
+					check_fast_retry(pack, len);
+					break;
+				}
+			} else {
+				// Check if the src address is the master address
+				if (get_pack_addr(pack->src) != cur_link->master_addr) {
+					// Count the src address error package
+					cur_link->pack_count_info.recv_pack_count[PACK_RECV_SRC_ERR]++;
+					ret = PACK_RECV_SRC_ERR;
+					break;
+				}
 			}
 		}
 
 		// Check the data length
-		if ((pack->len < 1) || (pack->len > MAX_DATA_LEN)) {
+		if ((len < 1) || (len > MAX_DATA_LEN)) {
 			// Count the data length error package
-			pack_count_info.recv_pack_count[PACK_RECV_LEN_ERR]++;
+			cur_link->pack_count_info.recv_pack_count[PACK_RECV_LEN_ERR]++;
 			ret = PACK_RECV_LEN_ERR;
 			break;
 		}
 
 		// Check the checksum
-		if (pack->chksum != checksum((const U8*)&pack->seqno, pack->len + CHECKSUM_HEAD_LEN)) {
+		if (get_pack_u16(pack->chksum) != PACK_CHECKSUM(pack->dest, len + CHECKSUM_HEAD_LEN)) {
 			// Count the checksum error package
-			pack_count_info.recv_pack_count[PACK_RECV_CHKSUM_ERR]++;
+			cur_link->pack_count_info.recv_pack_count[PACK_RECV_CHKSUM_ERR]++;
 			ret = PACK_RECV_CHKSUM_ERR;
 			break;
 		}
 
-		// If the seqno is same as the last received, slave will resend the last package
-		if (!flag_is_master) {
-			// Check the seqno
-			if (pack->seqno == slave_recv_seqno_last) {
+#if !defined PACK_ROLE_MASTER
+		// If the seqno is a recent one, slave resends the cached ack without
+		// passing the request to application again
+		if (!IS_MASTER && !IS_MONITOR) {
+			// Master restarted, the cached acks are of its last run
+			if ((seqno == SEQNO_FIRST) && (seqno != cur_link->slave_recv_seqno_last)) {
+				memset(cur_link->slave_cache, 0, sizeof(cur_link->slave_cache));
+			}
+			entry = find_ack(seqno);
+			if (entry != NULL || seqno == cur_link->slave_recv_seqno_last) {
 				// Count the resend package that slave received
-				pack_count_info.recv_pack_count[PACK_RECV_RETRY]++;
-				// Resend the last package
-				resend_pack();
+				cur_link->pack_count_info.recv_pack_count[PACK_RECV_RETRY]++;
+				// Resend the cached ack, if the application has not acked
+				// yet, the ack will be sent later
+				if (entry != NULL) {
+					cur_link->pack_count_info.send_pack_count[PACK_SEND_RETRY]++;
+					send_frame(entry->buf, entry->len, cur_link->master_addr);
+					TRACE_PACK(TRACE_SEND_RETRY, 0, entry->buf, entry->len);
+				}
 				ret = PACK_RECV_RETRY;
 				break;
 			}
+			// A delayed duplicate must not be done again
+			if (is_stale_seqno(seqno)) {
+				// Count the seqno error package
+				cur_link->pack_count_info.recv_pack_count[PACK_RECV_SEQNO_ERR]++;
+				ret = PACK_RECV_SEQNO_ERR;
+				break;
+			}
 		}
+#endif
 
 		// Count the new package received
-		pack_count_info.recv_pack_count[PACK_RECV_NEW]++;
+		cur_link->pack_count_info.recv_pack_count[PACK_RECV_NEW]++;
 
-		if (flag_is_master) {
+		if (IS_MASTER) {
 			// Ack package has received, clear the mark that master is waiting for ack
-			flag_master_need_ack = false;
+			cur_link->flag_master_need_ack = false;
 			// Set the resend times of master to zero
-			master_retry_times = 0;
+			cur_link->master_retry_times = 0;
+#if defined PACK_STATS
+			count_hist(cur_link->pack_count_info.ack_delay_hist, LOCAL_TIME() - cur_link->master_send_time_first);
+#endif
+#if !defined PACK_ROLE_SLAVE
+			// Count the ack in the state of slave
+			peer = find_peer(cur_link->master_send_addr_last, false);
+			if (peer != NULL) {
+				peer->ack_count++;
+#if defined PACK_TIMESTAMP
+				count_stamp(peer, pack);
+#endif
+#if defined PACK_COMPACT
+				// Slave acked this seqno, and knows the compact header if
+				// it acked in it
+				peer->seqno_last = seqno;
+				if (compact_len > 0) {
+					peer->flag_compact = true;
+				}
+#endif
+			}
+#endif
 		} else {
 			// Slave record the last seqno that received
-			slave_recv_seqno_last = pack->seqno;
+			cur_link->slave_recv_seqno_last = seqno;
+#if defined PACK_TIMESTAMP
+			cur_link->slave_recv_stamp = STAMP_TIME();
+#endif
+#if defined PACK_COMPACT
+			// Slave acks in the header of request
+			cur_link->flag_recv_compact = (compact_len > 0);
+#endif
 		}
 	} while (0);
 
+	// Record the received package, the length may be broken
+	TRACE_PACK(TRACE_RECV, ret, cur_link->recv_buf, (len > MAX_DATA_LEN)
+	           ? MAX_BUF_SIZE : sizeof(struct pack_header) + len + PACK_FEC_LEN);
+
+#if !defined PACK_ROLE_SLAVE
+	// Complete the asynchronous request in flight
+	if (cur_link->flag_req_in_flight) {
+		if (ret == PACK_RECV_NEW) {
+			finish_req(cur_link->req_prio, PACK_REQ_ACK, cur_link->recv_data, len);
+			// Send the next request at once
+			start_req();
+		} else if (ret != PACK_RECV_SEQNO_ERR) {
+			// Remember the broken ack for reporting, a stale ack is an
+			// intact answer of an earlier sending
+			cur_link->flag_req_err_seen = true;
+		}
+	}
+#endif
+
 	return ret;
 }
 
+#if defined PACK_FRAMING_COBS
+// Decode the frame of 'len' bytes in recv_buf in place and check it, the
+// lower layer stores the bytes before delimiter to recv_buf
+enum pack_recv_type_list check_frame(U16 len)
+{
+	struct pack_header* pack = (struct pack_header*)cur_link->recv_buf;
+
+	// The frame must hold a whole package, nothing more
+	len = cobs_decode(cur_link->recv_buf, len);
+#if defined PACK_COMPACT
+	if ((len >= 2) && (cur_link->recv_buf[1] == PACK_START_COMPACT)) {
+		const struct pack_compact_header* compact = (const struct pack_compact_header*)cur_link->recv_buf;
+
+		if ((len < sizeof(struct pack_compact_header))
+		|| (len != sizeof(struct pack_compact_header) + compact->len_flags + PACK_FEC_LEN)) {
+			// Count the data length error package
+			cur_link->pack_count_info.recv_pack_count[PACK_RECV_LEN_ERR]++;
+			return PACK_RECV_LEN_ERR;
+		}
+		return check_pack();
+	}
+#endif
+	if ((len < sizeof(struct pack_header))
+#if defined PACK_FEC
+	|| (len != sizeof(struct pack_header) + get_fec_len(pack) + PACK_FEC_LEN)) {
+#else
+	|| (len != sizeof(struct pack_header) + get_pack_u16(pack->len) + PACK_FEC_LEN)) {
+#endif
+		// Count the data length error package
+		cur_link->pack_count_info.recv_pack_count[PACK_RECV_LEN_ERR]++;
+		return PACK_RECV_LEN_ERR;
+	}
+
+	return check_pack();
+}
+
+// Find and check the next frame in 'len' bytes of 'buf' from lower layer,
+// skipping line noise before it. Frames are found by the delimiter, so a
+// broken frame is checked as a broken package, and never hides the next.
+// Return true if a frame is decoded to recv_buf and checked, '*result' is
+// the verdict of check_frame(). '*used' is the number of bytes consumed,
+// the rest must be passed again with more bytes appended.
+bool scan_pack(const U8* buf, U16 len, U16* used, enum pack_recv_type_list* result)
+{
+	const U8* end;
+	U16 pos = 0;
+	U16 frame_len;
+
+	while (true) {
+		// Find the next delimiter, memchr() is the fastest byte search of libc
+		end = memchr(buf + pos, COBS_DELIMITER, len - pos);
+		if (end == NULL) {
+			// Bytes longer than a frame are noise
+			*used = (len - pos >= MAX_FRAME_SIZE) ? len : pos;
+			return false;
+		}
+		frame_len = (U16)(end - buf) - pos;
+
+		// Skip empty frames and frames too long
+		if ((frame_len == 0) || (frame_len >= MAX_FRAME_SIZE)) {
+			pos += frame_len + 1;
+			continue;
+		}
+
+		memcpy(cur_link->recv_buf, buf + pos, frame_len);
+		*result = check_frame(frame_len);
+		*used = pos + frame_len + 1;
+		return true;
+	}
+}
+#else
+// Find and check the next package in 'len' bytes of 'buf' from lower layer,
+// skipping line noise before it. Candidates are found by the start code, and
+// a candidate with wrong length or checksum is taken as noise, then the scan
+// goes on from its next byte, so a package behind garbage is not lost.
+// Return true if a package is copied to recv_buf and checked, '*result' is
+// the verdict of check_pack(). '*used' is the number of bytes consumed, the
+// rest must be passed again with more bytes appended.
+bool scan_pack(const U8* buf, U16 len, U16* used, enum pack_recv_type_list* result)
+{
+	const struct pack_header* pack;
+	const U8* start;
+	U16 head = 0;
+	U16 pos = 0;
+	U16 data_len;
+	U16 frame_len;
+#if defined PACK_COMPACT
+	const U8* compact;
+	bool flag_compact;
+#endif
+
+	while (true) {
+		// Find the next start code, memchr() is the fastest byte search of libc
+		start = memchr(buf + pos, PACK_START, len - pos);
+#if defined PACK_COMPACT
+		// The start code of compact package may come first
+		compact = memchr(buf + pos, PACK_START_COMPACT, ((start == NULL) ? len : (U16)(start - buf)) - pos);
+		flag_compact = (compact != NULL);
+		if (flag_compact) {
+			start = compact;
+		}
+#endif
+		if (start == NULL) {
+			// Keep the bytes may be premble of the next package
+			*used = (len - pos > 3) ? len - 3 : pos;
+			return false;
+		}
+		pos = (U16)(start - buf) + 1;
+
+#if defined PACK_COMPACT
+		if (flag_compact) {
+			// Check the premble before start code, which is one byte
+			if ((pos < 2) || (start[-1] != PACK_PREMBLE)) {
+				continue;
+			}
+			head = pos - 2;
+
+			// Wait for the rest of header
+			if (head + sizeof(struct pack_compact_header) > len) {
+				break;
+			}
+
+			// Check the data length, a wrong one is noise
+			data_len = ((const struct pack_compact_header*)(buf + head))->len_flags;
+			if ((data_len < 1) || (data_len > COMPACT_MAX_DATA_LEN)) {
+				continue;
+			}
+			frame_len = sizeof(struct pack_compact_header) + data_len + PACK_FEC_LEN;
+		} else
+#endif
+		{
+			// Check the premble before start code
+			if ((pos < sizeof(pack->premble) + 1)
+			|| (start[-1] != PACK_PREMBLE)
+			|| (start[-2] != PACK_PREMBLE)
+			|| (start[-3] != PACK_PREMBLE)) {
+				continue;
+			}
+			head = pos - sizeof(pack->premble) - 1;
+			pack = (const struct pack_header*)(buf + head);
+
+			// Wait for the rest of header
+			if (head + sizeof(struct pack_header) > len) {
+				break;
+			}
+
+			// Check the data length, a wrong one is noise
+#if defined PACK_FEC
+			data_len = get_fec_len(pack);
+#else
+			data_len = get_pack_u16(pack->len);
+#endif
+			if ((data_len < 1) || (data_len > MAX_DATA_LEN)) {
+				continue;
+			}
+			frame_len = sizeof(struct pack_header) + data_len + PACK_FEC_LEN;
+		}
+
+		// Wait for the rest of package
+		if (head + frame_len > len) {
+			break;
+		}
+
+		memcpy(cur_link->recv_buf, buf + head, frame_len);
+		*result = check_pack();
+		if (*result == PACK_RECV_CHKSUM_ERR) {
+			continue;
+		}
+		// Addresses and seqno are checked before checksum, so the package
+		// is only skipped as a whole if checksum is right, the compact one
+		// is in full header now
+		pack = (const struct pack_header*)cur_link->recv_buf;
+		if ((*result == PACK_RECV_DEST_ERR || *result == PACK_RECV_SRC_ERR || *result == PACK_RECV_SEQNO_ERR)
+		&& (get_pack_u16(pack->chksum) != PACK_CHECKSUM(pack->dest, data_len + CHECKSUM_HEAD_LEN))) {
+			continue;
+		}
+		*used = head + frame_len;
+		return true;
+	}
+
+	*used = head;
+	return false;
+}
+
+#endif
+
 // When ack timeout, master will resend the last package and return the resend times
 U16 master_check_ack_delay(void)
 {
 	// Check if master is waiting for ack
-	if (flag_master_need_ack) {
+#if defined PACK_TX_ASYNC
+	if (cur_link->flag_master_need_ack && cur_link->flag_master_tx_done) {
+#else
+	if (cur_link->flag_master_need_ack) {
+#endif
 		// Check if ack timeout
-		if ((LOCAL_TIME() - master_send_time_last) > master_max_ack_delay) {
+		if ((LOCAL_TIME() - cur_link->master_send_time_last) > cur_link->master_ack_delay) {
+			TRACE_PACK(TRACE_TIMEOUT, 0, cur_link->send_buf, sizeof(struct pack_header));
 			// Increment the resend times of master by 1
-			master_retry_times++;
+			cur_link->master_retry_times++;
+#if !defined PACK_ROLE_SLAVE
+			// Nothing answered the last sending, a broken ack before it is
+			// not reported
+			cur_link->flag_req_err_seen = false;
+#endif
 			// Resend the last sent package
-			resend_pack();
+			resend_pack(PACK_SEND_RETRY);
 		}
 	}
 
-	return master_retry_times;
+	return cur_link->master_retry_times;
+}
+
+// Master resends at once after receiving 'stale_acks' intact acks with wrong
+// seqno from the slave, instead of waiting for ack timeout, 0 to disable
+void master_set_fast_retry(U8 stale_acks)
+{
+	cur_link->master_fast_retry_acks = stale_acks;
+	cur_link->master_stale_ack_count = 0;
+}
+
+// Set the model of bus for airtime of packages, 'baud' is bits per second
+// and 100 at least, 'bits_per_byte' counts start, parity and stop bits,
+// 'turnaround' is the microseconds between a package and the next one
+void set_pack_airtime(U32 baud, U8 bits_per_byte, U32 turnaround)
+{
+	cur_link->bus_baud = (baud >= 100) ? baud : 0;
+	cur_link->bus_bits_per_byte = bits_per_byte;
+	cur_link->bus_turnaround = turnaround;
+	cur_link->bus_busy_time = 0;
+	cur_link->bus_load_time_last = LOCAL_TIME();
+}
+
+// Get airtime in microseconds of a package with 'data_len' bytes of data,
+// 0 if airtime is not modeled
+U32 get_pack_airtime(U16 data_len)
+{
+	return bytes_airtime(PACK_FRAME_LEN(data_len));
+}
+
+#if defined PACK_COMPACT
+// Use compact header for packages with short data if 'flag_compact'
+void set_pack_compact(bool flag_compact)
+{
+	cur_link->flag_compact = flag_compact;
+}
+#endif
+
+// Get bus load in permille, which is the airtime of packages sent and
+// received, with turnaround, per time since the last call
+U16 get_bus_load(void)
+{
+	U32 now = LOCAL_TIME();
+	U32 time = (U32)(now - cur_link->bus_load_time_last) * US_PER_TICK;
+	U32 busy = cur_link->bus_busy_time;
+
+	if (time < 1000) {
+		return 0;
+	}
+
+	cur_link->bus_load_time_last = now;
+	cur_link->bus_busy_time = 0;
+
+	// Time is divided first, so busy time of an hour can't overflow
+	busy /= time / 1000;
+
+	return (U16)((busy > 1000) ? 1000 : busy);
 }
 
 // Get the last slave address that master sent package
-U8 get_master_send_addr_last(void)
+pack_addr get_master_send_addr_last(void)
+{
+	return cur_link->master_send_addr_last;
+}
+
+#if !defined PACK_ROLE_SLAVE
+// Master submit a asynchronous request which will be completed before the
+// point-in-time 'deadline', return false if the request queue is full
+bool master_submit_pack(pack_addr dest_addr, const void* data, U16 data_len,
+                        U32 deadline, pack_req_func func, void* arg)
+{
+	return master_submit_pack_prio(PACK_PRIO_NORMAL, dest_addr, data, data_len, deadline, func, arg);
+}
+
+// Master submit a asynchronous request of class 'prio', it's sent after the
+// request in flight, before the waiting requests of lower classes. Return
+// false if the queue of class is full.
+bool master_submit_pack_prio(enum pack_prio_list prio, pack_addr dest_addr, const void* data,
+                             U16 data_len, U32 deadline, pack_req_func func, void* arg)
+{
+	struct pack_req* req;
+	struct pack_req_count* count;
+
+	// Check the class, the data length and free space of queue
+	if (((U8)prio >= PACK_PRIO_TOTAL) || (data_len < 1) || (data_len > MAX_DATA_LEN)
+	|| (cur_link->req_count[prio] >= MAX_REQ_QUEUE_SIZE)) {
+		return false;
+	}
+
+	// Append the request to the tail of queue
+	req = &cur_link->req_queue[prio][(cur_link->req_head[prio] + cur_link->req_count[prio]) % MAX_REQ_QUEUE_SIZE];
+	req->dest_addr = dest_addr;
+	req->data_len = data_len;
+	req->deadline = deadline;
+	req->time_submit = LOCAL_TIME();
+	req->func = func;
+	req->arg = arg;
+	memcpy(req->data, data, data_len);
+	cur_link->req_count[prio]++;
+
+	// Count the depth of queue
+	count = &cur_link->pack_count_info.req_count_info[prio];
+	count->submit_count++;
+	if (cur_link->req_count[prio] > count->depth_max) {
+		count->depth_max = cur_link->req_count[prio];
+	}
+
+	// Send it at once if the bus is idle
+	start_req();
+
+	return true;
+}
+
+// Get the number of requests in queue of class 'prio', the one in flight included
+U8 master_get_req_depth(enum pack_prio_list prio)
+{
+	return ((U8)prio < PACK_PRIO_TOTAL) ? cur_link->req_count[prio] : 0;
+}
+
+// Master holds the waiting requests while another sender owns the bus, e.g. a
+// burst of bulk transfer, and sends them after it releases
+void master_hold_req(bool flag_hold)
+{
+	cur_link->flag_req_hold = flag_hold;
+
+	// Send the first waiting request at once
+	start_req();
+}
+
+// Master drive the asynchronous requests, must be called periodically
+void master_poll_pack(void)
+{
+	U8 prio = cur_link->req_prio;
+
+	if (cur_link->flag_req_in_flight) {
+		// Give up the request in flight if its deadline is reached
+		if (time_reached(cur_link->req_queue[prio][cur_link->req_head[prio]].deadline)) {
+			cur_link->flag_master_need_ack = false;
+			cur_link->master_retry_times = 0;
+			finish_req(prio, cur_link->flag_req_err_seen ? PACK_REQ_ERR : PACK_REQ_TIMEOUT, NULL, 0);
+		} else {
+			// Resend the package in flight if ack timeout
+			master_check_ack_delay();
+		}
+	}
+
+	// Send the next request if the bus is idle
+	start_req();
+}
+
+// Master limits the asynchronous requests of slave 'slave_addr' to 'share'
+// permille of bus time, with bursts of 'burst' microseconds, return false
+// if the peer table is full
+bool master_set_budget(pack_addr slave_addr, U16 share, U32 burst)
+{
+	struct pack_peer* budget = find_peer(slave_addr, share > 0);
+
+	// Remove the budget, the slave keeps its entry
+	if (share == 0) {
+		if (budget != NULL) {
+			budget->share = 0;
+		}
+		return true;
+	}
+
+	if (budget == NULL) {
+		return false;
+	}
+
+	budget->share = (share > 1000) ? 1000 : share;
+	budget->burst = burst;
+	budget->tokens = burst;
+	budget->time_last = LOCAL_TIME();
+
+	return true;
+}
+
+// Master keeps the state of slaves in peer table 'table' of 'size' entries
+// instead of the small table in link, 'size' must be power of 2 and 32768
+// at most, the state of slaves in the old table is dropped. Return false if
+// 'size' is not a power of 2, the table is kept then.
+bool master_set_peer_table(struct pack_peer* table, U16 size)
+{
+	// Index of entry is masked by size - 1
+	if ((table == NULL) || (size == 0) || ((size & (size - 1)) != 0) || (size > 32768U)) {
+		return false;
+	}
+
+	memset(table, 0, sizeof(*table) * size);
+	cur_link->peers = table;
+	cur_link->peer_size = size;
+	cur_link->peer_count = 0;
+
+	return true;
+}
+
+// Get the state of slave 'slave_addr' kept by master, NULL if it's not in
+// peer table
+const struct pack_peer* master_get_peer(pack_addr slave_addr)
 {
-	return master_send_addr_last;
+	return find_peer(slave_addr, false);
 }
+#endif
 
 // Get statistics for sent and received package
 struct pack_count* get_pack_count_info(void)
 {
-	return &pack_count_info;
+	return &cur_link->pack_count_info;
 }
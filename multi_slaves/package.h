@@ -11,17 +11,46 @@
  *            6. Support variable-length data part.
  *            7. Application can define their own data structure.
  *            8. Statistics for every sent and received package.
+ *            9. Asynchronous requests of master with completion callbacks,
+ *               in priority classes, urgent ones jump the queue.
+ *           10. Slave answers duplicate requests from its cache of recent acks.
+ *           11. Trace of every sent and received package.
+ *           12. Reentrant, a process can drive many links, one per thread.
+ *           13. Resynchronizes on the next package after line noise.
+ *           14. Optional COBS framing with unambiguous frame boundaries.
+ *           15. Optional forward error correction of received packages.
+ *           16. Fast resend of master on stale acks, before ack timeout.
+ *           17. Airtime model of bus, for ack timeout by package size, bus
+ *               load and airtime budgets of slaves.
+ *           18. Optional asynchronous sending with 2 buffers, for DMA or
+ *               interrupt-driven lower layer.
+ *           19. Master repeats a package with new header in constant time,
+ *               by patching the checksum incrementally.
+ *           20. Optional 16-bit addresses, and a hashed peer table of master
+ *               for the state of thousands of slaves.
+ *           21. Seqno compared by serial number arithmetic, slave drops
+ *               delayed duplicates, optional 32-bit seqno.
+ *           22. Optional histogram of ack delay, and statistics published
+ *               to shared memory for monitoring tools.
+ *           23. Optional timestamps in packages, master estimates clock
+ *               offset of slaves NTP-like, and splits round-trip time into
+ *               wire time and service time of slave.
+ *           24. Optional compact header for short data, negotiated with
+ *               each slave, both formats are accepted.
  * ======================================================================== */
 
 #ifndef _PACKAGE_H
 #define _PACKAGE_H
 
 #include <time.h>
+#include <string.h>
+#include <stddef.h>
 #include <stdbool.h>
 
 // Define CPU type
 #define X86
 //#define AVR
+//#define ARM
 
 // Definitions of basic type
 #if defined X86
@@ -29,48 +58,264 @@
 	typedef unsigned char  U8;
 	typedef unsigned short U16;
 	typedef unsigned int   U32;
+	#define PACK_LITTLE_ENDIAN
+	#define PACK_THREAD_LOCAL __thread
 #elif defined AVR
 	// AVR MCU
 	typedef unsigned char U8;
 	typedef unsigned int  U16;
 	typedef unsigned long U32;
+	#define PACK_LITTLE_ENDIAN
+	#define PACK_THREAD_LOCAL
+#elif defined ARM
+	// ARM MCU
+	typedef unsigned char  U8;
+	typedef unsigned short U16;
+	typedef unsigned int   U32;
+	#define PACK_LITTLE_ENDIAN
+	#define PACK_THREAD_LOCAL
 #endif
 
 // Function type of callback function for sending bytes
 typedef void (*send_bytes_func)(U8* buf, U16 count);
 
-// Get local time
-#define LOCAL_TIME() (clock())
+// Define PACK_WIDE_ADDR for 16-bit addresses instead of 8-bit, for buses with
+// more than 254 slaves, the header is 2 bytes longer
+//#define PACK_WIDE_ADDR
+
+// Type of address
+#if defined PACK_WIDE_ADDR
+	typedef U16 pack_addr;
+	#define PACK_ADDR_LEN 2
+#else
+	typedef U8 pack_addr;
+	#define PACK_ADDR_LEN 1
+#endif
+// Number of addresses
+#define PACK_ADDR_COUNT (1UL << (PACK_ADDR_LEN * 8))
+
+// Define PACK_WIDE_SEQNO for 32-bit seqno instead of 16-bit, so seqno won't
+// wrap in a long time on fast links, the header is 2 bytes longer
+//#define PACK_WIDE_SEQNO
+
+// Type of seqno
+#if defined PACK_WIDE_SEQNO
+	typedef U32 pack_seqno;
+	#define PACK_SEQNO_LEN 4
+#else
+	typedef U16 pack_seqno;
+	#define PACK_SEQNO_LEN 2
+#endif
+
+// Define PACK_TIMESTAMP to carry timestamps in packages, so master estimates
+// clock offset of slaves NTP-like, and splits round-trip time of each
+// exchange into wire time and service time of slave, the header is 8 bytes
+// longer
+//#define PACK_TIMESTAMP
+#if defined PACK_TIMESTAMP
+	#define PACK_STAMP_LEN 8
+#else
+	#define PACK_STAMP_LEN 0
+#endif
+
+// Define PACK_COMPACT for a compact header of packages with short data, which
+// has 1 byte of premble, 8-bit seqno, and data length packed with flags, so
+// it's 4 bytes shorter, or 6 bytes with PACK_WIDE_SEQNO. Links use it after
+// set_pack_compact(), and check_pack() accepts both formats. It can't be
+// used with PACK_TIMESTAMP.
+//#define PACK_COMPACT
+#if defined PACK_COMPACT && defined PACK_TIMESTAMP
+	#error "PACK_COMPACT can't carry the timestamps of PACK_TIMESTAMP"
+#endif
+
+// Enable trace of packages, it needs trace.c
+//#define PACK_TRACE
+
+// Keep a histogram of ack delay of master in statistics, which stats.c
+// publishes with the other statistics to shared memory for monitoring tools
+//#define PACK_STATS
+// Number of buckets in histogram of ack delay, bucket 0 counts delays of 0
+// tick, bucket n counts delays from 2^(n-1) to 2^n-1 ticks, the last bucket
+// counts the longer ones too
+#define PACK_HIST_SIZE 20
+
+// Frame packages by COBS with a zero delimiter instead of premble only, so
+// boundaries of frames are unambiguous, it needs cobs.c
+//#define PACK_FRAMING_COBS
+
+// Correct byte errors of received packages by Reed-Solomon code, the value is
+// the maximum bytes corrected in a package, each costs 2 parity bytes that
+// appended to the package, and 2 more in the header, whose own parity
+// corrects the length before the parity of package is found by it. It needs
+// fec.c
+//#define PACK_FEC 2
+
+// Define PACK_TX_ASYNC if the lower layer sends bytes in background, e.g. by
+// DMA or interrupt of UART, then send_bytes_func returns at once and the
+// lower layer calls tx_complete() after the last byte is out. Frames take
+// turns in 2 buffers, and ack timeout of master starts from tx_complete().
+// PACK_TX_LOCK() and PACK_TX_UNLOCK() mask and unmask the interrupt that
+// calls tx_complete(), e.g. cli() and sei() on AVR
+//#define PACK_TX_ASYNC
+#if defined PACK_TX_ASYNC && !defined PACK_TX_LOCK
+	#define PACK_TX_LOCK()
+	#define PACK_TX_UNLOCK()
+#endif
+
+// Define role of the machine at compile time, so that the code for the other
+// role is removed, leave both undefined to select the role at runtime
+//#define PACK_ROLE_MASTER
+//#define PACK_ROLE_SLAVE
+
+// Define PACK_CHECKSUM to replace the checksum algorithm with a function of
+// application, its prototype is 'U16 func(const U8* addr, U16 count)'
+//#define PACK_CHECKSUM crc16
+
+// Get local time, define PACK_CLOCK_EXTERN to use the time function of
+// application instead, e.g. a monotonic clock or a simulated clock
+#if defined PACK_CLOCK_EXTERN
+	U32 pack_local_time(void);
+	#define LOCAL_TIME() (pack_local_time())
+	#define LOCAL_TIME_PER_SEC 1000
+#else
+	#define LOCAL_TIME() (clock())
+	#define LOCAL_TIME_PER_SEC CLOCKS_PER_SEC
+#endif
+// Get time of timestamps in microseconds, it wraps at 2^32, and the clock of
+// application is pack_stamp_time() with PACK_CLOCK_EXTERN
+#if defined PACK_TIMESTAMP
+	#if defined PACK_CLOCK_EXTERN
+		U32 pack_stamp_time(void);
+		#define STAMP_TIME() (pack_stamp_time())
+	#else
+		#define STAMP_TIME() ((U32)(clock() * (1000000.0 / CLOCKS_PER_SEC)))
+	#endif
+#endif
 
-// Maximum buffer size
-#define MAX_BUF_SIZE 100
+// Maximum buffer size, can be defined by compiler option
+#ifndef MAX_BUF_SIZE
+	#define MAX_BUF_SIZE 100
+#endif
+// Length of parity appended to package
+#if defined PACK_FEC
+	#define PACK_FEC_LEN (PACK_FEC * 2)
+	// A codeword begins from checksum, and it's 255 bytes at most
+	#if MAX_BUF_SIZE > 255 + 4 + PACK_FEC_LEN
+		#error "MAX_BUF_SIZE is too large for PACK_FEC"
+	#endif
+#else
+	#define PACK_FEC_LEN 0
+#endif
 // Maxinum size of data part
-#define MAX_DATA_LEN (MAX_BUF_SIZE - sizeof(struct pack_header))
+#define MAX_DATA_LEN (MAX_BUF_SIZE - sizeof(struct pack_header) - PACK_FEC_LEN)
+// Length of package with 'len' bytes of data
+#define PACK_LEN(len) (sizeof(struct pack_header) + (len) + PACK_FEC_LEN)
+// Length of package with 'len' bytes of data on the bus, the worst case of COBS
+#if defined PACK_FRAMING_COBS
+	#define PACK_FRAME_LEN(len) (PACK_LEN(len) + PACK_LEN(len) / 254 + 2)
+#else
+	#define PACK_FRAME_LEN(len) PACK_LEN(len)
+#endif
+// Maximum size of frame on the bus, which is a package encoded by COBS with
+// the delimiter, or the package itself
+#if defined PACK_FRAMING_COBS
+	#define MAX_FRAME_SIZE (MAX_BUF_SIZE + MAX_BUF_SIZE / 254 + 2)
+#else
+	#define MAX_FRAME_SIZE MAX_BUF_SIZE
+#endif
+// Maximum number of asynchronous requests waiting in master's queue
+#define MAX_REQ_QUEUE_SIZE 4
+// Number of entries in the peer table of master in link, must be power of 2,
+// 3/4 of them can be used, a larger table can be set by master_set_peer_table()
+#define MAX_PEER_SIZE 16
+// Number of recent acks that slave caches for duplicate requests, must be
+// power of 2, each costs MAX_BUF_SIZE + 4 bytes
+#define SLAVE_CACHE_SIZE 4
+
+// The first seqno of master after it's initialized, the seqno skips it and 0
+// on wraparound, so slave always takes it as a new request, for restart of
+// master
+#define SEQNO_FIRST 1
+// Requests whose seqno is before the last one that slave received, by this
+// at most, are delayed duplicates, slave drops them
+#define SLAVE_SEQNO_WINDOW 256
+// Clock offset of slave is taken from the sample of the least wire time,
+// which is hurt the least by asymmetric delay, and a sample of longer wire
+// time replaces it after this many samples, so the offset follows drift
+#define PACK_CLOCK_AGE 8
 
 // Premble
 #define PACK_PREMBLE '-'
 // Start code
 #define PACK_START   '>'
+// Start code of compact package
+#define PACK_START_COMPACT '<'
 
-// The length for checksum computing before 'data' in struct pack_header
-#define CHECKSUM_HEAD_LEN 6
+// The length for checksum computing before 'data' in struct pack_header,
+// which is from 'dest' to 'len'
+#define CHECKSUM_HEAD_LEN (PACK_ADDR_LEN * 2 + PACK_SEQNO_LEN + PACK_STAMP_LEN + 2)
+// The length for FEC before 'data' in struct pack_header, which is from
+// 'chksum' to 'len'
+#define FEC_HEAD_LEN (CHECKSUM_HEAD_LEN + 2)
 
-// Package header
+// Package header, it's made of bytes only, so the layout is same on every
+// CPU, multi-byte fields are little-endian and accessed by get_pack_u16()
+// and put_pack_u16(), addresses are accessed by get_pack_addr() and
+// put_pack_addr()
 struct pack_header {
 	U8 premble[3]; // Premble
 	U8 start;      // Start code
-	U16 chksum;    // Checksum that computed from 'dest' to the tail of 'data'
-	U8 dest;       // destination address
-	U8 src;        // source address
-	U16 seqno;     // Sequence number
-	U16 len;       // Length of data part
+#if defined PACK_FEC
+	U8 head_fec[PACK_FEC_LEN]; // Parity of the fields from 'chksum' to 'len', at a fixed place
+#endif
+	U8 chksum[2];  // Checksum that computed from 'dest' to the tail of 'data'
+	U8 dest[PACK_ADDR_LEN]; // destination address
+	U8 src[PACK_ADDR_LEN];  // source address
+	U8 seqno[PACK_SEQNO_LEN]; // Sequence number
+#if defined PACK_TIMESTAMP
+	U8 stamp[4];   // Time of sender when the package is sent, in microseconds
+	U8 service[4]; // Microseconds from the request to its ack in slave, 0 for master
+#endif
+	U8 len[2];     // Length of data part
+	U8 data[];     // Data part
+};
+
+#if defined PACK_COMPACT
+// Maximum data length of compact package
+#define COMPACT_MAX_DATA_LEN 63
+// Mask of data length in 'len_flags' of compact header, the other bits are
+// flags, which are 0 now
+#define COMPACT_LEN_MASK 0x3F
+// Seqno of compact package is restored from the low byte as the nearest one
+// from this much before the last seqno of the receiver
+#define COMPACT_SEQNO_BEHIND 16
+// Master probes a slave by a compact request once in this many new packages
+// to it, until the slave acks in compact header
+#define COMPACT_PROBE_PERIOD 16
+
+// Compact package header, for the data part of COMPACT_MAX_DATA_LEN bytes at
+// most, on links that are synchronized. It stands for the package in struct
+// pack_header with the same fields, and 'chksum' is the checksum of that
+// package, so the receiver expands the header in place before the check,
+// restoring seqno from the last one it knows. A wrong seqno fails the
+// checksum.
+struct pack_compact_header {
+	U8 premble;    // Premble
+	U8 start;      // Start code of compact package
+	U8 chksum[2];  // Checksum of the package in full header
+	U8 dest[PACK_ADDR_LEN]; // destination address
+	U8 src[PACK_ADDR_LEN];  // source address
+	U8 seqno;      // The low byte of sequence number
+	U8 len_flags;  // Length of data part in low 6 bits, and flags
 	U8 data[];     // Data part
 };
+#endif
 
 // Type of sent package
 enum pack_send_type_list {
 	PACK_SEND_NEW,        // New package
-	PACK_SEND_RETRY,      // Resending package
+	PACK_SEND_RETRY,      // Resending package for ack timeout or duplicate request
+	PACK_SEND_FAST_RETRY, // Resending package at once for stale acks
 
 	PACK_SEND_TYPE_TOTAL, // Total type of sent package
 };
@@ -90,35 +335,395 @@ enum pack_recv_type_list {
 	PACK_RECV_TYPE_TOTAL,  // Total type of received package
 };
 
+// Result of asynchronous request
+enum pack_req_result_list {
+	PACK_REQ_ACK,          // Ack package received
+	PACK_REQ_TIMEOUT,      // The last sending is not answered before the deadline
+	PACK_REQ_ERR,          // The last sending is answered by a broken ack package only
+
+	PACK_REQ_RESULT_TOTAL, // Total type of request result
+};
+
+// Priority class of asynchronous request, a waiting request of a class is sent
+// before all requests of lower classes
+enum pack_prio_list {
+	PACK_PRIO_URGENT,      // Urgent command, e.g. emergency stop, not limited by budget
+	PACK_PRIO_NORMAL,      // Normal request, the class of master_submit_pack()
+
+	PACK_PRIO_TOTAL,       // Total priority classes
+};
+
+// Function type of callback function for request completion, 'data' and
+// 'data_len' give the data part of the ack package if result is PACK_REQ_ACK
+typedef void (*pack_req_func)(pack_addr dest_addr, enum pack_req_result_list result,
+                              const void* data, U16 data_len, void* arg);
+
+// Statistics for asynchronous requests of a priority class, latency is the
+// ticks from submitting to completion with any result
+struct pack_req_count {
+	U32 submit_count;      // Requests submitted
+	U32 done_count;        // Requests completed
+	U32 latency_sum;       // Sum of latency of completed requests
+	U32 latency_max;       // Maximum latency
+#if defined PACK_STATS
+	U32 latency_hist[PACK_HIST_SIZE]; // Histogram of latency
+#endif
+	U8 depth_max;          // Maximum requests in queue
+};
+
 // Statistics for sent and received packages
 struct pack_count {
 	U32 send_pack_count[PACK_SEND_TYPE_TOTAL]; // Statistics for sent packages
 	U32 recv_pack_count[PACK_RECV_TYPE_TOTAL]; // Statistics for received packages
+#if defined PACK_FEC
+	U32 fec_pack_count;                        // Received packages corrected by FEC
+	U32 fec_byte_count;                        // Bytes corrected by FEC
+#endif
+#if defined PACK_COMPACT
+	U32 compact_send_count;                    // Packages sent in compact header
+	U32 compact_recv_count;                    // Packages received in compact header
+#endif
+#if defined PACK_STATS
+	U32 ack_delay_hist[PACK_HIST_SIZE];        // Histogram of ticks from new package to its ack, retries included
+#endif
+#if !defined PACK_ROLE_SLAVE
+	struct pack_req_count req_count_info[PACK_PRIO_TOTAL]; // Statistics for requests of each class
+#endif
+};
+
+// Read a little-endian 16-bit field of package
+static inline U16 get_pack_u16(const U8* p)
+{
+#if defined PACK_LITTLE_ENDIAN
+	U16 value;
+
+	// memcpy() of a word is one load where unaligned access is allowed, and
+	// doesn't break strict aliasing as a cast does
+	memcpy(&value, p, sizeof(value));
+	return value;
+#else
+	return (U16)(p[0] | (p[1] << 8));
+#endif
+}
+
+// Write a little-endian 16-bit field of package
+static inline void put_pack_u16(U8* p, U16 value)
+{
+#if defined PACK_LITTLE_ENDIAN
+	// memcpy() of a word is one store where unaligned access is allowed
+	memcpy(p, &value, sizeof(value));
+#else
+	p[0] = (U8)value;
+	p[1] = (U8)(value >> 8);
+#endif
+}
+
+// Read a little-endian 32-bit field of package
+static inline U32 get_pack_u32(const U8* p)
+{
+	return get_pack_u16(p) | ((U32)get_pack_u16(p + 2) << 16);
+}
+
+// Write a little-endian 32-bit field of package
+static inline void put_pack_u32(U8* p, U32 value)
+{
+	put_pack_u16(p, (U16)value);
+	put_pack_u16(p + 2, (U16)(value >> 16));
+}
+
+// Read the seqno field of package
+static inline pack_seqno get_pack_seqno(const U8* p)
+{
+#if defined PACK_WIDE_SEQNO
+	return get_pack_u16(p) | ((U32)get_pack_u16(p + 2) << 16);
+#else
+	return get_pack_u16(p);
+#endif
+}
+
+// Write the seqno field of package
+static inline void put_pack_seqno(U8* p, pack_seqno seqno)
+{
+#if defined PACK_WIDE_SEQNO
+	put_pack_u16(p, (U16)seqno);
+	put_pack_u16(p + 2, (U16)(seqno >> 16));
+#else
+	put_pack_u16(p, seqno);
+#endif
+}
+
+// Check if seqno 'a' is before 'b' by serial number arithmetic of RFC 1982,
+// which is right over wraparound, 'a' is before 'b' if 'b' is ahead of it
+// by less than half of the seqno space
+static inline bool seqno_before(pack_seqno a, pack_seqno b)
+{
+	return (a != b) && ((pack_seqno)(b - a) < ((pack_seqno)1 << (PACK_SEQNO_LEN * 8 - 1)));
+}
+
+// Read an address field of package
+static inline pack_addr get_pack_addr(const U8* p)
+{
+#if defined PACK_WIDE_ADDR
+	return get_pack_u16(p);
+#else
+	return p[0];
+#endif
+}
+
+// Write an address field of package
+static inline void put_pack_addr(U8* p, pack_addr addr)
+{
+#if defined PACK_WIDE_ADDR
+	put_pack_u16(p, addr);
+#else
+	p[0] = addr;
+#endif
+}
+
+#if !defined PACK_ROLE_SLAVE
+// Asynchronous request waiting in master's queue
+struct pack_req {
+	pack_addr dest_addr;   // Destination address
+	U16 data_len;          // Length of data part
+	U32 deadline;          // The point-in-time that request must be completed
+	U32 time_submit;       // The point-in-time that request was submitted
+	pack_req_func func;    // Callback function for request completion
+	void* arg;             // Argument for callback function
+	U8 data[MAX_DATA_LEN]; // Data part
+};
+#endif
+
+// State of a slave kept by master, an entry of the peer table that is open
+// addressed by slave address. It costs 24 bytes on 32-bit CPU, or 28 bytes
+// with PACK_WIDE_ADDR, and 24 bytes more with PACK_TIMESTAMP, or 4 bytes
+// more with PACK_COMPACT.
+struct pack_peer {
+	U32 burst;             // Maximum tokens of airtime budget in microseconds of bus time
+	U32 tokens;            // Tokens left in microseconds of bus time
+	U32 time_last;         // The last point-in-time that tokens were added
+	U32 send_count;        // New packages sent to slave
+	U32 ack_count;         // New acks received from slave
+#if defined PACK_TIMESTAMP
+	U32 clock_offset;      // Microseconds added to clock of master to get clock of slave, modulo 2^32
+	U32 clock_delay;       // Wire time of the sample that gave 'clock_offset'
+	U32 wire_time;         // Smoothed wire time of exchanges in microseconds, both ways
+	U32 service_time;      // Smoothed service time of slave in microseconds
+	U32 service_time_max;  // Maximum service time of slave in microseconds
+	U32 stamp_count;       // Acks sampled for timestamps
+	U8 clock_age;          // Samples since 'clock_offset' was taken
+#endif
+#if defined PACK_COMPACT
+	pack_seqno seqno_last; // The last seqno that slave acked
+	U8 compact_probe;      // New packages to slave since the last probe of compact header
+	bool flag_compact;     // If slave acked in compact header, so it's used for slave
+#endif
+	U16 share;             // Share of bus time in permille, 0 if not limited
+	pack_addr slave_addr;  // Address of slave
+	bool flag_used;        // If the entry is used
+};
+
+#if !defined PACK_ROLE_MASTER
+// Ack package cached by slave, indexed by seqno in ring
+struct pack_cache {
+	pack_seqno seqno;     // Seqno of the ack, 0 if the entry is empty
+	U16 len;              // Length of the whole ack package
+	U8 buf[MAX_BUF_SIZE]; // Ack package
+};
+#endif
+
+// Trace ring, defined in trace.h
+struct trace_ring;
+
+// Protocol state of a link, which is a node on a bus. A process may have
+// many links, the interface functions work on the link selected by
+// select_pack_link() in current thread, or the default link.
+struct pack_link {
+	U8 send_buf[MAX_BUF_SIZE];  // Sending buffer
+	U8 recv_buf[MAX_FRAME_SIZE]; // Receiving buffer for lower layer to store received data
+#if defined PACK_TX_ASYNC
+	U8 tx_buf[2][MAX_FRAME_SIZE]; // Sending buffers of frames, one is on the bus while the other is filled
+	U8 tx_next;                 // Index of the buffer to fill next
+	volatile bool flag_tx_busy; // If a frame is on the bus
+	volatile U16 tx_wait_len;   // Length of the frame waiting for the bus, 0 if none
+#elif defined PACK_FRAMING_COBS
+	U8 frame_buf[MAX_FRAME_SIZE]; // Sending buffer of frame encoded by COBS
+#endif
+#if defined PACK_COMPACT
+	U8 compact_buf[sizeof(struct pack_compact_header) + COMPACT_MAX_DATA_LEN + PACK_FEC_LEN]; // Sending buffer of compact package
+	bool flag_compact;          // If compact header is used for short packages
+	bool flag_recv_compact;     // If the last new package received is compact
+#endif
+	void* send_data;            // Sending data address for application to store its sending data
+	const void* recv_data;      // Receiving data address for application to read its receiving data
+	bool flag_is_master;        // If the machine is master
+	bool flag_is_monitor;       // If the machine is monitor of bus
+	pack_addr local_addr;       // Local address
+	pack_addr master_addr;      // Master address
+	U32 master_max_ack_delay;   // The max wait time that master waiting for ack
+	send_bytes_func send_bytes; // Callback function for sending bytes
+	struct trace_ring* trace;   // Trace ring of link, NULL if not traced
+	U32 bus_baud;               // Baud rate of bus, 0 if airtime is not modeled
+	U8 bus_bits_per_byte;       // Bits on bus for each byte, e.g. 10 for 8N1
+	U32 bus_turnaround;         // Microseconds between a package and the next one
+	U32 bus_busy_time;          // Microseconds of airtime since bus load was read
+	U32 bus_load_time_last;     // The last point-in-time that bus load was read
+
+	pack_seqno slave_recv_seqno_last;  // The last seqno that slave received
+	pack_seqno master_send_seqno_last; // The last seqno that master sent
+	bool flag_master_need_ack;  // If master is waiting for ack
+	volatile U32 master_send_time_last; // The last point-in-time that master sent package
+#if defined PACK_STATS
+	U32 master_send_time_first; // The point-in-time that master sent the package first
+#endif
+#if defined PACK_TIMESTAMP
+	U32 master_send_stamp;      // Time of timestamps that master sent the last new package
+	bool flag_master_stamp_valid; // If an ack can be sampled, it's not after a resending
+	U32 slave_recv_stamp;       // Time of timestamps that slave received the last new request
+#endif
+#if defined PACK_TX_ASYNC
+	volatile bool flag_master_tx_done; // If the last package of master is out
+#endif
+	U32 master_ack_delay;       // Ack timeout of the last package that master sent
+	U16 master_retry_times;     // The resend times of master
+	pack_addr master_send_addr_last; // The last slave address that master sent package
+	U8 master_fast_retry_acks;  // Stale acks that make master resend at once, 0 if disabled
+	U8 master_stale_ack_count;  // Stale acks received since the last sending
+	struct pack_count pack_count_info; // Statistics for sent and received packages
+
+#if !defined PACK_ROLE_SLAVE
+	struct pack_req req_queue[PACK_PRIO_TOTAL][MAX_REQ_QUEUE_SIZE]; // Queues of asynchronous requests of each class
+	U8 req_head[PACK_PRIO_TOTAL];  // Index of the first request in queue of each class
+	U8 req_count[PACK_PRIO_TOTAL]; // Number of requests in queue of each class
+	U8 req_prio;                // Class of the request in flight, the first one of its queue
+	bool flag_req_in_flight;    // If a request is sent and waiting for ack
+	bool flag_req_err_seen;     // If a broken ack answered the last sending of request in flight
+	bool flag_req_hold;         // If requests wait for another sender, e.g. a burst of bulk transfer
+	struct pack_peer peer_buf[MAX_PEER_SIZE]; // Peer table in link
+	struct pack_peer* peers;    // Peer table of master, 'peer_buf' or a table of application
+	U16 peer_size;              // Number of entries in peer table, power of 2
+	U16 peer_count;             // Number of used entries in peer table
+#endif
+
+#if !defined PACK_ROLE_MASTER
+	struct pack_cache slave_cache[SLAVE_CACHE_SIZE]; // Recent acks of slave
+#endif
 };
 
 // ============================ Global Variables ============================
-// Receiving buffer for lower layer to store received data
-extern U8 recv_buf[MAX_BUF_SIZE];
+// The global buffers below belong to the default link
+// Receiving buffer for lower layer to store received data, a lower layer in
+// interrupt handler puts bytes to a ring of ring.h instead, which fills it
+extern U8* const recv_buf;
 // Sending data address for application to store its sending data
-extern void* send_data;
+extern void* const send_data;
 // Receiving data address for application to read its receiving data
-extern const void* recv_data;
+extern const void* const recv_data;
 
 // =========================== Interface Functions ==========================
+// Select the link that interface functions work on in current thread, NULL
+// for the default link, the link must be initialized before use
+void select_pack_link(struct pack_link* link);
+// Get the link selected in current thread
+struct pack_link* get_pack_link(void);
+// Attach a trace ring to the selected link, NULL to stop trace, the default
+// link is traced to 'pack_trace' if PACK_TRACE is defined
+void set_pack_trace(struct trace_ring* ring);
 // Master initialize protocol
-void master_init_pack(U8 my_addr, U32 max_ack_delay, send_bytes_func func);
+void master_init_pack(pack_addr my_addr, U32 max_ack_delay, send_bytes_func func);
 // Slave initialize protocol
-void slave_init_pack(U8 my_addr, U8 master_add, send_bytes_func func);
+void slave_init_pack(pack_addr my_addr, pack_addr master_add, send_bytes_func func);
+// Monitor initialize protocol, check_pack() of monitor only checks integrity
+// of package, for tools watching the bus or replaying captured packages
+void monitor_init_pack(void);
 // Master send package
-void master_send_pack(U8 dest_addr, U16 data_len);
+void master_send_pack(pack_addr dest_addr, U16 data_len);
 // Slave send package
 void slave_send_pack(U16 data_len);
+// Master sends the last package again as a new one to slave 'dest_addr',
+// e.g. to repeat a command or to fail over to a backup slave, the checksum
+// is patched for the new header instead of summed again
+void master_repeat_pack(pack_addr dest_addr);
+// Master continues from seqno 'seqno', the next new package is sent with
+// the seqno after it, e.g. to resume the seqno kept over a restart, or to
+// test the wraparound
+void master_set_pack_seqno(pack_seqno seqno);
+#if defined PACK_TX_ASYNC
+// Lower layer tells that the bytes of the last send_bytes_func are out, the
+// next frame is sent from here if it's waiting, can be called in interrupt
+void tx_complete(void);
+#endif
+// Check if a package can be sent now without replacing the frame waiting for
+// the bus, it's always true without PACK_TX_ASYNC, for senders of bursts
+bool is_pack_tx_ready(void);
 // Check validity of the received package
 enum pack_recv_type_list check_pack(void);
+#if defined PACK_FRAMING_COBS
+// Decode the frame of 'len' bytes in recv_buf in place and check it, the
+// lower layer stores the bytes before delimiter to recv_buf
+enum pack_recv_type_list check_frame(U16 len);
+#endif
+// Find and check the next package in bytes from lower layer, skipping line
+// noise, return true if a package is checked and '*result' is its verdict,
+// '*used' bytes are consumed, pass the rest again with more bytes appended
+bool scan_pack(const U8* buf, U16 len, U16* used, enum pack_recv_type_list* result);
 // When ack timeout, master will resend the last package and return the resend times
 U16 master_check_ack_delay(void);
+// Master resends at once after receiving 'stale_acks' intact acks with wrong
+// seqno from the slave, instead of waiting for ack timeout, 0 to disable,
+// which is the default
+void master_set_fast_retry(U8 stale_acks);
+// Set the model of bus for airtime of packages, 'baud' is bits per second
+// and 100 at least, 'bits_per_byte' counts start, parity and stop bits,
+// 'turnaround' is the microseconds between a package and the next one.
+// Then ack timeout of master is 'max_ack_delay' plus the airtime of the
+// package and the longest ack. 'baud' 0 disables the model.
+void set_pack_airtime(U32 baud, U8 bits_per_byte, U32 turnaround);
+// Get airtime in microseconds of a package with 'data_len' bytes of data,
+// 0 if airtime is not modeled
+U32 get_pack_airtime(U16 data_len);
+#if defined PACK_COMPACT
+// Use compact header for packages with short data if 'flag_compact', which
+// both master and slaves set. Slave acks in it only when the request is in
+// it. Master sends in it to a slave after the slave acks a compact probe,
+// and while the slave is synchronized, resending is always in full header.
+void set_pack_compact(bool flag_compact);
+#endif
+// Get bus load in permille, which is the airtime of packages sent and
+// received, with turnaround, per time since the last call
+U16 get_bus_load(void);
 // Get the last slave address that master sent package
-U8 get_master_send_addr_last(void);
+pack_addr get_master_send_addr_last(void);
+// Master submit a asynchronous request which will be completed before the
+// point-in-time 'deadline', return false if the request queue is full
+bool master_submit_pack(pack_addr dest_addr, const void* data, U16 data_len,
+                        U32 deadline, pack_req_func func, void* arg);
+// Master submit a asynchronous request of class 'prio', it's sent after the
+// request in flight, before the waiting requests of lower classes. Return
+// false if the queue of class is full.
+bool master_submit_pack_prio(enum pack_prio_list prio, pack_addr dest_addr, const void* data,
+                             U16 data_len, U32 deadline, pack_req_func func, void* arg);
+// Get the number of requests in queue of class 'prio', the one in flight included
+U8 master_get_req_depth(enum pack_prio_list prio);
+// Master holds the waiting requests while another sender owns the bus, e.g. a
+// burst of bulk transfer, and sends them after it releases
+void master_hold_req(bool flag_hold);
+// Master drive the asynchronous requests, must be called periodically
+void master_poll_pack(void);
+// Master limits the asynchronous requests of slave 'slave_addr' to 'share'
+// permille of bus time, with bursts of 'burst' microseconds, by airtime of
+// requests and acks. Slaves without budget are not limited, 'share' 0
+// removes the budget. Return false if the peer table is full.
+bool master_set_budget(pack_addr slave_addr, U16 share, U32 burst);
+// Master keeps the state of slaves in peer table 'table' of 'size' entries
+// instead of the small table in link, e.g. for thousands of slaves, 'size'
+// must be power of 2 and 32768 at most, and 3/4 of entries can be used. The
+// state of slaves in the old table is dropped. Slaves are added to the table
+// when master sends to them, so lookups are O(1) in check_pack(). Return
+// false if 'size' is not a power of 2, the table is kept then.
+bool master_set_peer_table(struct pack_peer* table, U16 size);
+// Get the state of slave 'slave_addr' kept by master, NULL if it's not in
+// peer table
+const struct pack_peer* master_get_peer(pack_addr slave_addr);
 // Get statistics for sent and received package
 struct pack_count* get_pack_count_info(void);
 
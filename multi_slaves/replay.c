@@ -0,0 +1,375 @@
+/* ==========================================================================
+ * replay.c: Replay Tool for Captured Packages
+ *
+ * function:  1. Reads a pcap file dumped by trace_dump(), or a raw byte
+ *               stream captured from the bus.
+ *            2. Feeds the raw byte stream through scan_pack() of a monitor,
+ *               so framing, FEC and compact header are those of the build,
+ *               or every complete package of pcap file through check_pack(),
+ *               and reports the throughput of parser in MB/s.
+ *            3. Packages of pcap file cut by the snap length are reported,
+ *               not parsed, the capture must be built with TRACE_SNAP_LEN
+ *               of MAX_BUF_SIZE for the throughput of long packages.
+ *            4. Rebuilds the RTT, retry and error timelines of every slave.
+ *
+ * usage:     replay [-n loops] [-m master_addr] [-v] file
+ *               -n  Times to feed the packages through parser, default 1
+ *               -m  Master address of raw byte stream, default is the
+ *                   source address of the first package
+ *               -v  Print the timeline of every event
+ * ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "package.h"
+#include "trace.h"
+
+// Package found in the captured file
+struct frame {
+	double time;   // Time in milliseconds, negative if unknown
+	U8 type;       // Type of trace event, TRACE_RECV for raw byte stream
+	U8 verdict;    // Verdict of trace, or of monitor for raw byte stream
+	U16 cap_len;   // Length of captured bytes
+	U16 len;       // Length of the whole package
+	const U8* buf; // Captured bytes
+};
+
+// Statistics of a slave
+struct slave_stat {
+	U32 request;       // New requests sent to slave
+	U32 retry;         // Requests resent to slave
+	U32 ack;           // Acks received from slave
+	U32 timeout;       // Ack timeouts of master
+	U32 error;         // Broken packages from slave
+	U32 rtt_count;     // Number of RTT samples
+	double rtt_min;    // Minimum RTT
+	double rtt_max;    // Maximum RTT
+	double rtt_sum;    // Sum of RTT
+	bool pending;      // If a request is waiting for ack
+	pack_seqno seqno;  // Seqno of the request waiting for ack
+	double send_time;  // Time that the request was sent first
+};
+
+// ============================ Static Variables ============================
+static struct frame* frames;           // Packages found in file
+static U32 frame_count;                // Number of packages found
+static U8* raw_packs;                  // Packages found in raw byte stream, as checked in recv_buf
+static const U8* raw_buf;              // Raw byte stream, NULL for pcap file
+static size_t raw_size;                // Length of raw byte stream
+static struct slave_stat slaves[PACK_ADDR_COUNT]; // Statistics indexed by address
+static bool flag_verbose;              // If print the timeline
+
+// Print name of received package type
+static const char* recv_type_name[PACK_RECV_TYPE_TOTAL] = {
+	"NEW", "RETRY", "PREMBLE_ERR", "START_ERR", "DEST_ERR",
+	"SRC_ERR", "SEQNO_ERR", "LEN_ERR", "CHKSUM_ERR",
+};
+
+// Read little-endian U32 from buffer
+static U32 read_u32(const U8* p)
+{
+	return (U32)p[0] | ((U32)p[1] << 8) | ((U32)p[2] << 16) | ((U32)p[3] << 24);
+}
+
+// Append a package to the list
+static void add_frame(double time, U8 type, U8 verdict, const U8* buf, U16 cap_len, U16 len)
+{
+	struct frame* f = &frames[frame_count++];
+
+	f->time = time;
+	f->type = type;
+	f->verdict = verdict;
+	f->buf = buf;
+	f->cap_len = cap_len;
+	f->len = len;
+}
+
+// Find packages in pcap file dumped by trace_dump()
+static bool parse_pcap(const U8* buf, size_t size)
+{
+	size_t pos = 24;
+	U32 cap_len;
+	U32 len;
+
+	if (read_u32(buf + 20) != TRACE_PCAP_LINKTYPE) {
+		printf("Unknown link type of pcap file.\n");
+		return false;
+	}
+
+	while (pos + 16 <= size) {
+		cap_len = read_u32(buf + pos + 8);
+		len = read_u32(buf + pos + 12);
+		if (cap_len < TRACE_PCAP_HEAD_LEN || pos + 16 + cap_len > size) {
+			break;
+		}
+		add_frame(read_u32(buf + pos) * 1000.0 + read_u32(buf + pos + 4) / 1000.0,
+		          buf[pos + 16], buf[pos + 17], buf + pos + 16 + TRACE_PCAP_HEAD_LEN,
+		          (U16)(cap_len - TRACE_PCAP_HEAD_LEN), (U16)(len - TRACE_PCAP_HEAD_LEN));
+		pos += 16 + cap_len;
+	}
+
+	return true;
+}
+
+// Feed the raw byte stream through scan_pack() of monitor, return the number
+// of packages. The packages are kept as checked in recv_buf, with the verdict
+// of monitor, if 'flag_keep' is set.
+static U32 scan_raw(bool flag_keep, U32 verdicts[PACK_RECV_TYPE_TOTAL])
+{
+	enum pack_recv_type_list verdict;
+	const struct pack_header* pack;
+	U8* out = raw_packs;
+	size_t pos = 0;
+	U16 window;
+	U16 used;
+	U16 len;
+	U32 count = 0;
+
+	while (pos < raw_size) {
+		// A window of 2 frames always holds a whole one, or it's noise
+		window = (raw_size - pos < 2 * MAX_FRAME_SIZE) ? (U16)(raw_size - pos) : 2 * MAX_FRAME_SIZE;
+		if (!scan_pack(raw_buf + pos, window, &used, &verdict)) {
+			if (used == 0) {
+				break;
+			}
+			pos += used;
+			continue;
+		}
+		pos += used;
+		verdicts[verdict]++;
+		count++;
+
+		if (flag_keep) {
+			pack = (const struct pack_header*)recv_buf;
+			len = sizeof(struct pack_header) + get_pack_u16(pack->len) + PACK_FEC_LEN;
+			if (len > MAX_BUF_SIZE) {
+				len = sizeof(struct pack_header);
+			}
+			memcpy(out, recv_buf, len);
+			add_frame(-1, TRACE_RECV, verdict, out, len, len);
+			out += len;
+		}
+	}
+
+	return count;
+}
+
+// Feed the packages through the parser of monitor, and print the throughput
+static void replay(U32 loops)
+{
+	U32 verdicts[PACK_RECV_TYPE_TOTAL] = {0};
+	enum pack_recv_type_list verdict;
+	U32 i;
+	U32 j;
+	U32 count = 0;
+	U32 truncated = 0;
+	double bytes = 0;
+	double secs;
+	clock_t start;
+
+	start = clock();
+	for (i = 0; i < loops; i++) {
+		monitor_init_pack();
+		if (raw_buf != NULL) {
+			count += scan_raw(i == 0, verdicts);
+			bytes += raw_size;
+			continue;
+		}
+		for (j = 0; j < frame_count; j++) {
+			if (frames[j].cap_len < frames[j].len || frames[j].len > MAX_BUF_SIZE) {
+				truncated += (i == 0);
+				continue;
+			}
+			memcpy(recv_buf, frames[j].buf, frames[j].len);
+			verdict = check_pack();
+			verdicts[verdict]++;
+			bytes += frames[j].len;
+			count++;
+		}
+	}
+	secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	printf("Parser: %u packages, %.0f bytes in %.3f s", count, bytes, secs);
+	if (secs > 0) {
+		printf(", %.0f packages/s, %.2f MB/s", count / secs, bytes / secs / 1e6);
+	}
+	printf("\n");
+	if (truncated > 0) {
+		printf("  %u packages cut by snap length of capture are not parsed\n", truncated);
+	}
+	for (i = 0; i < PACK_RECV_TYPE_TOTAL; i++) {
+		if (verdicts[i] > 0) {
+			printf("  %-12s %u\n", recv_type_name[i], verdicts[i]);
+		}
+	}
+}
+
+// Print a event of timeline
+static void print_event(const struct frame* f, pack_addr addr, const char* event, double rtt)
+{
+	if (!flag_verbose) {
+		return;
+	}
+	if (f->time >= 0) {
+		printf("%12.3f ", f->time);
+	}
+	printf("slave %3u %-8s seqno %5u", addr, event,
+	       (f->cap_len >= sizeof(struct pack_header))
+	       ? get_pack_seqno(((const struct pack_header*)f->buf)->seqno) : 0);
+	if (rtt >= 0) {
+		printf(" rtt %.3f", rtt);
+	}
+	printf("\n");
+}
+
+// Rebuild the timeline of every slave from packages
+static void analyse(int master_addr)
+{
+	const struct frame* f;
+	const struct pack_header* pack;
+	struct slave_stat* st;
+	double rtt;
+	pack_seqno seqno;
+	U32 i;
+
+	for (i = 0; i < frame_count; i++) {
+		f = &frames[i];
+		if (f->cap_len < sizeof(struct pack_header)) {
+			continue;
+		}
+		pack = (const struct pack_header*)f->buf;
+		seqno = get_pack_seqno(pack->seqno);
+
+		// Master address of raw byte stream is the sender of first package
+		if (master_addr < 0) {
+			master_addr = get_pack_addr(pack->src);
+		}
+
+		if (f->type == TRACE_TIMEOUT) {
+			st = &slaves[get_pack_addr(pack->dest)];
+			st->timeout++;
+			print_event(f, get_pack_addr(pack->dest), "TIMEOUT", -1);
+		} else if (f->verdict != PACK_RECV_NEW) {
+			// Broken package, charged to the source address in header
+			st = &slaves[get_pack_addr(pack->src)];
+			st->error++;
+			print_event(f, get_pack_addr(pack->src), recv_type_name[f->verdict], -1);
+		} else if (f->type == TRACE_SEND_NEW || f->type == TRACE_SEND_RETRY
+		|| (f->type == TRACE_RECV && get_pack_addr(pack->src) == master_addr)) {
+			// Request from master
+			st = &slaves[get_pack_addr(pack->dest)];
+			if (f->type == TRACE_SEND_RETRY || (f->type == TRACE_RECV
+			&& st->pending && st->seqno == seqno)) {
+				st->retry++;
+				print_event(f, get_pack_addr(pack->dest), "RETRY", -1);
+			} else {
+				st->request++;
+				st->pending = true;
+				st->seqno = seqno;
+				st->send_time = f->time;
+				print_event(f, get_pack_addr(pack->dest), "REQUEST", -1);
+			}
+		} else {
+			// Ack from slave
+			st = &slaves[get_pack_addr(pack->src)];
+			st->ack++;
+			rtt = -1;
+			if (st->pending && st->seqno == seqno && f->time >= 0 && st->send_time >= 0) {
+				rtt = f->time - st->send_time;
+				if (st->rtt_count == 0 || rtt < st->rtt_min) {
+					st->rtt_min = rtt;
+				}
+				if (st->rtt_count == 0 || rtt > st->rtt_max) {
+					st->rtt_max = rtt;
+				}
+				st->rtt_sum += rtt;
+				st->rtt_count++;
+			}
+			st->pending = false;
+			print_event(f, get_pack_addr(pack->src), "ACK", rtt);
+		}
+	}
+
+	printf("slave  request    retry      ack  timeout    error  rtt min/avg/max (ms)\n");
+	for (i = 0; i < PACK_ADDR_COUNT; i++) {
+		st = &slaves[i];
+		if (st->request + st->retry + st->ack + st->timeout + st->error == 0) {
+			continue;
+		}
+		printf("%5u %8u %8u %8u %8u %8u", i, st->request, st->retry, st->ack, st->timeout, st->error);
+		if (st->rtt_count > 0) {
+			printf("  %.3f/%.3f/%.3f", st->rtt_min, st->rtt_sum / st->rtt_count, st->rtt_max);
+		}
+		printf("\n");
+	}
+}
+
+// Replay tool
+int main(int argc, char* argv[])
+{
+	const char* file_name = NULL;
+	int master_addr = -1;
+	U32 loops = 1;
+	U8* buf;
+	size_t size;
+	FILE* fd;
+	int i;
+
+	// Parse options
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			loops = (U32)atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+			master_addr = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-v") == 0) {
+			flag_verbose = true;
+		} else {
+			file_name = argv[i];
+		}
+	}
+	if (file_name == NULL) {
+		printf("usage: replay [-n loops] [-m master_addr] [-v] file\n");
+		return 1;
+	}
+
+	// Read the whole file
+	fd = fopen(file_name, "rb");
+	if (fd == NULL) {
+		printf("Can't open %s.\n", file_name);
+		return 1;
+	}
+	fseek(fd, 0, SEEK_END);
+	size = (size_t)ftell(fd);
+	fseek(fd, 0, SEEK_SET);
+	buf = malloc(size + 1);
+	frames = malloc((size / 4 + 1) * sizeof(struct frame));
+	// Compact header expands to less than twice of its frame
+	raw_packs = malloc(2 * size + MAX_BUF_SIZE);
+	if (buf == NULL || frames == NULL || raw_packs == NULL || fread(buf, 1, size, fd) != size) {
+		printf("Can't read %s.\n", file_name);
+		return 1;
+	}
+	fclose(fd);
+
+	// Find packages
+	if (size >= 24 && read_u32(buf) == 0xA1B2C3D4) {
+		if (!parse_pcap(buf, size)) {
+			return 1;
+		}
+	} else {
+		raw_buf = buf;
+		raw_size = size;
+	}
+
+	// Packages of raw byte stream are found in the first loop of parser
+	replay(loops > 0 ? loops : 1);
+	printf("%s: %u packages\n", file_name, frame_count);
+	analyse(master_addr);
+
+	free(raw_packs);
+	free(frames);
+	free(buf);
+
+	return 0;
+}
@@ -0,0 +1,100 @@
+/* ==========================================================================
+ * ring.c: Receiving Ring of Bytes for Interrupt-driven Lower Layer
+ *
+ * function:  1. Lock-free ring with single producer and single consumer,
+ *               the producer may be an interrupt or signal handler.
+ *            2. The producer never waits, bytes are dropped and counted
+ *               if the ring is full.
+ *            3. The consumer finds packages in the bytes by scan_pack(),
+ *               so recv_buf is never written by the producer.
+ * ======================================================================== */
+
+#include <string.h>
+#include "ring.h"
+
+// =========================== Interface Functions ==========================
+// Initialize ring, before the producer starts
+void ring_init(struct byte_ring* ring)
+{
+	memset(ring, 0, sizeof(*ring));
+}
+
+// Put 'count' bytes to ring, for the producer, return the number of bytes
+// put, the others are dropped
+U16 ring_write(struct byte_ring* ring, const U8* buf, U16 count)
+{
+	ring_index head = ring->head;
+	ring_index tail = ring->tail;
+	U16 space = (U16)((tail - head - 1) & (RING_SIZE - 1));
+	U16 part;
+
+	if (count > space) {
+		ring->drop_count += count - space;
+		count = space;
+	}
+
+	// Copy in two parts at most, before and after the end of ring
+	part = RING_SIZE - head;
+	if (part > count) {
+		part = count;
+	}
+	memcpy(ring->buf + head, buf, part);
+	memcpy(ring->buf, buf + part, count - part);
+
+	// The bytes are written before they're seen by consumer
+	RING_BARRIER();
+	ring->head = (ring_index)((head + count) & (RING_SIZE - 1));
+
+	return count;
+}
+
+// Take at most 'count' bytes out of ring, for the consumer, return the
+// number of bytes taken
+U16 ring_read(struct byte_ring* ring, U8* buf, U16 count)
+{
+	ring_index head = ring->head;
+	ring_index tail = ring->tail;
+	U16 used = (U16)((head - tail) & (RING_SIZE - 1));
+	U16 part;
+
+	// The bytes are read after the index that publishes them
+	RING_BARRIER();
+
+	if (count > used) {
+		count = used;
+	}
+
+	// Copy in two parts at most, before and after the end of ring
+	part = RING_SIZE - tail;
+	if (part > count) {
+		part = count;
+	}
+	memcpy(buf, ring->buf + tail, part);
+	memcpy(buf + part, ring->buf, count - part);
+
+	// The bytes are read before their space is given back to producer
+	RING_BARRIER();
+	ring->tail = (ring_index)((tail + count) & (RING_SIZE - 1));
+
+	return count;
+}
+
+// Find and check the next package in ring by scan_pack(), for the consumer,
+// return true if a package is checked in recv_buf, '*result' is its verdict
+bool ring_scan_pack(struct byte_ring* ring, enum pack_recv_type_list* result)
+{
+	bool flag_found;
+	U16 used;
+
+	// Take the new bytes behind the bytes not scanned yet
+	ring->frame_len += ring_read(ring, ring->frame_buf + ring->frame_len,
+	                             sizeof(ring->frame_buf) - ring->frame_len);
+
+	flag_found = scan_pack(ring->frame_buf, ring->frame_len, &used, result);
+
+	// Keep the bytes that may be the head of the next package
+	ring->frame_len -= used;
+	memmove(ring->frame_buf, ring->frame_buf + used, ring->frame_len);
+
+	return flag_found;
+}
@@ -0,0 +1,163 @@
+/* ==========================================================================
+ * ring_test.c: Stress Test of Receiving Ring of Bytes
+ *
+ * function:  1. A producer puts a numbered byte stream to the ring by
+ *               ring_put(), from a second thread, or from the handler of a
+ *               timer signal that interrupts the consumer as a UART
+ *               interrupt does.
+ *            2. The main loop drains the ring by ring_read() in chunks of
+ *               varying length at the same time.
+ *            3. Every byte is checked against its number, so a byte lost,
+ *               duplicated or out of order is reported at the first one.
+ *
+ * usage:     ring_test [-n bytes] [-s]
+ *               -n  Bytes to pass through the ring, default 1000000
+ *               -s  Producer is a signal handler, default is a thread
+ *
+ * build:     gcc -O2 -pthread ring_test.c ring.c package.c trace.c
+ *            Define RING_SIZE for another size of ring, a small one
+ *            wraps around more often.
+ * ======================================================================== */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include "ring.h"
+
+// Bytes put by the signal handler in one signal, at most
+#define TEST_SIGNAL_BURST 64
+// Interval of timer signal in microseconds
+#define TEST_SIGNAL_INTERVAL 20
+
+// ============================ Static Variables ============================
+static struct byte_ring ring;               // Ring under test
+static U32 total = 1000000;                 // Bytes to pass through the ring
+static volatile U32 produced;               // Bytes put by the producer
+static volatile U32 signal_count;           // Signals handled
+
+// Byte of number 'seq' in the stream, a lost or duplicated byte changes the
+// bytes after it, even for a gap of multiple of 256
+static U8 stream_byte(U32 seq)
+{
+	return (U8)((seq * 0x9E3779B1UL) >> 24);
+}
+
+// Producer thread, it waits while the ring is full, so no byte is dropped
+static void* produce_thread(void* arg)
+{
+	U32 seq;
+
+	(void)arg;
+	for (seq = 0; seq < total; seq++) {
+		while (!ring_put(&ring, stream_byte(seq))) {
+			sched_yield();
+		}
+	}
+	produced = total;
+
+	return NULL;
+}
+
+// Producer in signal handler, it can't wait, so the byte refused by a full
+// ring is put again in the next signal
+static void produce_signal(int sig)
+{
+	U32 seq = produced;
+	U16 i;
+
+	(void)sig;
+	for (i = 0; (i < TEST_SIGNAL_BURST) && (seq < total); i++) {
+		if (!ring_put(&ring, stream_byte(seq))) {
+			break;
+		}
+		seq++;
+	}
+	produced = seq;
+	signal_count++;
+}
+
+// Stress test
+int main(int argc, char* argv[])
+{
+	U8 buf[RING_SIZE];
+	bool flag_signal = false;
+	struct sigaction sa;
+	struct itimerval timer;
+	pthread_t thread;
+	U32 seq = 0;
+	U32 chunk = 0;
+	U16 count;
+	U16 i;
+	int arg;
+
+	for (arg = 1; arg < argc; arg++) {
+		if (arg + 1 < argc && strcmp(argv[arg], "-n") == 0) {
+			total = (U32)atol(argv[++arg]);
+		} else if (strcmp(argv[arg], "-s") == 0) {
+			flag_signal = true;
+		} else {
+			break;
+		}
+	}
+	if (arg < argc) {
+		printf("usage: ring_test [-n bytes] [-s]\n");
+		return 1;
+	}
+
+	ring_init(&ring);
+	memset(&timer, 0, sizeof(timer));
+	if (flag_signal) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = produce_signal;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGALRM, &sa, NULL);
+		timer.it_interval.tv_usec = TEST_SIGNAL_INTERVAL;
+		timer.it_value.tv_usec = TEST_SIGNAL_INTERVAL;
+		setitimer(ITIMER_REAL, &timer, NULL);
+	} else {
+		pthread_create(&thread, NULL, produce_thread, NULL);
+	}
+
+	// Drain in chunks of every length up to the ring, so reads end at every
+	// position against the wraparound
+	while (seq < total) {
+		chunk = (chunk % (RING_SIZE - 1)) + 1;
+		count = ring_read(&ring, buf, (U16)chunk);
+		if ((count == 0) && !flag_signal) {
+			sched_yield();
+		}
+		for (i = 0; i < count; i++, seq++) {
+			if (buf[i] != stream_byte(seq)) {
+				printf("FAIL: byte %u is 0x%02X, expected 0x%02X\n", seq, buf[i], stream_byte(seq));
+				return 1;
+			}
+		}
+	}
+	if (flag_signal) {
+		memset(&timer, 0, sizeof(timer));
+		setitimer(ITIMER_REAL, &timer, NULL);
+	} else {
+		pthread_join(thread, NULL);
+	}
+
+	// Nothing is left behind the stream
+	count = ring_read(&ring, buf, sizeof(buf));
+	if (count > 0 || produced != total) {
+		printf("FAIL: %u bytes more than the stream\n", count);
+		return 1;
+	}
+
+	printf("bytes %u, ring full %u times", seq, ring.drop_count);
+	if (flag_signal) {
+		printf(", signals %u", signal_count);
+	}
+	printf("\ndone\n");
+
+	return 0;
+}
@@ -0,0 +1,260 @@
+/* ==========================================================================
+ * seqno_test.c: Test of Seqno Wraparound of Embedded Transport Protocol
+ *
+ * function:  1. Checks seqno_before() at the edges of serial number
+ *               arithmetic.
+ *            2. Runs a master and a slave of package.c in loopback, the
+ *               seqno of master is seeded shortly before the wraparound,
+ *               every seqno must follow the last one and skip 0 and
+ *               SEQNO_FIRST.
+ *            3. Replays old requests of master to slave across the
+ *               wraparound, a request up to SLAVE_SEQNO_WINDOW behind is
+ *               dropped as a delayed duplicate, an older one is new.
+ *            4. Restarts master, its SEQNO_FIRST is new for slave though
+ *               it's shortly before the last seqno.
+ *            5. Optionally, a long run of more than 2^32 exchanges from
+ *               SEQNO_FIRST without seeding, so every seqno is sent, and
+ *               32-bit seqno wraps around too.
+ *
+ * usage:     seqno_test [-l]
+ *               -l  Long run, it takes minutes
+ *
+ * build:     gcc -DPACK_CLOCK_EXTERN seqno_test.c package.c trace.c
+ *            Add -DPACK_WIDE_SEQNO for the wraparound of 32-bit seqno.
+ * ======================================================================== */
+
+#include <stdio.h>
+#include <string.h>
+#include "package.h"
+
+// LOCAL_TIME() doesn't move, no ack is timeout
+#if !defined PACK_CLOCK_EXTERN
+	#error "seqno_test.c needs PACK_CLOCK_EXTERN, LOCAL_TIME() is given by pack_local_time()"
+#endif
+
+// Address of master and slave
+#define TEST_MASTER_ADDR 1
+#define TEST_SLAVE_ADDR  2
+// Seqno of master is seeded this much before the wraparound, so the window
+// of slave crosses it at the end
+#define TEST_SEED_BEHIND (SLAVE_SEQNO_WINDOW + 8)
+// Requests of master kept for replay, more than SLAVE_SEQNO_WINDOW
+#define TEST_HISTORY (SLAVE_SEQNO_WINDOW * 2)
+// Exchanges of long run, past the wraparound of 32-bit seqno by 2 windows
+#define TEST_LONG_COUNT ((1ULL << 32) + TEST_HISTORY)
+// Exchanges between progress reports of long run
+#define TEST_LONG_REPORT (1ULL << 28)
+
+// Request of master kept for replay
+struct request {
+	pack_seqno seqno;       // Seqno of request
+	U16 len;                // Length of package
+	U8 buf[MAX_FRAME_SIZE]; // Package
+};
+
+// ============================ Static Variables ============================
+static struct pack_link master_link;      // Link of master
+static struct pack_link slave_link;       // Link of slave
+static U8 wire[MAX_FRAME_SIZE];           // The last package sent
+static U16 wire_len;                      // Length of the last package sent
+static struct request history[TEST_HISTORY]; // Requests of master, indexed by count
+static U32 request_count;                 // Requests sent by master
+static U32 fail_count;                    // Checks failed
+
+// Local time, for LOCAL_TIME()
+U32 pack_local_time(void)
+{
+	return 0;
+}
+
+// Callback function for sending bytes, the package is delivered by the test
+static void send_bytes(U8* buf, U16 len)
+{
+	memcpy(wire, buf, len);
+	wire_len = len;
+}
+
+// Count a failed check
+static void check(bool flag_ok, const char* what, U32 value)
+{
+	if (!flag_ok) {
+		printf("FAIL: %s, %lu\n", what, (unsigned long)value);
+		fail_count++;
+	}
+}
+
+// Deliver package of 'len' bytes in 'buf' to 'link', return the verdict
+static enum pack_recv_type_list deliver(struct pack_link* link, const U8* buf, U16 len)
+{
+	select_pack_link(link);
+	memcpy(link->recv_buf, buf, len);
+	return check_pack();
+}
+
+// Master sends a request and slave acks it, return the seqno of request
+static pack_seqno exchange(void)
+{
+	struct request* req = &history[request_count % TEST_HISTORY];
+	enum pack_recv_type_list verdict;
+
+	select_pack_link(&master_link);
+	*(U8*)master_link.send_data = (U8)request_count;
+	master_send_pack(TEST_SLAVE_ADDR, 1);
+	req->seqno = get_pack_seqno(((const struct pack_header*)wire)->seqno);
+	req->len = wire_len;
+	memcpy(req->buf, wire, wire_len);
+	request_count++;
+
+	verdict = deliver(&slave_link, req->buf, req->len);
+	check(verdict == PACK_RECV_NEW, "request is not new", req->seqno);
+	*(U8*)slave_link.send_data = *(const U8*)slave_link.recv_data;
+	slave_send_pack(1);
+
+	verdict = deliver(&master_link, wire, wire_len);
+	check(verdict == PACK_RECV_NEW, "ack is not new", req->seqno);
+
+	return req->seqno;
+}
+
+// Find the request kept that is 'behind' the last seqno of slave
+static const struct request* find_request(pack_seqno behind)
+{
+	U32 i;
+
+	for (i = 0; i < TEST_HISTORY; i++) {
+		if ((history[i].len > 0)
+		&& ((pack_seqno)(slave_link.slave_recv_seqno_last - history[i].seqno) == behind)) {
+			return &history[i];
+		}
+	}
+	return NULL;
+}
+
+// Long run of TEST_LONG_COUNT exchanges from initialization, every seqno
+// must follow the last one, and every request and ack is new
+static void run_long(void)
+{
+	unsigned long long i;
+	pack_seqno seqno;
+	pack_seqno last = 0;
+	U32 wraps = 0;
+
+	select_pack_link(&master_link);
+	master_init_pack(TEST_MASTER_ADDR, 1000, send_bytes);
+	select_pack_link(&slave_link);
+	slave_init_pack(TEST_SLAVE_ADDR, TEST_MASTER_ADDR, send_bytes);
+
+	for (i = 0; i < TEST_LONG_COUNT; i++) {
+		seqno = exchange();
+		if (i == 0) {
+			check(seqno == SEQNO_FIRST, "first seqno is not SEQNO_FIRST", seqno);
+		} else if (seqno < last) {
+			check(seqno == SEQNO_FIRST + 1, "seqno after wraparound is not SEQNO_FIRST + 1", seqno);
+			wraps++;
+		} else {
+			check(seqno == (pack_seqno)(last + 1), "seqno doesn't follow the last", seqno);
+		}
+		last = seqno;
+
+		if (fail_count > 0) {
+			return;
+		}
+		if ((i + 1) % TEST_LONG_REPORT == 0) {
+			printf("long run: %llu exchanges, %u wraparounds\n", i + 1, wraps);
+			fflush(stdout);
+		}
+	}
+	check(wraps > 0, "seqno didn't wrap around in long run", last);
+	printf("long run: %llu exchanges, %u wraparounds\n", i, wraps);
+}
+
+// Test of seqno
+int main(int argc, char* argv[])
+{
+	const pack_seqno half = (pack_seqno)1 << (PACK_SEQNO_LEN * 8 - 1);
+	const struct request* req;
+	pack_seqno seqno;
+	pack_seqno last;
+	bool flag_wrapped = false;
+	U32 i;
+
+	if ((argc > 2) || ((argc == 2) && (strcmp(argv[1], "-l") != 0))) {
+		printf("usage: seqno_test [-l]\n");
+		return 1;
+	}
+
+	// Serial number arithmetic
+	check(seqno_before((pack_seqno)-1, SEQNO_FIRST + 1), "max is not before the seqno after wraparound", 0);
+	check(!seqno_before(SEQNO_FIRST + 1, (pack_seqno)-1), "seqno after wraparound is before max", 0);
+	check(!seqno_before(5, 5), "seqno is before itself", 5);
+	check(seqno_before(0, half - 1), "seqno is not before one less than half range ahead", 0);
+	check(!seqno_before(0, half), "seqno is before the one half range ahead", 0);
+	check(!seqno_before(half, 0), "seqno half range apart is before", 0);
+
+	select_pack_link(&master_link);
+	master_init_pack(TEST_MASTER_ADDR, 1000, send_bytes);
+	select_pack_link(&slave_link);
+	slave_init_pack(TEST_SLAVE_ADDR, TEST_MASTER_ADDR, send_bytes);
+
+	// The first seqno after initialization is SEQNO_FIRST
+	last = exchange();
+	check(last == SEQNO_FIRST, "first seqno is not SEQNO_FIRST", last);
+
+	// Slave restarts, else the seed is a delayed duplicate of SEQNO_FIRST.
+	// Seed master before the wraparound.
+	select_pack_link(&slave_link);
+	slave_init_pack(TEST_SLAVE_ADDR, TEST_MASTER_ADDR, send_bytes);
+	select_pack_link(&master_link);
+	master_set_pack_seqno((pack_seqno)(0 - TEST_SEED_BEHIND));
+	last = exchange();
+
+	// Through the wraparound, and further than the window
+	for (i = 0; i < TEST_HISTORY - 1; i++) {
+		seqno = exchange();
+		check((seqno != 0) && (seqno != SEQNO_FIRST), "seqno is 0 or SEQNO_FIRST", seqno);
+		check(seqno_before(last, seqno), "seqno is not after the last", seqno);
+		if (seqno < last) {
+			check(seqno == SEQNO_FIRST + 1, "seqno after wraparound is not SEQNO_FIRST + 1", seqno);
+			flag_wrapped = true;
+		}
+		last = seqno;
+	}
+	check(flag_wrapped, "seqno didn't wrap around", last);
+
+	// Slave acks the last ones from its cache, and drops delayed ones in the
+	// window, which crosses the wraparound. One before the window is new.
+	req = find_request(1);
+	check(req != NULL && deliver(&slave_link, req->buf, req->len) == PACK_RECV_RETRY,
+	      "recent request is not resent from cache", 1);
+	req = find_request((pack_seqno)(last + 2));
+	check(req != NULL && deliver(&slave_link, req->buf, req->len) == PACK_RECV_SEQNO_ERR,
+	      "request before wraparound is not dropped", (U32)(pack_seqno)(0 - 2));
+	req = find_request(SLAVE_SEQNO_WINDOW);
+	check(req != NULL && deliver(&slave_link, req->buf, req->len) == PACK_RECV_SEQNO_ERR,
+	      "request at the edge of window is not dropped", SLAVE_SEQNO_WINDOW);
+	check(slave_link.slave_recv_seqno_last == last, "dropped request moved the last seqno", last);
+	req = find_request(SLAVE_SEQNO_WINDOW + 1);
+	check(req != NULL && deliver(&slave_link, req->buf, req->len) == PACK_RECV_NEW,
+	      "request before the window is not new", SLAVE_SEQNO_WINDOW + 1);
+
+	// Master goes on, then restarts, its first seqno is new though it's in
+	// the window
+	last = exchange();
+	check(seqno_before(SEQNO_FIRST, last) && ((pack_seqno)(last - SEQNO_FIRST) <= SLAVE_SEQNO_WINDOW),
+	      "SEQNO_FIRST is not in the window", last);
+	select_pack_link(&master_link);
+	master_init_pack(TEST_MASTER_ADDR, 1000, send_bytes);
+	seqno = exchange();
+	check(seqno == SEQNO_FIRST, "first seqno after restart is not SEQNO_FIRST", seqno);
+
+	printf("requests %u, seqno %u bits, failed %u\n", request_count, PACK_SEQNO_LEN * 8, fail_count);
+	if ((fail_count == 0) && (argc == 2)) {
+		run_long();
+	}
+	if (fail_count > 0) {
+		return 1;
+	}
+	printf("done\n");
+
+	return 0;
+}
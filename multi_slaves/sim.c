@@ -0,0 +1,807 @@
+/* ==========================================================================
+ * sim.c: Discrete-event Simulator of Embedded Transport Protocol
+ *
+ * function:  1. Runs a master and hundreds of slaves of package.c in one
+ *               process, every node is a link, on a virtual clock.
+ *            2. Half-duplex bus with airtime of frames by baud rate, frames
+ *               that overlap collide, and frames are broken by loss rate.
+ *            3. Master polls every slave in cycles by asynchronous requests.
+ *            4. Reports cycle time, bus utilisation, frame rate and tail
+ *               latency of requests for every combination of slave count,
+ *               data length and loss rate, much faster than real time.
+ *            5. With urgent requests, the queue of normal class is kept
+ *               full, and the latency of urgent class is reported against
+ *               one transaction in flight, which is all it may wait for.
+ *            6. With bulk writes, master streams blocks to slave 1 by bulk.c
+ *               without pause instead of polling, urgent requests cut the
+ *               bursts short, and every block is checked at the slave.
+ *               Urgent latency is reported against the packages of burst
+ *               that can't be taken back, and one transaction.
+ *            7. Exits with 1 if urgent latency is over its bound without
+ *               loss, or a block of bulk write is lost or broken.
+ *
+ * usage:     sim [-n slaves] [-d data_len] [-l loss] [-c cycles] [-b baud]
+ *                [-a max_ack_delay] [-r response] [-t turnaround]
+ *                [-w deadline] [-s seed] [-u urgent] [-k bulk_len]
+ *               -n  Numbers of slaves, comma separated, default 10,100,250
+ *               -d  Lengths of data part, comma separated, default 8
+ *               -l  Loss rates of frames in percent, comma separated,
+ *                   default 0
+ *               -c  Poll cycles of each combination, default 100
+ *               -b  Baud rate of bus, default 115200
+ *               -a  Max ack delay of master in milliseconds, default 2
+ *               -r  Microseconds from request to ack of slave, default 200
+ *               -t  Turnaround of line driver in microseconds, default 50
+ *               -w  Deadline of request in milliseconds, default 1000
+ *               -s  Seed of random loss, default 1
+ *               -u  Microseconds between urgent requests to random
+ *                   slaves, default 0 for none
+ *               -k  Bytes of bulk write blocks to slave 1, default 0 for
+ *                   none, then cycles are blocks. It needs PACK_TX_ASYNC,
+ *                   so packages of burst go one by one.
+ *
+ * build:     gcc -DPACK_CLOCK_EXTERN sim.c package.c bulk.c trace.c
+ *            Add -DPACK_TX_ASYNC for bulk writes, every frame is complete
+ *            at its end on the bus.
+ *            Add -DPACK_WIDE_ADDR for more than 254 slaves, and define
+ *            MAX_BUF_SIZE for longer data part. Every node uses compact
+ *            header with -DPACK_COMPACT.
+ * ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "package.h"
+#include "bulk.h"
+
+// LOCAL_TIME() is the virtual clock
+#if !defined PACK_CLOCK_EXTERN
+	#error "sim.c needs PACK_CLOCK_EXTERN, LOCAL_TIME() is given by pack_local_time()"
+#endif
+
+// Address of master
+#define SIM_MASTER_ADDR 1
+// Bits on bus for each byte, 8N1
+#define SIM_BITS_PER_BYTE 10
+// Period of polling master in microseconds
+#define SIM_TICK 1000
+// Maximum frames on the bus at the same time
+#define SIM_MAX_FRAMES 16
+// Maximum number of values in a option list
+#define SIM_MAX_LIST 16
+// Length of frame of package of 'len' bytes of data, with COBS overhead
+#if defined PACK_FRAMING_COBS
+	#define SIM_FRAME_LEN(len) (PACK_LEN(len) + PACK_LEN(len) / 254 + 2)
+#else
+	#define SIM_FRAME_LEN(len) PACK_LEN(len)
+#endif
+
+// Type of event
+enum sim_event_type {
+	SIM_FRAME_END, // The last byte of frame is on the bus
+	SIM_RESPONSE,  // Slave acks the request it received
+	SIM_TICK_POLL, // Master polls its requests
+	SIM_URGENT,    // Master submits a urgent request
+};
+
+// Event in queue
+struct sim_event {
+	unsigned long long time; // Virtual time in microseconds
+	U8 type;                 // Type of event
+	U8 frame;                // Frame of SIM_FRAME_END
+	U16 node;                // Node of SIM_RESPONSE, 0 is master
+};
+
+// Frame on the bus
+struct sim_frame {
+	U16 sender;              // Node that sent the frame, 0 is master
+	U16 len;                 // Length of frame
+	bool flag_used;          // If the frame is on the bus
+	U8 buf[MAX_FRAME_SIZE];  // Bytes of frame
+};
+
+// Node on the bus, node 0 is master
+struct sim_node {
+	struct pack_link link;   // Link of node
+	pack_addr addr;          // Address of node
+	unsigned long long submit_time; // Virtual time the request to slave was submitted
+	U16 rx_len;              // Bytes in receiving buffer
+	U8 rx_buf[MAX_FRAME_SIZE * 2]; // Receiving buffer
+};
+
+// Parameters of a run
+struct sim_param {
+	U16 slave_count;         // Number of slaves
+	U16 data_len;            // Length of data part of requests and acks
+	double loss;             // Loss rate of frames in percent
+	U32 cycles;              // Poll cycles to run
+	U32 baud;                // Baud rate of bus
+	U32 max_ack_delay;       // Max ack delay of master in milliseconds
+	U32 response;            // Microseconds from request to ack of slave
+	U32 turnaround;          // Turnaround of line driver in microseconds
+	U32 deadline;            // Deadline of request in milliseconds
+	U32 urgent;              // Microseconds between urgent requests, 0 for none
+	U32 bulk;                // Bytes of bulk write blocks, 0 for none
+};
+
+// ============================ Static Variables ============================
+static unsigned long long sim_now;         // Virtual time in microseconds
+static struct sim_event* events;           // Heap of events ordered by time
+static U32 event_count;                    // Number of events in heap
+static U32 event_size;                     // Size of heap
+static struct sim_frame frames[SIM_MAX_FRAMES]; // Frames on the bus
+static unsigned long long bus_busy_until;  // Virtual time the last frame ends
+static int bus_frame_last = -1;            // The last frame sent, -1 if none
+static unsigned long long bus_busy_time;   // Total airtime of frames
+static U32 frame_count;                    // Frames sent on the bus
+static struct sim_node* nodes;             // Master and slaves
+static U16 node_count;                     // Number of nodes
+static U16 cur_node;                       // Node selected
+static const struct sim_param* param;      // Parameters of the run
+static U32 rand_state;                     // State of random generator
+
+static U16 cycle_next;                     // The next slave to submit in cycle
+static U16 cycle_done;                     // Requests completed in cycle
+static unsigned long long cycle_start;     // Virtual time the cycle started
+static U32 cycle_count;                    // Cycles completed
+static U32* cycle_times;                   // Time of every cycle in microseconds
+static U32* latencies;                     // Latency of every request in microseconds
+static U32 latency_count;                  // Number of latencies
+static U32 result_count[PACK_REQ_RESULT_TOTAL]; // Requests by result
+static U32 collision_count;                // Frames broken by collision
+static U32 loss_count;                     // Frames broken by loss
+static U8 sim_data[MAX_DATA_LEN];          // Data part of requests and acks
+
+static unsigned long long urgent_submit[MAX_REQ_QUEUE_SIZE]; // Virtual time of urgent requests in queue
+static U32 urgent_next;                    // Urgent requests submitted
+static U32* urgent_latencies;              // Latency of every urgent request in microseconds
+static U32 urgent_count;                   // Number of urgent latencies
+static U32 urgent_size;                    // Size of urgent latencies
+static U32 urgent_failed;                  // Urgent requests timeout or error
+
+static struct bulk_transfer bulk_xfer;     // Bulk write of master
+static struct bulk_slave bulk_target;      // Bulk state of slave 1
+static U8* bulk_src;                       // Block written by master
+static U8* bulk_mem;                       // Memory of slave 1 written by bulk
+static U32 bulk_bad;                       // Blocks failed or broken at slave
+static U32 bulk_preempt;                   // Urgent requests done during bulk write
+static U32 bulk_bursts;                    // Bursts of all blocks
+
+// Virtual time in milliseconds, for LOCAL_TIME()
+U32 pack_local_time(void)
+{
+	return (U32)(sim_now / 1000);
+}
+
+#if defined PACK_TIMESTAMP
+// Virtual time in microseconds, for STAMP_TIME(), every node has the same clock
+U32 pack_stamp_time(void)
+{
+	return (U32)sim_now;
+}
+#endif
+
+// Random number, xorshift
+static U32 next_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+// Select the link of node
+static void select_node(U16 node)
+{
+	cur_node = node;
+	select_pack_link(&nodes[node].link);
+}
+
+// Add a event to heap
+static void add_event(unsigned long long time, U8 type, U8 frame, U16 node)
+{
+	struct sim_event event = { time, type, frame, node };
+	U32 i;
+
+	if (event_count >= event_size) {
+		event_size = event_size ? event_size * 2 : 64;
+		events = realloc(events, event_size * sizeof(struct sim_event));
+		if (events == NULL) {
+			printf("Out of memory.\n");
+			exit(1);
+		}
+	}
+
+	// Sift up
+	for (i = event_count++; i > 0 && events[(i - 1) / 2].time > time; i = (i - 1) / 2) {
+		events[i] = events[(i - 1) / 2];
+	}
+	events[i] = event;
+}
+
+// Take the earliest event out of heap
+static struct sim_event take_event(void)
+{
+	struct sim_event first = events[0];
+	struct sim_event last = events[--event_count];
+	U32 i = 0;
+	U32 child;
+
+	// Sift down
+	while ((child = i * 2 + 1) < event_count) {
+		if (child + 1 < event_count && events[child + 1].time < events[child].time) {
+			child++;
+		}
+		if (events[child].time >= last.time) {
+			break;
+		}
+		events[i] = events[child];
+		i = child;
+	}
+	events[i] = last;
+
+	return first;
+}
+
+// Callback function for sending bytes of every node, the frame is on the
+// bus after the turnaround of line driver
+static void send_bytes(U8* buf, U16 count)
+{
+	unsigned long long start = sim_now + param->turnaround;
+	unsigned long long airtime = (unsigned long long)count * SIM_BITS_PER_BYTE * 1000000 / param->baud;
+	struct sim_frame* frame = NULL;
+	int i;
+
+	for (i = 0; i < SIM_MAX_FRAMES; i++) {
+		if (!frames[i].flag_used) {
+			frame = &frames[i];
+			break;
+		}
+	}
+	if (frame == NULL || count > MAX_FRAME_SIZE) {
+		return;
+	}
+	frame->sender = cur_node;
+	frame->len = count;
+	frame->flag_used = true;
+	memcpy(frame->buf, buf, count);
+
+	// Frames that overlap on the bus are both broken
+	if (start < bus_busy_until && bus_frame_last >= 0 && frames[bus_frame_last].flag_used) {
+		frames[bus_frame_last].buf[frames[bus_frame_last].len / 2] ^= 0x55;
+		frame->buf[count / 2] ^= 0x55;
+		collision_count += 2;
+	} else if (param->loss > 0 && next_rand() % 100000 < (U32)(param->loss * 1000)) {
+		// Line noise breaks a byte
+		frame->buf[next_rand() % count] ^= (U8)(next_rand() % 255 + 1);
+		loss_count++;
+	}
+
+	bus_busy_time += airtime;
+	frame_count++;
+	if (start + airtime > bus_busy_until) {
+		bus_busy_until = start + airtime;
+	}
+	bus_frame_last = i;
+	add_event(start + airtime, SIM_FRAME_END, (U8)i, 0);
+}
+
+// Callback function for request completion of master
+static void finish_req(pack_addr dest_addr, enum pack_req_result_list result,
+                       const void* data, U16 data_len, void* arg)
+{
+	struct sim_node* node = arg;
+
+	(void)dest_addr;
+	(void)data;
+	(void)data_len;
+
+	result_count[result]++;
+	latencies[latency_count++] = (U32)(sim_now - node->submit_time);
+	cycle_done++;
+}
+
+// Callback function for urgent request completion of master, 'arg' is the
+// submitting time, urgent requests complete in order
+static void finish_urgent(pack_addr dest_addr, enum pack_req_result_list result,
+                          const void* data, U16 data_len, void* arg)
+{
+	const unsigned long long* submit_time = arg;
+
+	(void)dest_addr;
+	(void)data;
+	(void)data_len;
+
+	if (result != PACK_REQ_ACK) {
+		urgent_failed++;
+	}
+	if (bulk_xfer.flag_busy) {
+		bulk_preempt++;
+	}
+	if (urgent_count >= urgent_size) {
+		urgent_size = urgent_size ? urgent_size * 2 : 1024;
+		urgent_latencies = realloc(urgent_latencies, urgent_size * sizeof(U32));
+		if (urgent_latencies == NULL) {
+			printf("Out of memory.\n");
+			exit(1);
+		}
+	}
+	urgent_latencies[urgent_count++] = (U32)(sim_now - *submit_time);
+}
+
+// Master submits a urgent request to a random slave, it's dropped if the
+// queue of urgent class is full
+static void submit_urgent(void)
+{
+	unsigned long long* submit_time = &urgent_submit[urgent_next % MAX_REQ_QUEUE_SIZE];
+
+	select_node(0);
+	*submit_time = sim_now;
+	if (master_submit_pack_prio(PACK_PRIO_URGENT, nodes[next_rand() % param->slave_count + 1].addr,
+	                            sim_data, param->data_len, pack_local_time() + param->deadline,
+	                            finish_urgent, submit_time)) {
+		urgent_next++;
+	}
+}
+
+// Write function of slave 1 for bulk, region 0 is its memory
+static bool write_bulk(U8 region, U32 offset, const U8* buf, U16 len)
+{
+	if ((region != 0) || (offset > param->bulk) || (len > param->bulk - offset)) {
+		return false;
+	}
+	memcpy(bulk_mem + offset, buf, len);
+
+	return true;
+}
+
+// Callback function for bulk write completion, the block must be in memory
+// of slave 1 as it's sent
+static void finish_bulk(struct bulk_transfer* xfer, enum bulk_result_list result)
+{
+	if ((result != BULK_OK) || (memcmp(bulk_mem, bulk_src, xfer->length) != 0)) {
+		bulk_bad++;
+	}
+	bulk_bursts += xfer->burst_count;
+	cycle_times[cycle_count++] = (U32)(sim_now - cycle_start);
+}
+
+// Master starts a new block of bulk write to slave 1 when the last one is
+// done, and streams it
+static void feed_bulk(void)
+{
+	U32 i;
+
+	select_node(0);
+	if (bulk_xfer.flag_busy) {
+		bulk_poll(&bulk_xfer);
+		return;
+	}
+	if (cycle_count >= param->cycles) {
+		return;
+	}
+
+	for (i = 0; i < param->bulk; i++) {
+		bulk_src[i] = (U8)next_rand();
+	}
+	memset(bulk_mem, 0, param->bulk);
+	cycle_start = sim_now;
+	bulk_start(&bulk_xfer, nodes[1].addr, BULK_OP_WRITE, 0, 0, bulk_src, param->bulk, finish_bulk, NULL);
+}
+
+// Master submits the requests of cycle one by one, so latency of request
+// is the time of its exchanges on the bus, and starts the next cycle after
+// every slave is done. With urgent requests, the queue of normal class is
+// kept full instead.
+static void feed_master(void)
+{
+	struct sim_node* node;
+
+	if (param->bulk > 0) {
+		feed_bulk();
+		return;
+	}
+
+	select_node(0);
+	for (;;) {
+		if (cycle_done == param->slave_count) {
+			cycle_times[cycle_count++] = (U32)(sim_now - cycle_start);
+			if (cycle_count >= param->cycles) {
+				return;
+			}
+			cycle_start = sim_now;
+			cycle_next = 0;
+			cycle_done = 0;
+		}
+		if (cycle_next >= param->slave_count || (param->urgent == 0 && cycle_next > cycle_done)) {
+			return;
+		}
+		node = &nodes[cycle_next + 1];
+		node->submit_time = sim_now;
+		if (!master_submit_pack(node->addr, sim_data, param->data_len,
+		                        pack_local_time() + param->deadline, finish_req, node)) {
+			return;
+		}
+		cycle_next++;
+	}
+}
+
+// Pass a frame to a node
+static void receive_frame(U16 i, const struct sim_frame* frame)
+{
+	struct sim_node* node = &nodes[i];
+	enum pack_recv_type_list result;
+	U16 pos = 0;
+	U16 used;
+	U16 len;
+
+	select_node(i);
+
+	// Bytes left from a broken frame are kept until the scanner skips them
+	if (node->rx_len + frame->len > sizeof(node->rx_buf)) {
+		node->rx_len = 0;
+	}
+	memcpy(node->rx_buf + node->rx_len, frame->buf, frame->len);
+	node->rx_len += frame->len;
+
+	while (scan_pack(node->rx_buf + pos, node->rx_len - pos, &used, &result)) {
+		pos += used;
+		if (result != PACK_RECV_NEW) {
+			continue;
+		}
+		// Bulk packages are taken at once, slave 1 answers a burst by status
+		len = get_pack_u16(((const struct pack_header*)node->link.recv_buf)->len);
+		if ((param->bulk > 0) && (i == 0) && bulk_take(&bulk_xfer, node->link.recv_data, len)) {
+			continue;
+		}
+		if ((param->bulk > 0) && (i == 1) && bulk_slave_take(&bulk_target, node->link.recv_data, len)) {
+			continue;
+		}
+		// Slave acks the new request after its response time
+		if (i != 0) {
+			add_event(sim_now + param->response, SIM_RESPONSE, 0, i);
+		}
+	}
+	pos += used;
+	node->rx_len -= pos;
+	memmove(node->rx_buf, node->rx_buf + pos, node->rx_len);
+}
+
+// Pass a frame on the bus to the nodes that take it
+static void deliver_frame(const struct sim_frame* frame)
+{
+#if defined PACK_FRAMING_COBS
+	U16 i;
+
+	// Destination is in the encoded frame, every node checks it
+	for (i = 0; i < node_count; i++) {
+		if (i != frame->sender) {
+			receive_frame(i, frame);
+		}
+	}
+#else
+	U32 dest;
+
+	// Master takes every frame of slaves. A slave drops the frames to
+	// others as DEST_ERR, so only the slave at destination is given the
+	// frame, which makes a run O(1) in slave count. A broken destination
+	// goes to the slave it names, or to nobody.
+	if (frame->sender != 0) {
+		receive_frame(0, frame);
+		return;
+	}
+#if defined PACK_COMPACT
+	if ((frame->len >= sizeof(struct pack_compact_header)) && (frame->buf[1] == PACK_START_COMPACT)) {
+		dest = get_pack_addr(((const struct pack_compact_header*)frame->buf)->dest);
+	} else
+#endif
+	dest = (frame->len >= sizeof(struct pack_header))
+	     ? get_pack_addr(((const struct pack_header*)frame->buf)->dest) : 0;
+	if (dest > SIM_MASTER_ADDR && dest - SIM_MASTER_ADDR < node_count) {
+		receive_frame((U16)(dest - SIM_MASTER_ADDR), frame);
+	}
+#endif
+}
+
+// Compare U32 for qsort
+static int compare_u32(const void* a, const void* b)
+{
+	U32 x = *(const U32*)a;
+	U32 y = *(const U32*)b;
+
+	return (x > y) - (x < y);
+}
+
+// Get the value at 'permille' of sorted values
+static U32 percentile(const U32* values, U32 count, U32 permille)
+{
+	if (count == 0) {
+		return 0;
+	}
+	return values[(unsigned long long)(count - 1) * permille / 1000];
+}
+
+// Run a simulation and print its result, return false if urgent latency is
+// over its bound without loss, or a block of bulk write is lost or broken
+static bool run(const struct sim_param* p)
+{
+	static struct pack_peer* peer_table;
+	struct sim_event event;
+	struct pack_count* count;
+	clock_t wall = clock();
+	double wall_time;
+	unsigned long long cycle_sum = 0;
+	unsigned long long transaction;
+	unsigned long long bound;
+	bool flag_ok = true;
+	U32 retry_count;
+	U16 peer_size;
+	U16 i;
+
+	param = p;
+	sim_now = 0;
+	event_count = 0;
+	memset(frames, 0, sizeof(frames));
+	bus_busy_until = 0;
+	bus_frame_last = -1;
+	bus_busy_time = 0;
+	frame_count = 0;
+	cycle_next = 0;
+	cycle_done = 0;
+	cycle_start = 0;
+	cycle_count = 0;
+	latency_count = 0;
+	urgent_next = 0;
+	urgent_count = 0;
+	urgent_failed = 0;
+	bulk_bad = 0;
+	bulk_preempt = 0;
+	bulk_bursts = 0;
+	memset(&bulk_xfer, 0, sizeof(bulk_xfer));
+	memset(result_count, 0, sizeof(result_count));
+	collision_count = 0;
+	loss_count = 0;
+
+	// Master and slaves
+	node_count = p->slave_count + 1;
+	nodes = calloc(node_count, sizeof(struct sim_node));
+	cycle_times = malloc(p->cycles * sizeof(U32));
+	latencies = malloc((size_t)p->cycles * p->slave_count * sizeof(U32));
+	for (peer_size = 16; (peer_size < 32768U) && (peer_size - peer_size / 4 < p->slave_count); peer_size *= 2);
+	peer_table = calloc(peer_size, sizeof(struct pack_peer));
+	bulk_src = malloc(p->bulk + 1);
+	bulk_mem = malloc(p->bulk + 1);
+	if (nodes == NULL || cycle_times == NULL || latencies == NULL || peer_table == NULL
+	|| bulk_src == NULL || bulk_mem == NULL) {
+		printf("Out of memory.\n");
+		exit(1);
+	}
+	select_node(0);
+	nodes[0].addr = SIM_MASTER_ADDR;
+	master_init_pack(SIM_MASTER_ADDR, p->max_ack_delay, send_bytes);
+	set_pack_airtime(p->baud, SIM_BITS_PER_BYTE, p->turnaround);
+	if ((peer_size - peer_size / 4 < p->slave_count) || !master_set_peer_table(peer_table, peer_size)) {
+		printf("Too many slaves for peer table.\n");
+		exit(1);
+	}
+#if defined PACK_COMPACT
+	set_pack_compact(true);
+#endif
+	for (i = 1; i < node_count; i++) {
+		select_node(i);
+		nodes[i].addr = (pack_addr)(SIM_MASTER_ADDR + i);
+		slave_init_pack(nodes[i].addr, SIM_MASTER_ADDR, send_bytes);
+#if defined PACK_COMPACT
+		set_pack_compact(true);
+#endif
+	}
+	bulk_slave_init(&bulk_target, NULL, write_bulk);
+
+	// Run events until every cycle is done
+	add_event(SIM_TICK, SIM_TICK_POLL, 0, 0);
+	if (p->urgent > 0) {
+		add_event(p->urgent, SIM_URGENT, 0, 0);
+	}
+	feed_master();
+	while (cycle_count < p->cycles && event_count > 0) {
+		event = take_event();
+		sim_now = event.time;
+
+		switch (event.type) {
+		case SIM_FRAME_END:
+			// Nodes may send while the frame is passed, keep it until then
+			deliver_frame(&frames[event.frame]);
+			frames[event.frame].flag_used = false;
+#if defined PACK_TX_ASYNC
+			// The next frame of sender goes on the bus
+			select_node(frames[event.frame].sender);
+			tx_complete();
+#endif
+			break;
+		case SIM_RESPONSE:
+			select_node(event.node);
+			memcpy(nodes[event.node].link.send_data, sim_data, p->data_len);
+			slave_send_pack(p->data_len);
+			break;
+		case SIM_TICK_POLL:
+			select_node(0);
+			master_poll_pack();
+			add_event(sim_now + SIM_TICK, SIM_TICK_POLL, 0, 0);
+			break;
+		case SIM_URGENT:
+			submit_urgent();
+			add_event(sim_now + p->urgent, SIM_URGENT, 0, 0);
+			break;
+		}
+		feed_master();
+	}
+	wall_time = (double)(clock() - wall) / CLOCKS_PER_SEC;
+
+	// Report
+	select_node(0);
+	count = get_pack_count_info();
+	retry_count = count->send_pack_count[PACK_SEND_RETRY] + count->send_pack_count[PACK_SEND_FAST_RETRY];
+	for (i = 0; i < cycle_count; i++) {
+		cycle_sum += cycle_times[i];
+	}
+	qsort(cycle_times, cycle_count, sizeof(U32), compare_u32);
+	qsort(latencies, latency_count, sizeof(U32), compare_u32);
+	printf("%6u %5u %5.1f | %9.2f %9.2f | %5.1f %8.1f | %8u %8u %8u %8u | %6u %6u %6u %6u | %7.0f\n",
+	       p->slave_count, p->data_len, p->loss,
+	       cycle_count ? cycle_sum / 1000.0 / cycle_count : 0.0,
+	       percentile(cycle_times, cycle_count, 990) / 1000.0,
+	       sim_now ? bus_busy_time * 100.0 / sim_now : 0.0,
+	       sim_now ? frame_count * 1e6 / sim_now : 0.0,
+	       percentile(latencies, latency_count, 500), percentile(latencies, latency_count, 990),
+	       percentile(latencies, latency_count, 999), percentile(latencies, latency_count, 1000),
+	       retry_count, result_count[PACK_REQ_TIMEOUT] + result_count[PACK_REQ_ERR],
+	       collision_count, loss_count,
+	       wall_time > 0 ? sim_now / 1e6 / wall_time : 0.0);
+
+	// Urgent request waits for the transaction in flight, then takes its own.
+	// Under bulk write, it waits for the package on the bus, the one waiting
+	// for the bus, and the last one of burst with its status instead, with a
+	// tick of margin.
+	if (p->urgent > 0) {
+		transaction = 2 * ((unsigned long long)SIM_FRAME_LEN(p->data_len) * SIM_BITS_PER_BYTE * 1000000 / p->baud
+		                   + p->turnaround) + p->response;
+		bound = 2 * transaction;
+		if (p->bulk > 0) {
+			bound = transaction + 3 * ((unsigned long long)SIM_FRAME_LEN(MAX_DATA_LEN) * SIM_BITS_PER_BYTE * 1000000 / p->baud
+			                           + p->turnaround)
+			      + (unsigned long long)SIM_FRAME_LEN(MSG_LEN_bulk_status) * SIM_BITS_PER_BYTE * 1000000 / p->baud
+			      + p->turnaround + SIM_TICK;
+		}
+		qsort(urgent_latencies, urgent_count, sizeof(U32), compare_u32);
+		printf("  urgent %u, failed %u, latency p50 %u p99 %u max %u us, bound %llu us, p99 %s\n",
+		       urgent_count, urgent_failed, percentile(urgent_latencies, urgent_count, 500),
+		       percentile(urgent_latencies, urgent_count, 990), percentile(urgent_latencies, urgent_count, 1000),
+		       bound, (percentile(urgent_latencies, urgent_count, 990) <= bound) ? "within bound" : "OVER bound");
+		if ((p->loss == 0) && ((urgent_count == 0) || (percentile(urgent_latencies, urgent_count, 990) > bound))) {
+			flag_ok = false;
+		}
+	}
+
+	// Every block must be in memory of slave as it's sent
+	if (p->bulk > 0) {
+		printf("  bulk %u blocks of %u bytes, %u broken, %u bursts, %u urgent requests done during bulk write\n",
+		       cycle_count, p->bulk, bulk_bad, bulk_bursts, bulk_preempt);
+		if ((bulk_bad > 0) || (cycle_count < p->cycles)) {
+			flag_ok = false;
+		}
+	}
+
+	free(nodes);
+	free(cycle_times);
+	free(latencies);
+	free(peer_table);
+	free(bulk_src);
+	free(bulk_mem);
+
+	return flag_ok;
+}
+
+// Parse a comma separated list of numbers, return the number of values
+static U16 parse_list(const char* text, double* values)
+{
+	U16 count = 0;
+	char* end;
+
+	while (count < SIM_MAX_LIST) {
+		values[count++] = strtod(text, &end);
+		if (*end != ',') {
+			break;
+		}
+		text = end + 1;
+	}
+
+	return count;
+}
+
+// Simulator
+int main(int argc, char* argv[])
+{
+	struct sim_param p = { 0, 0, 0, 100, 115200, 2, 200, 50, 1000, 0, 0 };
+	double slave_list[SIM_MAX_LIST] = { 10, 100, 250 };
+	double len_list[SIM_MAX_LIST] = { 8 };
+	double loss_list[SIM_MAX_LIST] = { 0 };
+	U16 slave_total = 3;
+	U16 len_total = 1;
+	U16 loss_total = 1;
+	bool flag_ok = true;
+	U16 i, j, k;
+
+	// Parse options
+	rand_state = 1;
+	for (i = 1; i < argc; i++) {
+		if (i + 1 >= argc || argv[i][0] != '-') {
+			break;
+		}
+		switch (argv[i][1]) {
+		case 'n': slave_total = parse_list(argv[++i], slave_list); break;
+		case 'd': len_total = parse_list(argv[++i], len_list); break;
+		case 'l': loss_total = parse_list(argv[++i], loss_list); break;
+		case 'c': p.cycles = (U32)atol(argv[++i]); break;
+		case 'b': p.baud = (U32)atol(argv[++i]); break;
+		case 'a': p.max_ack_delay = (U32)atol(argv[++i]); break;
+		case 'r': p.response = (U32)atol(argv[++i]); break;
+		case 't': p.turnaround = (U32)atol(argv[++i]); break;
+		case 'w': p.deadline = (U32)atol(argv[++i]); break;
+		case 's': rand_state = (U32)atol(argv[++i]); break;
+		case 'u': p.urgent = (U32)atol(argv[++i]); break;
+		case 'k': p.bulk = (U32)atol(argv[++i]); break;
+		default: i = (U16)argc; break;
+		}
+	}
+	if (i < argc || p.cycles < 1 || p.baud < 100 || rand_state == 0) {
+		printf("usage: sim [-n slaves] [-d data_len] [-l loss] [-c cycles] [-b baud]\n"
+		       "           [-a max_ack_delay] [-r response] [-t turnaround]\n"
+		       "           [-w deadline] [-s seed] [-u urgent] [-k bulk_len]\n");
+		return 1;
+	}
+#if !defined PACK_TX_ASYNC
+	if (p.bulk > 0) {
+		printf("Bulk write needs PACK_TX_ASYNC.\n");
+		return 1;
+	}
+#endif
+	for (i = 0; i < slave_total; i++) {
+		if (slave_list[i] < 1 || slave_list[i] > PACK_ADDR_COUNT - 2) {
+			printf("Slaves must be 1 to %lu.\n", PACK_ADDR_COUNT - 2);
+			return 1;
+		}
+	}
+	for (i = 0; i < len_total; i++) {
+		if (len_list[i] < 1 || len_list[i] > MAX_DATA_LEN) {
+			printf("Data length must be 1 to %u.\n", (U16)MAX_DATA_LEN);
+			return 1;
+		}
+	}
+
+	printf("%u baud, ack delay %u ms, response %u us, turnaround %u us, %u cycles",
+	       p.baud, p.max_ack_delay, p.response, p.turnaround, p.cycles);
+	if (p.urgent > 0) {
+		printf(", urgent every %u us", p.urgent);
+	}
+	if (p.bulk > 0) {
+		printf(", bulk write of %u bytes", p.bulk);
+	}
+	printf("\n");
+	printf("                  | cycle time (ms)     | bus            | request latency (us)                | frames and requests         |\n");
+	printf("slaves  data loss |       avg       p99 |     %% frames/s |      p50      p99    p99.9      max |  retry failed  collis   loss |   speed\n");
+	for (i = 0; i < slave_total; i++) {
+		for (j = 0; j < len_total; j++) {
+			for (k = 0; k < loss_total; k++) {
+				p.slave_count = (U16)slave_list[i];
+				p.data_len = (U16)len_list[j];
+				p.loss = loss_list[k];
+				if (!run(&p)) {
+					flag_ok = false;
+				}
+			}
+		}
+	}
+
+	return flag_ok ? 0 : 1;
+}
@@ -129,10 +129,10 @@ int main(void)
 			if (check_result == PACK_RECV_NEW) {
 				// Print the package
 				printf("<Slave1 Recv> dest: %d, src: %d, seqno: %d, len: %d, cmd: %c, data: %c\n",
-				((struct pack_header*)recv_buf)->dest,
-				((struct pack_header*)recv_buf)->src,
-				((struct pack_header*)recv_buf)->seqno,
-				((struct pack_header*)recv_buf)->len,
+				get_pack_addr(((struct pack_header*)recv_buf)->dest),
+				get_pack_addr(((struct pack_header*)recv_buf)->src),
+				get_pack_seqno(((struct pack_header*)recv_buf)->seqno),
+				get_pack_u16(((struct pack_header*)recv_buf)->len),
 				data_recv->cmd,
 				data_recv->cmd_data[0]);
 
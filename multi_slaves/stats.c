@@ -0,0 +1,276 @@
+/* ==========================================================================
+ * stats.c: Shared-memory Statistics of Embedded Transport Protocol (Linux)
+ *
+ * function:  1. Publishes the statistics, the state of slaves and the
+ *               histogram of ack delay of links to a shared-memory segment,
+ *               which monitoring tools map and read at any rate.
+ *            2. A slot for each link, updated under a seqlock by the thread
+ *               of link only, without lock or system call.
+ *            3. Readers copy consistent snapshots, retrying while the slot
+ *               is being written, the writer never waits for readers.
+ *            4. The segment is versioned, and the layout is described in
+ *               its head, so readers refuse a segment they don't know.
+ *
+ * build:     gcc app.c stats.c package.c trace.c -lrt
+ * ======================================================================== */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "stats.h"
+
+// Keep the order of memory access between seqlock and slot, x86 never
+// reorders stores with stores or loads with loads
+#if defined X86 && defined __GNUC__
+	#define STATS_BARRIER() __asm__ __volatile__("" ::: "memory")
+#elif defined __GNUC__
+	#define STATS_BARRIER() __sync_synchronize()
+#else
+	#define STATS_BARRIER()
+#endif
+
+
+// =========================== Interface Functions ==========================
+// Create the shared-memory segment 'name', e.g. "/etp_stats", with 'link_count'
+// slots that hold 'max_peers' slaves each, return NULL if failed. An old
+// segment of the same name is replaced.
+struct stats_segment* stats_create(const char* name, U16 link_count, U16 max_peers)
+{
+	struct stats_segment* seg;
+	U32 link_size;
+	U32 size;
+	int fd;
+
+	// Slots are aligned for the U32 fields
+	link_size = (U32)(sizeof(struct stats_link) + sizeof(struct stats_peer) * max_peers + 7) & ~7U;
+	size = (U32)sizeof(struct stats_segment) + link_size * link_count;
+
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	seg = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED) {
+		shm_unlink(name);
+		return NULL;
+	}
+
+	// The pages are zero, so every slot is empty and stable
+	seg->version = STATS_VERSION;
+	seg->head_size = sizeof(struct stats_segment);
+	seg->size = size;
+	seg->link_size = link_size;
+	seg->link_count = link_count;
+	seg->max_peers = max_peers;
+	seg->hist_size = PACK_HIST_SIZE;
+	seg->send_type_total = PACK_SEND_TYPE_TOTAL;
+	seg->recv_type_total = PACK_RECV_TYPE_TOTAL;
+	seg->prio_total = PACK_PRIO_TOTAL;
+	seg->local_time_per_sec = LOCAL_TIME_PER_SEC;
+	// Readers take the segment after the magic is written
+	STATS_BARRIER();
+	seg->magic = STATS_MAGIC;
+
+	return seg;
+}
+
+// Map the segment 'name' read-only for reading snapshots, return NULL if it
+// doesn't exist or its version or layout is unknown
+const struct stats_segment* stats_attach(const char* name)
+{
+	const struct stats_segment* seg;
+	struct stat st;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct stats_segment)) {
+		close(fd);
+		return NULL;
+	}
+	seg = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED) {
+		return NULL;
+	}
+
+	// Check the layout is the one of this build
+	if (seg->magic != STATS_MAGIC || seg->version != STATS_VERSION
+	|| seg->head_size != sizeof(struct stats_segment)
+	|| seg->size != (U32)st.st_size
+	|| seg->link_size < sizeof(struct stats_link) + sizeof(struct stats_peer) * seg->max_peers
+	|| seg->size < seg->head_size + (U32)seg->link_size * seg->link_count
+	|| seg->hist_size != PACK_HIST_SIZE
+	|| seg->send_type_total != PACK_SEND_TYPE_TOTAL
+	|| seg->recv_type_total != PACK_RECV_TYPE_TOTAL
+	|| seg->prio_total != PACK_PRIO_TOTAL) {
+		munmap((void*)seg, st.st_size);
+		return NULL;
+	}
+
+	return seg;
+}
+
+// Unmap the segment
+void stats_detach(const struct stats_segment* seg)
+{
+	munmap((void*)seg, seg->size);
+}
+
+// Remove the segment 'name' from the system, mapped segments stay valid
+void stats_remove(const char* name)
+{
+	shm_unlink(name);
+}
+
+// Publish the link selected in current thread to slot 'index', only the
+// thread of link may publish to its slot
+void stats_publish(struct stats_segment* seg, U16 index)
+{
+	struct pack_link* link = get_pack_link();
+	struct stats_link* slot;
+	const struct pack_count* count = &link->pack_count_info;
+#if !defined PACK_ROLE_SLAVE
+	const struct pack_peer* peer;
+	const struct pack_req_count* req;
+	struct stats_peer* out;
+	U16 i;
+#endif
+
+	if (index >= seg->link_count) {
+		return;
+	}
+	slot = stats_get_link(seg, index);
+
+	// Readers retry while the seqlock is odd
+	slot->seq++;
+	STATS_BARRIER();
+
+	slot->publish_count++;
+	slot->time = LOCAL_TIME();
+	slot->local_addr = link->local_addr;
+	slot->flag_is_master = link->flag_is_master;
+	slot->flag_need_ack = link->flag_master_need_ack;
+	slot->retry_times = link->master_retry_times;
+	memcpy(slot->send_pack_count, count->send_pack_count, sizeof(slot->send_pack_count));
+	memcpy(slot->recv_pack_count, count->recv_pack_count, sizeof(slot->recv_pack_count));
+#if defined PACK_FEC
+	slot->fec_pack_count = count->fec_pack_count;
+	slot->fec_byte_count = count->fec_byte_count;
+#endif
+	memcpy(slot->ack_delay_hist, count->ack_delay_hist, sizeof(slot->ack_delay_hist));
+
+#if !defined PACK_ROLE_SLAVE
+	// Requests of each class
+	for (i = 0; i < PACK_PRIO_TOTAL; i++) {
+		req = &count->req_count_info[i];
+		slot->reqs[i].submit_count = req->submit_count;
+		slot->reqs[i].done_count = req->done_count;
+		slot->reqs[i].latency_sum = req->latency_sum;
+		slot->reqs[i].latency_max = req->latency_max;
+		memcpy(slot->reqs[i].latency_hist, req->latency_hist, sizeof(slot->reqs[i].latency_hist));
+		slot->reqs[i].depth = link->req_count[i];
+		slot->reqs[i].depth_max = req->depth_max;
+	}
+
+	// State of slaves in peer table of master
+	slot->peer_count = 0;
+	slot->peer_lost = 0;
+	if (link->flag_is_master) {
+		for (i = 0; i < link->peer_size; i++) {
+			peer = &link->peers[i];
+			if (!peer->flag_used) {
+				continue;
+			}
+			if (slot->peer_count >= seg->max_peers) {
+				slot->peer_lost++;
+				continue;
+			}
+			out = &slot->peers[slot->peer_count++];
+			out->send_count = peer->send_count;
+			out->ack_count = peer->ack_count;
+			out->tokens = peer->tokens;
+#if defined PACK_TIMESTAMP
+			out->clock_offset = peer->clock_offset;
+			out->wire_time = peer->wire_time;
+			out->service_time = peer->service_time;
+			out->service_time_max = peer->service_time_max;
+			out->stamp_count = peer->stamp_count;
+#else
+			out->clock_offset = 0;
+			out->wire_time = 0;
+			out->service_time = 0;
+			out->service_time_max = 0;
+			out->stamp_count = 0;
+#endif
+			out->share = peer->share;
+			out->slave_addr = peer->slave_addr;
+		}
+	}
+#endif
+
+	STATS_BARRIER();
+	slot->seq++;
+}
+
+// Copy a consistent snapshot of slot 'index' to 'snap', which has room for
+// 'max_peers' slaves, return false if the slot is always being written
+bool stats_read(const struct stats_segment* seg, U16 index, struct stats_link* snap, U16 max_peers)
+{
+	const struct stats_link* slot;
+	U32 seq;
+	U16 peer_count;
+	U16 tries;
+
+	if (index >= seg->link_count) {
+		return false;
+	}
+	slot = stats_get_link(seg, index);
+
+	for (tries = 0; tries < STATS_READ_TRIES; tries++) {
+		seq = slot->seq;
+		if (seq & 1) {
+			// Give the writer time to finish
+			sched_yield();
+			continue;
+		}
+		STATS_BARRIER();
+
+		memcpy(snap, (const void*)slot, sizeof(struct stats_link));
+		// The count may be torn, it's checked before use
+		peer_count = snap->peer_count;
+		if (peer_count > seg->max_peers) {
+			peer_count = seg->max_peers;
+		}
+		if (peer_count > max_peers) {
+			peer_count = max_peers;
+		}
+		memcpy(snap->peers, slot->peers, sizeof(struct stats_peer) * peer_count);
+
+		// The copy is consistent if no publish ran during it
+		STATS_BARRIER();
+		if (slot->seq == seq) {
+			if (snap->peer_count > peer_count) {
+				snap->peer_lost += snap->peer_count - peer_count;
+				snap->peer_count = peer_count;
+			}
+			snap->seq = seq;
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,122 @@
+/* ==========================================================================
+ * stats.h: Shared-memory Statistics of Embedded Transport Protocol (Linux)
+ *
+ * function:  1. Publishes the statistics, the state of slaves and the
+ *               histogram of ack delay of links to a shared-memory segment,
+ *               which monitoring tools map and read at any rate.
+ *            2. A slot for each link, updated under a seqlock by the thread
+ *               of link only, without lock or system call.
+ *            3. Readers copy consistent snapshots, retrying while the slot
+ *               is being written, the writer never waits for readers.
+ *            4. The segment is versioned, and the layout is described in
+ *               its head, so readers refuse a segment they don't know.
+ *
+ * build:     gcc app.c stats.c package.c trace.c -lrt
+ * ======================================================================== */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include "package.h"
+
+#if !defined PACK_STATS
+	#error "stats.h needs PACK_STATS, which keeps the histogram of ack delay"
+#endif
+
+// Magic number at the head of segment, "ETPS" in memory
+#define STATS_MAGIC   0x53505445
+// Version of the layout of segment, changed if any structure below changes
+#define STATS_VERSION 3
+// Times that reader retries a slot being written before giving up
+#define STATS_READ_TRIES 1000
+
+// State of a slave kept by master
+struct stats_peer {
+	U32 send_count;       // New packages sent to slave
+	U32 ack_count;        // New acks received from slave
+	U32 tokens;           // Tokens left in microseconds of bus time
+	U32 clock_offset;     // Clock offset of slave, see struct pack_peer, 0 without PACK_TIMESTAMP
+	U32 wire_time;        // Smoothed wire time in microseconds
+	U32 service_time;     // Smoothed service time of slave in microseconds
+	U32 service_time_max; // Maximum service time of slave in microseconds
+	U32 stamp_count;      // Acks sampled for timestamps
+	U16 share;            // Share of bus time in permille, 0 if not limited
+	U16 slave_addr;       // Address of slave
+};
+
+// Asynchronous requests of a priority class of master, see struct pack_req_count
+struct stats_req {
+	U32 submit_count;         // Requests submitted
+	U32 done_count;           // Requests completed
+	U32 latency_sum;          // Sum of latency of completed requests
+	U32 latency_max;          // Maximum latency
+	U32 latency_hist[PACK_HIST_SIZE]; // Histogram of latency
+	U8 depth;                 // Requests in queue
+	U8 depth_max;             // Maximum requests in queue
+	U16 reserved;             // Zero
+};
+
+// Slot of a link, followed by 'max_peers' entries of struct stats_peer
+struct stats_link {
+	volatile U32 seq;         // Seqlock, odd while the slot is being written
+	U32 publish_count;        // Times the slot was published
+	U32 time;                 // Local time of the last publish
+	U16 local_addr;           // Local address of link
+	U8 flag_is_master;        // If the link is master
+	U8 flag_need_ack;         // If master is waiting for ack
+	U16 retry_times;          // The resend times of master
+	U16 reserved;             // Zero
+	U32 send_pack_count[PACK_SEND_TYPE_TOTAL]; // Statistics for sent packages
+	U32 recv_pack_count[PACK_RECV_TYPE_TOTAL]; // Statistics for received packages
+	U32 fec_pack_count;       // Received packages corrected by FEC
+	U32 fec_byte_count;       // Bytes corrected by FEC
+	U32 ack_delay_hist[PACK_HIST_SIZE]; // Histogram of ack delay, see struct pack_count
+	struct stats_req reqs[PACK_PRIO_TOTAL]; // Requests of each class, master only
+	U16 peer_count;           // Number of entries used in 'peers'
+	U16 peer_lost;            // Slaves in peer table that 'peers' can't hold
+	struct stats_peer peers[]; // State of slaves, master only
+};
+
+// Head of segment, followed by 'link_count' slots of 'link_size' bytes
+struct stats_segment {
+	U32 magic;                // STATS_MAGIC
+	U16 version;              // STATS_VERSION
+	U16 head_size;            // Size of this head
+	U32 size;                 // Size of the whole segment
+	U32 link_size;            // Size of a slot with its peers
+	U16 link_count;           // Number of slots
+	U16 max_peers;            // Entries of struct stats_peer in each slot
+	U16 hist_size;            // PACK_HIST_SIZE
+	U16 send_type_total;      // PACK_SEND_TYPE_TOTAL
+	U16 recv_type_total;      // PACK_RECV_TYPE_TOTAL
+	U16 prio_total;           // PACK_PRIO_TOTAL
+	U32 local_time_per_sec;   // LOCAL_TIME_PER_SEC, unit of time and histogram
+};
+
+// Get the slot 'index' of segment
+static inline struct stats_link* stats_get_link(const struct stats_segment* seg, U16 index)
+{
+	return (struct stats_link*)((U8*)seg + seg->head_size + (size_t)seg->link_size * index);
+}
+
+// =========================== Interface Functions ==========================
+// Create the shared-memory segment 'name', e.g. "/etp_stats", with 'link_count'
+// slots that hold 'max_peers' slaves each, return NULL if failed. An old
+// segment of the same name is replaced.
+struct stats_segment* stats_create(const char* name, U16 link_count, U16 max_peers);
+// Map the segment 'name' read-only for reading snapshots, return NULL if it
+// doesn't exist or its version or layout is unknown
+const struct stats_segment* stats_attach(const char* name);
+// Unmap the segment
+void stats_detach(const struct stats_segment* seg);
+// Remove the segment 'name' from the system, mapped segments stay valid
+void stats_remove(const char* name);
+// Publish the link selected in current thread to slot 'index', only the
+// thread of link may publish to its slot
+void stats_publish(struct stats_segment* seg, U16 index);
+// Copy a consistent snapshot of slot 'index' to 'snap', which has room for
+// 'max_peers' slaves, return false if the slot is always being written
+bool stats_read(const struct stats_segment* seg, U16 index, struct stats_link* snap, U16 max_peers);
+
+
+#endif
@@ -0,0 +1,153 @@
+/* ==========================================================================
+ * trace.c: Package Trace of Embedded Transport Protocol
+ *
+ * function:  1. Records every sent package, received package with its
+ *               verdict and ack timeout, with a monotonic time.
+ *            2. Fixed-size ring, the newest record replaces the oldest.
+ *            3. Lock-free, the protocol writes without waiting, readers
+ *               copy out consistent records at any time.
+ *            4. Dumps the ring to a pcap file for offline analysis.
+ *            5. A ring for each link, the default link uses 'pack_trace'.
+ * ======================================================================== */
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <string.h>
+#include "trace.h"
+
+// Keep the order of memory access between record and index of ring, x86
+// never reorders stores with stores or loads with loads
+#if defined X86 && defined __GNUC__
+	#define TRACE_BARRIER() __asm__ __volatile__("" ::: "memory")
+#elif defined __GNUC__
+	#define TRACE_BARRIER() __sync_synchronize()
+#else
+	#define TRACE_BARRIER()
+#endif
+
+// ============================ Global Variables ============================
+// Trace ring of the default link
+struct trace_ring pack_trace;
+
+// Time of record
+static U32 trace_time(void)
+{
+#if defined TRACE_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (U32)((U32)ts.tv_sec * 1000000UL + (U32)(ts.tv_nsec / 1000));
+#else
+	return (U32)LOCAL_TIME();
+#endif
+}
+
+
+// =========================== Interface Functions ==========================
+// Record a event, 'verdict' is only for TRACE_RECV
+void trace_pack(struct trace_ring* ring, enum trace_type_list type, U8 verdict, const U8* buf, U16 len)
+{
+	U32 head = ring->head;
+	struct trace_record* rec = &ring->records[head & (TRACE_RING_SIZE - 1)];
+
+	rec->time = trace_time();
+	rec->type = type;
+	rec->verdict = verdict;
+	rec->len = len;
+	memcpy(rec->snap, buf, (len < TRACE_SNAP_LEN) ? len : TRACE_SNAP_LEN);
+
+	// Publish the record after it's written
+	TRACE_BARRIER();
+	ring->head = head + 1;
+}
+
+// Copy at most 'max_count' records out of the ring, the oldest first,
+// return the number of records copied
+U16 trace_read(struct trace_ring* ring, struct trace_record* records, U16 max_count)
+{
+	U32 head;
+	U32 first;
+	U32 count;
+	U32 lost = 0;
+	U32 i;
+
+	// Find the records in ring
+	head = ring->head;
+	TRACE_BARRIER();
+	count = (head < TRACE_RING_SIZE) ? head : TRACE_RING_SIZE;
+	if (count > max_count) {
+		count = max_count;
+	}
+	first = head - count;
+
+	// Copy records without stopping the writer
+	for (i = 0; i < count; i++) {
+		records[i] = ring->records[(first + i) & (TRACE_RING_SIZE - 1)];
+	}
+
+	// Drop the records that replaced by writer during copy, including the
+	// one in the slot being written
+	TRACE_BARRIER();
+	head = ring->head;
+	if (head + 1 > first + TRACE_RING_SIZE) {
+		lost = head + 1 - first - TRACE_RING_SIZE;
+	}
+	if (lost >= count) {
+		return 0;
+	}
+	if (lost > 0) {
+		memmove(records, records + lost, (count - lost) * sizeof(struct trace_record));
+	}
+
+	return (U16)(count - lost);
+}
+
+// Write U32 in little-endian to file
+static void write_u32(FILE* fd, U32 value)
+{
+	fputc((U8)value, fd);
+	fputc((U8)(value >> 8), fd);
+	fputc((U8)(value >> 16), fd);
+	fputc((U8)(value >> 24), fd);
+}
+
+// Dump the records in the ring to pcap file, return false if failed
+bool trace_dump(struct trace_ring* ring, const char* file_name)
+{
+	struct trace_record records[TRACE_RING_SIZE];
+	U16 count;
+	U16 snap_len;
+	U16 i;
+	FILE* fd = fopen(file_name, "wb");
+
+	// Check if file opened successfully
+	if (fd == NULL) {
+		return false;
+	}
+
+	// Global header of pcap file
+	write_u32(fd, 0xA1B2C3D4);
+	write_u32(fd, 0x00040002);
+	write_u32(fd, 0);
+	write_u32(fd, 0);
+	write_u32(fd, TRACE_PCAP_HEAD_LEN + TRACE_SNAP_LEN);
+	write_u32(fd, TRACE_PCAP_LINKTYPE);
+
+	// A pcap packet for each record
+	count = trace_read(ring, records, TRACE_RING_SIZE);
+	for (i = 0; i < count; i++) {
+		snap_len = (records[i].len < TRACE_SNAP_LEN) ? records[i].len : TRACE_SNAP_LEN;
+		write_u32(fd, records[i].time / TRACE_TIME_PER_SEC);
+		write_u32(fd, (U32)((U32)(records[i].time % TRACE_TIME_PER_SEC)
+		              * 1000000.0 / TRACE_TIME_PER_SEC));
+		write_u32(fd, TRACE_PCAP_HEAD_LEN + snap_len);
+		write_u32(fd, TRACE_PCAP_HEAD_LEN + records[i].len);
+		fputc(records[i].type, fd);
+		fputc(records[i].verdict, fd);
+		fputc((U8)records[i].len, fd);
+		fputc((U8)(records[i].len >> 8), fd);
+		fwrite(records[i].snap, 1, snap_len, fd);
+	}
+
+	return fclose(fd) == 0;
+}
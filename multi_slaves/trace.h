@@ -0,0 +1,82 @@
+/* ==========================================================================
+ * trace.h: Package Trace of Embedded Transport Protocol
+ *
+ * function:  1. Records every sent package, received package with its
+ *               verdict and ack timeout, with a monotonic time.
+ *            2. Fixed-size ring, the newest record replaces the oldest.
+ *            3. Lock-free, the protocol writes without waiting, readers
+ *               copy out consistent records at any time.
+ *            4. Dumps the ring to a pcap file for offline analysis.
+ *            5. A ring for each link, the default link uses 'pack_trace'.
+ * ======================================================================== */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "package.h"
+
+// Number of records in trace ring, must be power of 2
+#define TRACE_RING_SIZE 256
+// Maximum bytes captured from each package, which is the header and a few
+// bytes of data. Captures for replay define it as MAX_BUF_SIZE, so packages
+// are whole for the parser.
+#ifndef TRACE_SNAP_LEN
+	#define TRACE_SNAP_LEN 32
+#endif
+
+// Time of records is a monotonic clock in microseconds on POSIX systems,
+// since clock() of the default local time is processor time. It's the local
+// time with PACK_CLOCK_EXTERN, and on MCUs.
+#if defined PACK_CLOCK_EXTERN || !(defined __unix__ || defined __APPLE__)
+	#define TRACE_TIME_PER_SEC LOCAL_TIME_PER_SEC
+#else
+	#define TRACE_MONOTONIC
+	#define TRACE_TIME_PER_SEC 1000000UL
+#endif
+
+// Link type of pcap file, one of the types reserved for private use
+#define TRACE_PCAP_LINKTYPE 147
+// Length of trace head before the captured bytes in each pcap packet,
+// which is type, verdict and little-endian length of the whole package
+#define TRACE_PCAP_HEAD_LEN 4
+
+// Type of trace event
+enum trace_type_list {
+	TRACE_SEND_NEW,   // New package sent
+	TRACE_SEND_RETRY, // Package resent
+	TRACE_RECV,       // Package received, with the verdict of check_pack()
+	TRACE_TIMEOUT,    // Master's ack timeout of the package in sending buffer
+
+	TRACE_TYPE_TOTAL, // Total type of trace event
+};
+
+// Trace record
+struct trace_record {
+	U32 time;                // Time of event, in TRACE_TIME_PER_SEC
+	U8 type;                 // Type of event
+	U8 verdict;              // Verdict of received package
+	U16 len;                 // Length of the whole package
+	U8 snap[TRACE_SNAP_LEN]; // Bytes captured from the head of package
+};
+
+// Trace ring, it has only one writer
+struct trace_ring {
+	struct trace_record records[TRACE_RING_SIZE]; // Ring of records
+	volatile U32 head;                             // Total number of records written
+};
+
+// ============================ Global Variables ============================
+// Trace ring of the default link
+extern struct trace_ring pack_trace;
+
+// =========================== Interface Functions ==========================
+// Record a event, 'verdict' is only for TRACE_RECV
+void trace_pack(struct trace_ring* ring, enum trace_type_list type, U8 verdict, const U8* buf, U16 len);
+// Copy at most 'max_count' records out of the ring, the oldest first,
+// return the number of records copied
+U16 trace_read(struct trace_ring* ring, struct trace_record* records, U16 max_count);
+// Dump the records in the ring to pcap file, return false if failed
+bool trace_dump(struct trace_ring* ring, const char* file_name);
+
+
+#endif
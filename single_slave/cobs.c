@@ -0,0 +1,80 @@
+/* ==========================================================================
+ * cobs.c: Consistent Overhead Byte Stuffing for Framing of Packages
+ *
+ * function:  1. Encodes a package without zero bytes, so a zero byte only
+ *               appears as the delimiter between frames.
+ *            2. Bounded overhead, one byte for every 254 bytes at most.
+ *            3. Decodes in place, no copy of the received frame.
+ * ======================================================================== */
+
+#include <string.h>
+#include "cobs.h"
+
+// =========================== Interface Functions ==========================
+// Encode 'len' bytes of 'src' to 'dst', which has COBS_MAX_LEN(len) bytes
+// at least, return the length encoded, the delimiter is not appended
+U16 cobs_encode(const U8* src, U16 len, U8* dst)
+{
+	const U8* zero;
+	U16 out = 0;
+	U16 run;
+
+	while (true) {
+		// Find the run before the next zero, memchr() and memcpy() are much
+		// faster than a loop of bytes
+		run = (len < COBS_MAX_RUN) ? len : COBS_MAX_RUN;
+		zero = memchr(src, 0, run);
+		if (zero != NULL) {
+			run = (U16)(zero - src);
+		}
+
+		// The code byte is the distance to the next zero
+		dst[out] = (U8)(run + 1);
+		memcpy(dst + out + 1, src, run);
+		out += run + 1;
+		src += run;
+		len -= run;
+
+		if (zero != NULL) {
+			// The zero is replaced by the code byte
+			src++;
+			len--;
+		} else if ((run < COBS_MAX_RUN) || (len == 0)) {
+			// All bytes are encoded
+			break;
+		}
+		// A full run is followed by the next code byte without zero
+	}
+
+	return out;
+}
+
+// Decode 'len' bytes of 'buf' in place, which are a frame without the
+// delimiter, return the length decoded, or 0 if the frame is broken
+U16 cobs_decode(U8* buf, U16 len)
+{
+	U16 in = 0;
+	U16 out = 0;
+	U8 code;
+
+	while (in < len) {
+		code = buf[in++];
+		// Check if the run is in the frame
+		if ((code == COBS_DELIMITER) || (code - 1 > len - in)) {
+			return 0;
+		}
+
+		// Move the run forward over the code bytes
+		memmove(buf + out, buf + in, code - 1);
+		in += code - 1;
+		out += code - 1;
+
+		// Restore the zero replaced by code byte, except after a full run
+		// and at the end of frame
+		if ((code <= COBS_MAX_RUN) && (in < len)) {
+			buf[out++] = 0;
+		}
+	}
+
+	return out;
+}
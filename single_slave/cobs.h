@@ -0,0 +1,31 @@
+/* ==========================================================================
+ * cobs.h: Consistent Overhead Byte Stuffing for Framing of Packages
+ *
+ * function:  1. Encodes a package without zero bytes, so a zero byte only
+ *               appears as the delimiter between frames.
+ *            2. Bounded overhead, one byte for every 254 bytes at most.
+ *            3. Decodes in place, no copy of the received frame.
+ * ======================================================================== */
+
+#ifndef _COBS_H
+#define _COBS_H
+
+#include "package.h"
+
+// Delimiter between frames
+#define COBS_DELIMITER 0
+// Maximum bytes of a run without zero, which are led by a code byte
+#define COBS_MAX_RUN 254
+// Maximum length of 'len' bytes encoded, without the delimiter
+#define COBS_MAX_LEN(len) ((len) + (len) / COBS_MAX_RUN + 1)
+
+// =========================== Interface Functions ==========================
+// Encode 'len' bytes of 'src' to 'dst', which has COBS_MAX_LEN(len) bytes
+// at least, return the length encoded, the delimiter is not appended
+U16 cobs_encode(const U8* src, U16 len, U8* dst);
+// Decode 'len' bytes of 'buf' in place, which are a frame without the
+// delimiter, return the length decoded, or 0 if the frame is broken
+U16 cobs_decode(U8* buf, U16 len);
+
+
+#endif
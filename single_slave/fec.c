@@ -0,0 +1,237 @@
+/* ==========================================================================
+ * fec.c: Forward Error Correction of Packages by Reed-Solomon Code
+ *
+ * function:  1. Appends parity bytes to package, so the receiver can fix
+ *               byte errors without a resend.
+ *            2. Corrects PACK_FEC bytes at most in a package, at unknown
+ *               positions, with 2 parity bytes for each.
+ *            3. Code over GF(256), a package with parity is 255 bytes at
+ *               most, shorter packages are shortened codes.
+ * ======================================================================== */
+
+#include <string.h>
+#include "fec.h"
+
+#if !defined PACK_FEC
+	#error "fec.c needs PACK_FEC, the maximum bytes corrected in a package"
+#endif
+
+// Primitive polynomial of GF(256), x^8 + x^4 + x^3 + x^2 + 1
+#define FEC_PRIM_POLY 0x11D
+
+// ============================ Static Variables ============================
+static U8 gf_exp[FEC_MAX_LEN * 2];  // Powers of alpha, doubled to skip modulo
+static U8 gf_log[FEC_MAX_LEN + 1];  // Logarithms to base alpha
+static U8 gen_poly[PACK_FEC_LEN + 1]; // Generator polynomial, index is degree
+static U8 gen_log[PACK_FEC_LEN + 1];  // Logarithms of generator coefficients
+
+// Multiply in GF(256)
+static inline U8 gf_mul(U8 a, U8 b)
+{
+	return (a == 0 || b == 0) ? 0 : gf_exp[gf_log[a] + gf_log[b]];
+}
+
+// Divide in GF(256), 'b' must not be zero
+static inline U8 gf_div(U8 a, U8 b)
+{
+	return (a == 0) ? 0 : gf_exp[gf_log[a] + FEC_MAX_LEN - gf_log[b]];
+}
+
+// Evaluate polynomial 'poly' of 'count' coefficients at alpha^'power',
+// index of coefficient is degree
+static U8 poly_eval(const U8* poly, U16 count, U16 power)
+{
+	U8 value = 0;
+
+	while (count > 0) {
+		count--;
+		value = gf_mul(value, gf_exp[power % FEC_MAX_LEN]) ^ poly[count];
+	}
+
+	return value;
+}
+
+// =========================== Interface Functions ==========================
+// Initialize tables of Galois field and generator polynomial
+void fec_init(void)
+{
+	U16 x = 1;
+	U16 i;
+	U16 j;
+
+	for (i = 0; i < FEC_MAX_LEN; i++) {
+		gf_exp[i] = (U8)x;
+		gf_exp[i + FEC_MAX_LEN] = (U8)x;
+		gf_log[x] = (U8)i;
+		x <<= 1;
+		if (x & 0x100) {
+			x ^= FEC_PRIM_POLY;
+		}
+	}
+
+	// Generator polynomial is (x - alpha^0)(x - alpha^1)...
+	memset(gen_poly, 0, sizeof(gen_poly));
+	gen_poly[0] = 1;
+	for (i = 0; i < PACK_FEC_LEN; i++) {
+		for (j = i + 1; j > 0; j--) {
+			gen_poly[j] = gen_poly[j - 1] ^ gf_mul(gen_poly[j], gf_exp[i]);
+		}
+		gen_poly[0] = gf_mul(gen_poly[0], gf_exp[i]);
+	}
+	// Coefficients of generator are never zero
+	for (i = 0; i <= PACK_FEC_LEN; i++) {
+		gen_log[i] = gf_log[gen_poly[i]];
+	}
+}
+
+// Compute PACK_FEC_LEN parity bytes for 'len' bytes of 'buf' to 'parity'
+void fec_encode(const U8* buf, U16 len, U8* parity)
+{
+	U8 feedback;
+	U16 i;
+	U16 j;
+
+	// Remainder of the package divided by generator polynomial, the first
+	// parity byte is the highest degree
+	memset(parity, 0, PACK_FEC_LEN);
+	for (i = 0; i < len; i++) {
+		feedback = buf[i] ^ parity[0];
+		if (feedback == 0) {
+			// Only shift the remainder
+			memmove(parity, parity + 1, PACK_FEC_LEN - 1);
+			parity[PACK_FEC_LEN - 1] = 0;
+			continue;
+		}
+		// Logarithm of feedback is taken once for every coefficient
+		feedback = gf_log[feedback];
+		for (j = 0; j < PACK_FEC_LEN - 1; j++) {
+			parity[j] = parity[j + 1] ^ gf_exp[feedback + gen_log[PACK_FEC_LEN - 1 - j]];
+		}
+		parity[PACK_FEC_LEN - 1] = gf_exp[feedback + gen_log[0]];
+	}
+}
+
+// Correct the codeword of 'len' bytes in 'buf' in place, which ends with
+// parity, return false if it has too many errors, '*count' is the number
+// of bytes corrected
+bool fec_decode(U8* buf, U16 len, U8* count)
+{
+	U8 syndrome[PACK_FEC_LEN];      // Syndromes, index is degree
+	U8 locator[PACK_FEC_LEN + 1];   // Error locator polynomial
+	U8 last[PACK_FEC_LEN + 1];      // Locator before the last change of degree
+	U8 evaluator[PACK_FEC_LEN];     // Error evaluator polynomial
+	U8 temp[PACK_FEC_LEN + 1];
+	U16 position[PACK_FEC];         // Positions of errors in codeword
+	U16 degree;
+	U8 errors = 0;                  // Degree of locator, number of errors
+	U8 last_delta = 1;
+	U8 shift = 1;
+	U8 delta;
+	U8 value;
+	U8 slope;
+	bool flag_error = false;
+	U16 i;
+	U16 j;
+
+	*count = 0;
+	if (len <= PACK_FEC_LEN || len > FEC_MAX_LEN) {
+		return false;
+	}
+
+	// A clean codeword has the parity that encoder gives, which is the
+	// common case and faster to check than syndromes
+	fec_encode(buf, len - PACK_FEC_LEN, temp);
+	if (memcmp(temp, buf + len - PACK_FEC_LEN, PACK_FEC_LEN) == 0) {
+		return true;
+	}
+
+	// Syndromes are zero if there is no error
+	for (i = 0; i < PACK_FEC_LEN; i++) {
+		value = 0;
+		for (j = 0; j < len; j++) {
+			// Multiply by alpha^i with one lookup
+			value = ((value == 0) ? 0 : gf_exp[gf_log[value] + i]) ^ buf[j];
+		}
+		syndrome[i] = value;
+		flag_error |= (value != 0);
+	}
+	if (!flag_error) {
+		return true;
+	}
+
+	// Find error locator by Berlekamp-Massey algorithm
+	memset(locator, 0, sizeof(locator));
+	memset(last, 0, sizeof(last));
+	locator[0] = 1;
+	last[0] = 1;
+	for (i = 0; i < PACK_FEC_LEN; i++) {
+		delta = syndrome[i];
+		for (j = 1; j <= errors; j++) {
+			delta ^= gf_mul(locator[j], syndrome[i - j]);
+		}
+		if (delta == 0) {
+			shift++;
+			continue;
+		}
+
+		memcpy(temp, locator, sizeof(temp));
+		slope = gf_div(delta, last_delta);
+		for (j = shift; j <= PACK_FEC_LEN; j++) {
+			locator[j] ^= gf_mul(slope, last[j - shift]);
+		}
+		if (2 * errors <= i) {
+			errors = (U8)(i + 1 - errors);
+			memcpy(last, temp, sizeof(last));
+			last_delta = delta;
+			shift = 1;
+		} else {
+			shift++;
+		}
+	}
+	if (errors == 0 || errors > PACK_FEC) {
+		return false;
+	}
+
+	// Error evaluator is syndromes times locator, modulo x^PACK_FEC_LEN
+	for (i = 0; i < PACK_FEC_LEN; i++) {
+		value = 0;
+		for (j = 0; j <= i && j <= errors; j++) {
+			value ^= gf_mul(locator[j], syndrome[i - j]);
+		}
+		evaluator[i] = value;
+	}
+
+	// Find error positions by Chien search, byte 'j' is the coefficient of
+	// degree 'len - 1 - j', the locator has root alpha^-degree at an error
+	for (j = 0; j < len; j++) {
+		if (poly_eval(locator, errors + 1, FEC_MAX_LEN - (len - 1 - j)) == 0) {
+			if (*count == errors) {
+				break;
+			}
+			position[(*count)++] = j;
+		}
+	}
+	// Every root of locator must be in the codeword, or nothing is changed
+	if (*count != errors) {
+		*count = 0;
+		return false;
+	}
+
+	// Correct the errors by Forney algorithm
+	for (i = 0; i < errors; i++) {
+		degree = len - 1 - position[i];
+		// Formal derivative of locator has the odd terms only
+		slope = 0;
+		for (j = 1; j <= errors; j += 2) {
+			slope ^= gf_mul(locator[j], gf_exp[((FEC_MAX_LEN - degree) * (j - 1)) % FEC_MAX_LEN]);
+		}
+		if (slope == 0) {
+			*count = 0;
+			return false;
+		}
+		value = poly_eval(evaluator, PACK_FEC_LEN, FEC_MAX_LEN - degree);
+		buf[position[i]] ^= gf_mul(gf_exp[degree], gf_div(value, slope));
+	}
+
+	return true;
+}
@@ -0,0 +1,31 @@
+/* ==========================================================================
+ * fec.h: Forward Error Correction of Packages by Reed-Solomon Code
+ *
+ * function:  1. Appends parity bytes to package, so the receiver can fix
+ *               byte errors without a resend.
+ *            2. Corrects PACK_FEC bytes at most in a package, at unknown
+ *               positions, with 2 parity bytes for each.
+ *            3. Code over GF(256), a package with parity is 255 bytes at
+ *               most, shorter packages are shortened codes.
+ * ======================================================================== */
+
+#ifndef _FEC_H
+#define _FEC_H
+
+#include "package.h"
+
+// Maximum length of a codeword, which is the package with parity
+#define FEC_MAX_LEN 255
+
+// =========================== Interface Functions ==========================
+// Initialize tables of Galois field and generator polynomial
+void fec_init(void);
+// Compute PACK_FEC_LEN parity bytes for 'len' bytes of 'buf' to 'parity'
+void fec_encode(const U8* buf, U16 len, U8* parity);
+// Correct the codeword of 'len' bytes in 'buf' in place, which ends with
+// parity, return false if it has too many errors, '*count' is the number
+// of bytes corrected
+bool fec_decode(U8* buf, U16 len, U8* count);
+
+
+#endif
@@ -0,0 +1,149 @@
+/* ==========================================================================
+ * message.h: Typed Message Schema for the Data Part of Package
+ *
+ * function:  1. Describe application's messages by lists of fields, the
+ *               offsets and length are computed at compile time.
+ *            2. Read and write fields in place, no copy of data part.
+ *            3. Fields are little-endian, independent of CPU type and
+ *               alignment of buffer.
+ *            4. Check command, version and length of received message.
+ *            5. Dispatch received message by command through jump table.
+ * ======================================================================== */
+
+#ifndef _MESSAGE_H
+#define _MESSAGE_H
+
+#include <stddef.h>
+#include "package.h"
+
+// Length of message head, which is command and version
+#define MSG_HEAD_LEN 2
+// Total number of commands
+#define MSG_CMD_TOTAL 256
+
+// Function type of message handler
+typedef void (*msg_handler)(const void* data, U16 len);
+
+// ========================== Field Access Functions ========================
+// Read fields in little-endian
+static inline U8 msg_get_U8(const U8* p)
+{
+	return p[0];
+}
+
+static inline U16 msg_get_U16(const U8* p)
+{
+	return (U16)(p[0] | ((U16)p[1] << 8));
+}
+
+static inline U32 msg_get_U32(const U8* p)
+{
+	return (U32)p[0] | ((U32)p[1] << 8) | ((U32)p[2] << 16) | ((U32)p[3] << 24);
+}
+
+// Write fields in little-endian
+static inline void msg_put_U8(U8* p, U8 value)
+{
+	p[0] = value;
+}
+
+static inline void msg_put_U16(U8* p, U16 value)
+{
+	p[0] = (U8)value;
+	p[1] = (U8)(value >> 8);
+}
+
+static inline void msg_put_U32(U8* p, U32 value)
+{
+	p[0] = (U8)value;
+	p[1] = (U8)(value >> 8);
+	p[2] = (U8)(value >> 16);
+	p[3] = (U8)(value >> 24);
+}
+
+// ============================ Message Definition ==========================
+// Define message 'name' with command 'cmd', version 'ver' and the fields
+// listed by macro 'fields', the field types are U8, U16 and U32, e.g.
+//
+//     #define LED_FIELDS(FIELD, msg) FIELD(msg, U8, index) FIELD(msg, U16, duty)
+//     DEFINE_MSG(led, 'E', 1, LED_FIELDS)
+//
+// generates:
+//     struct msg_led               Layout of message, only for offsets
+//     MSG_CMD_led, MSG_VER_led     Command and version
+//     MSG_LEN_led                  Length of message
+//     led_get_index(data)          Read field 'index'
+//     led_put_index(data, value)   Write field 'index'
+//     led_init(data)               Write message head, return MSG_LEN_led
+//     led_check(data, len)         Check if a received message is valid
+//
+// Newer version of a message may only append fields, so a message with
+// the same or newer version is accepted if it's long enough.
+#define DEFINE_MSG(name, cmd, ver, fields) \
+	struct msg_##name { \
+		U8 head[MSG_HEAD_LEN]; \
+		fields(MSG_LAYOUT, name) \
+		U8 tail[]; \
+	}; \
+	enum { \
+		MSG_CMD_##name = (cmd), \
+		MSG_VER_##name = (ver), \
+		MSG_LEN_##name = offsetof(struct msg_##name, tail), \
+	}; \
+	fields(MSG_ACCESS, name) \
+	static inline U16 name##_init(void* data) \
+	{ \
+		((U8*)data)[0] = MSG_CMD_##name; \
+		((U8*)data)[1] = MSG_VER_##name; \
+		return MSG_LEN_##name; \
+	} \
+	static inline bool name##_check(const void* data, U16 len) \
+	{ \
+		return (len >= MSG_LEN_##name) \
+		&& (((const U8*)data)[0] == MSG_CMD_##name) \
+		&& (((const U8*)data)[1] >= MSG_VER_##name); \
+	}
+
+// Layout of a field, arrays of bytes have no padding
+#define MSG_LAYOUT(msg, type, field) U8 field[sizeof(type)];
+
+// Access functions of a field
+#define MSG_ACCESS(msg, type, field) \
+	static inline type msg##_get_##field(const void* data) \
+	{ \
+		return msg_get_##type((const U8*)data + offsetof(struct msg_##msg, field)); \
+	} \
+	static inline void msg##_put_##field(void* data, type value) \
+	{ \
+		msg_put_##type((U8*)data + offsetof(struct msg_##msg, field), value); \
+	}
+
+// ============================ Message Dispatch ============================
+// Entry of jump table indexed by command, e.g.
+//
+//     static const msg_handler handlers[MSG_CMD_TOTAL] = {
+//         MSG_HANDLER(led, on_led),
+//     };
+#define MSG_HANDLER(name, func) [MSG_CMD_##name] = (func)
+
+// Call the handler of received message, return false if no handler
+static inline bool msg_dispatch(const msg_handler table[MSG_CMD_TOTAL], const void* data, U16 len)
+{
+	msg_handler handler;
+
+	if (len < MSG_HEAD_LEN) {
+		return false;
+	}
+
+	handler = table[((const U8*)data)[0]];
+	if (handler == NULL) {
+		return false;
+	}
+
+	handler(data, len);
+
+	return true;
+}
+
+
+#endif
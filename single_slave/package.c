@@ -11,50 +11,90 @@
  *            6. Support variable-length data part.
  *            7. Application can define their own data structure.
  *            8. Statistics for every sent and received package.
+ *            9. Resynchronizes on the next package after line noise.
+ *           10. Optional COBS framing with unambiguous frame boundaries.
+ *           11. Optional forward error correction of received packages.
+ *           12. Fast resend of master on stale acks, before ack timeout.
+ *           13. Optional asynchronous sending with 2 buffers, for DMA or
+ *               interrupt-driven lower layer.
+ *           14. Master repeats a package with new seqno in constant time,
+ *               by patching the checksum incrementally.
+ *           15. Seqno compared by serial number arithmetic, slave drops
+ *               delayed duplicates, optional 32-bit seqno.
  * ======================================================================== */
 
 #include <stdio.h>
 #include <string.h>
 #include "package.h"
+#if defined PACK_FRAMING_COBS
+	#include "cobs.h"
+#endif
+#if defined PACK_FEC
+	#include "fec.h"
+#endif
+
+// Role of the machine, resolved at compile time if it is defined
+#if defined PACK_ROLE_MASTER
+	#define IS_MASTER (true)
+#elif defined PACK_ROLE_SLAVE
+	#define IS_MASTER (false)
+#else
+	#define IS_MASTER (flag_is_master)
+#endif
 
 // ============================ Static Variables ============================
 static U8 send_buf[MAX_BUF_SIZE];  // Sending buffer
 static bool flag_is_master;        // If the machine is master
 static U32 master_max_ack_delay;   // The max wait time that master waiting for ack
 static send_bytes_func send_bytes; // Callback function for sending bytes
-
-static U16 slave_recv_seqno_last;  // The last seqno that slave received
-static U16 master_send_seqno_last; // The last seqno that master sent
+#if defined PACK_TX_ASYNC
+static U8 tx_buf[2][MAX_FRAME_SIZE]; // Sending buffers of frames, one is on the bus while the other is filled
+static U8 tx_next;                   // Index of the buffer to fill next
+static volatile bool flag_tx_busy;   // If a frame is on the bus
+static volatile U16 tx_wait_len;     // Length of the frame waiting for the bus, 0 if none
+#elif defined PACK_FRAMING_COBS
+static U8 frame_buf[MAX_FRAME_SIZE]; // Sending buffer of frame encoded by COBS
+#endif
+
+static pack_seqno slave_recv_seqno_last;  // The last seqno that slave received
+static pack_seqno master_send_seqno_last; // The last seqno that master sent
 static bool flag_master_need_ack;  // If master is waiting for ack
-static U32 master_send_time_last;  // The last point-in-time that master sent package
+static volatile U32 master_send_time_last; // The last point-in-time that master sent package
+#if defined PACK_TX_ASYNC
+static volatile bool flag_master_tx_done; // If the last package of master is out
+#endif
 static U16 master_retry_times;     // The resend times of master
+static U8 master_fast_retry_acks;  // Stale acks that make master resend at once, 0 if disabled
+static U8 master_stale_ack_count;  // Stale acks received since the last sending
 static struct pack_count pack_count_info; // Statistics for sent and received packages
 
 // ============================ Global Variables ============================
 // Receiving buffer for lower layer to store received data
-U8 recv_buf[MAX_BUF_SIZE];
+U8 recv_buf[MAX_FRAME_SIZE];
 
 // Sending data address for application to store its sending data
-void* send_data = ((struct pack_header*)send_buf)->data;
+void* send_data = send_buf + sizeof(struct pack_header);
 // Receiving data address for application to read its receiving data
-const void* recv_data = ((struct pack_header*)recv_buf)->data;
+const void* recv_data = recv_buf + sizeof(struct pack_header);
 
 
 // =========================== Interface Functions ==========================
+#ifndef PACK_CHECKSUM
 // Compute Checksum for 'count' bytes beginning at location 'addr'
 static U16 checksum(const U8* addr, U16 count)
 {
 	register U32 sum = 0;
 
-	// Calculate the sum as 16-bit digital
+	// Calculate the sum as little-endian 16-bit digital
 	while (count > 1) {
-		sum += *(U16*)addr++;
+		sum += get_pack_u16(addr);
+		addr += 2;
 		count -= 2;
 	}
 
 	// Deal with odd-numbered situation
 	if (count > 0) {
-		sum += *(U8*)addr;
+		sum += *addr;
 	}
 
 	// Add the high bit overflow to the low 16-bit
@@ -66,6 +106,52 @@ static U16 checksum(const U8* addr, U16 count)
 	return (U16)(~sum);
 }
 
+// Patch checksum 'sum' for a 16-bit word of the summed bytes changed from
+// 'old_word' to 'new_word', without summing the bytes again, it's equation 3
+// of RFC 1624: HC' = ~(~HC + ~m + m'), which gives the same result as
+// checksum() because the sum never folds to 0 for the nonzero 'len' field
+static U16 checksum_patch(U16 sum, U16 old_word, U16 new_word)
+{
+	U32 value = (U32)(U16)~sum + (U16)~old_word + new_word;
+
+	// Add the high bit overflow to the low 16-bit
+	value = (value & 0xFFFF) + (value >> 16);
+	value = (value & 0xFFFF) + (value >> 16);
+
+	return (U16)(~value);
+}
+#define PACK_CHECKSUM checksum
+#else
+U16 PACK_CHECKSUM(const U8* addr, U16 count);
+// The checksum of application can't be patched, it's summed again
+#define CHECKSUM_EXTERN
+#endif
+
+// Stamp the 16-bit word at 'p' in the summed part of package 'pack' with
+// 'value', the checksum is patched for it, or left to be summed again if
+// the checksum is defined by application
+static void stamp_pack_u16(struct pack_header* pack, U8* p, U16 value)
+{
+#if !defined CHECKSUM_EXTERN
+	put_pack_u16(pack->chksum, checksum_patch(get_pack_u16(pack->chksum), get_pack_u16(p), value));
+#else
+	(void)pack;
+#endif
+	put_pack_u16(p, value);
+}
+
+// Stamp the seqno of package 'pack' with 'seqno', the checksum is patched
+// for it like stamp_pack_u16()
+static void stamp_pack_seqno(struct pack_header* pack, pack_seqno seqno)
+{
+#if defined PACK_WIDE_SEQNO
+	stamp_pack_u16(pack, pack->seqno, (U16)seqno);
+	stamp_pack_u16(pack, pack->seqno + 2, (U16)(seqno >> 16));
+#else
+	stamp_pack_u16(pack, pack->seqno, seqno);
+#endif
+}
+
 // Initialize variables
 static void init_data(void)
 {
@@ -79,11 +165,19 @@ static void init_data(void)
 	flag_master_need_ack = false;
 	master_send_time_last = 0;
 	master_retry_times = 0;
+	master_fast_retry_acks = 0;
+	master_stale_ack_count = 0;
 	memset(&pack_count_info, 0, sizeof(pack_count_info));
+#if defined PACK_TX_ASYNC
+	tx_next = 0;
+	flag_tx_busy = false;
+	tx_wait_len = 0;
+	flag_master_tx_done = false;
+#endif
 
 	memset(recv_buf, 0, sizeof(recv_buf));
-	send_data = ((struct pack_header*)send_buf)->data;
-	recv_data = ((struct pack_header*)recv_buf)->data;
+	send_data = send_buf + sizeof(struct pack_header);
+	recv_data = recv_buf + sizeof(struct pack_header);
 }
 
 // Initialize protocol
@@ -91,20 +185,109 @@ void init_pack(bool is_master, U32 max_ack_delay, send_bytes_func func)
 {
 	// Initialize variables
 	init_data();
+#if defined PACK_FEC
+	fec_init();
+#endif
 	// Config the protocol parameters with the given values
 	flag_is_master = is_master;
 	master_max_ack_delay = max_ack_delay;
 	send_bytes = func;
 }
 
+#if defined PACK_TX_ASYNC
+// Hand the frame in the next buffer to lower layer, the interrupt that calls
+// tx_complete() must be masked
+static void start_tx(U16 len)
+{
+	U8* frame = tx_buf[tx_next];
+
+	// Mark before sending, in case tx_complete() is called by send_bytes
+	flag_tx_busy = true;
+	tx_next ^= 1;
+	send_bytes(frame, len);
+}
+
+// Lower layer tells that the bytes of the last send_bytes_func are out, the
+// next frame is sent from here if it's waiting, can be called in interrupt
+void tx_complete(void)
+{
+	U16 len = tx_wait_len;
+
+	flag_tx_busy = false;
+	if (len > 0) {
+		tx_wait_len = 0;
+		start_tx(len);
+	} else {
+		// The last package is out, ack timeout of master starts from now
+		master_send_time_last = LOCAL_TIME();
+		flag_master_tx_done = true;
+	}
+}
+#endif
+
+// Send a package to lower layer, encoded as a frame if COBS is enabled
+static void send_frame(const U8* buf, U16 len)
+{
+#if defined PACK_TX_ASYNC
+	U8* frame;
+
+	// A frame waiting for the bus is replaced by the new one, so its buffer
+	// is free to fill while the other one is on the bus
+	PACK_TX_LOCK();
+	tx_wait_len = 0;
+	frame = tx_buf[tx_next];
+	PACK_TX_UNLOCK();
+
+	#if defined PACK_FRAMING_COBS
+	len = cobs_encode(buf, len, frame);
+	frame[len++] = COBS_DELIMITER;
+	#else
+	memcpy(frame, buf, len);
+	#endif
+
+	// Send it at once if the bus is free, or after the frame on the bus. Ack
+	// timeout of master waits for tx_complete() of this frame, the frame on
+	// the bus may be done while this one is filled, which must not count.
+	PACK_TX_LOCK();
+	flag_master_tx_done = false;
+	if (flag_tx_busy) {
+		tx_wait_len = len;
+	} else {
+		start_tx(len);
+	}
+	PACK_TX_UNLOCK();
+#elif defined PACK_FRAMING_COBS
+	len = cobs_encode(buf, len, frame_buf);
+	frame_buf[len++] = COBS_DELIMITER;
+	send_bytes(frame_buf, len);
+#else
+	send_bytes((U8*)buf, len);
+#endif
+}
+
+// The seqno of master after 'seqno', 0 and SEQNO_FIRST are skipped on
+// wraparound
+static pack_seqno next_seqno(pack_seqno seqno)
+{
+	seqno++;
+	if (seqno == 0) {
+		seqno = SEQNO_FIRST + 1;
+	}
+
+	return seqno;
+}
+
+static void transmit_pack(void);
+
 // Original send package function
-static void _send_pack(U16 data_len, bool is_new_pack)
+static void _send_pack(U16 data_len, enum pack_send_type_list type)
 {
 	// Mapping the sending buffer with struct pack_header
 	struct pack_header* pack = (struct pack_header*)send_buf;
+	pack_seqno seqno;
 
 	// See if it is a new package
-	if (is_new_pack) {
+	if (type == PACK_SEND_NEW) {
 		// Fill data in accordance with the package structure
 		pack->premble[0] = PACK_PREMBLE;
 		pack->premble[1] = PACK_PREMBLE;
@@ -112,48 +295,187 @@ static void _send_pack(U16 data_len, bool is_new_pack)
 		pack->start = PACK_START;
 		// Master's seqno will incremente by 1, but slave just take the last
 		// received seqno for this sending
-		if (flag_is_master) {
-			pack->seqno++;
-			if (pack->seqno == 0) {
-				pack->seqno = 1;
-			}
+		if (IS_MASTER) {
+			seqno = next_seqno(get_pack_seqno(pack->seqno));
 		} else {
-			pack->seqno = slave_recv_seqno_last;
+			seqno = slave_recv_seqno_last;
 		}
-		pack->len = data_len;
-		pack->chksum = checksum((const U8*)&pack->seqno, pack->len + CHECKSUM_HEAD_LEN);
+		put_pack_seqno(pack->seqno, seqno);
+		put_pack_u16(pack->len, data_len);
+		put_pack_u16(pack->chksum, PACK_CHECKSUM(pack->seqno, data_len + CHECKSUM_HEAD_LEN));
+#if defined PACK_FEC
+		// Append parity after data part, the header has its own
+		fec_encode(pack->chksum, FEC_HEAD_LEN, pack->head_fec);
+		fec_encode(pack->chksum, data_len + FEC_HEAD_LEN, pack->data + data_len);
+#endif
 
 		// Count the new sending package
 		pack_count_info.send_pack_count[PACK_SEND_NEW]++;
 	} else {
-		// Count the resending package
-		pack_count_info.send_pack_count[PACK_SEND_RETRY]++;
+		// Count the resending package by its reason
+		pack_count_info.send_pack_count[type]++;
 	}
 
+	transmit_pack();
+}
+
+// Send the package in sending buffer to lower layer, and update the state of
+// master for it
+static void transmit_pack(void)
+{
+	struct pack_header* pack = (struct pack_header*)send_buf;
+
 	// Send package
-	send_bytes(send_buf, sizeof(struct pack_header) + pack->len);
+	send_frame(send_buf, sizeof(struct pack_header) + get_pack_u16(pack->len) + PACK_FEC_LEN);
 
 	// Master must check if ack is timeout
-	if (flag_is_master) {
+	if (IS_MASTER) {
 		// Mark the master is waiting for ack
 		flag_master_need_ack = true;
+#if !defined PACK_TX_ASYNC
 		// Record the last point-in-time that master sent package
 		master_send_time_last = LOCAL_TIME();
+#endif
 		// Record the last seqno that master sent
-		master_send_seqno_last = pack->seqno;
+		master_send_seqno_last = get_pack_seqno(pack->seqno);
+		// Count stale acks for this sending only
+		master_stale_ack_count = 0;
 	}
 }
 
 // Send package
 void send_pack(U16 data_len)
 {
-	_send_pack(data_len, true);
+	_send_pack(data_len, PACK_SEND_NEW);
+}
+
+// Master sends the last package again as a new one, e.g. to repeat a command
+// that the slave would take as duplicate. Only 'seqno' is stamped, and the
+// checksum is patched for it instead of summed again, so it costs the same
+// time for any length of data part.
+void master_repeat_pack(void)
+{
+	struct pack_header* pack = (struct pack_header*)send_buf;
+
+	// Nothing was sent yet
+	if (get_pack_u16(pack->len) == 0) {
+		return;
+	}
+
+	stamp_pack_seqno(pack, next_seqno(get_pack_seqno(pack->seqno)));
+#if defined CHECKSUM_EXTERN
+	put_pack_u16(pack->chksum, PACK_CHECKSUM(pack->seqno, get_pack_u16(pack->len) + CHECKSUM_HEAD_LEN));
+#endif
+#if defined PACK_FEC
+	// Parity covers the header too, encode it again
+	fec_encode(pack->chksum, FEC_HEAD_LEN, pack->head_fec);
+	fec_encode(pack->chksum, get_pack_u16(pack->len) + FEC_HEAD_LEN, pack->data + get_pack_u16(pack->len));
+#endif
+
+	// Count the new sending package
+	pack_count_info.send_pack_count[PACK_SEND_NEW]++;
+	transmit_pack();
+}
+
+// Resend the last package, 'type' is the reason
+static void resend_pack(enum pack_send_type_list type)
+{
+	_send_pack(0, type);
+}
+
+// Master resends at once if enough stale acks are received while waiting
+// for ack, an intact ack with an old seqno tells the last package is lost
+static void check_fast_retry(const struct pack_header* pack, U16 len)
+{
+	if (!flag_master_need_ack || (master_fast_retry_acks == 0)) {
+		return;
+	}
+
+	// A broken ack tells nothing, its seqno may be wrong, and an ack ahead of
+	// the last sent seqno is not stale
+	if (!seqno_before(get_pack_seqno(pack->seqno), master_send_seqno_last)
+	|| (len < 1) || (len > MAX_DATA_LEN)
+	|| (get_pack_u16(pack->chksum) != PACK_CHECKSUM(pack->seqno, len + CHECKSUM_HEAD_LEN))) {
+		return;
+	}
+
+	master_stale_ack_count++;
+	if (master_stale_ack_count >= master_fast_retry_acks) {
+		// Increment the resend times of master by 1
+		master_retry_times++;
+		// Resend the last sent package
+		resend_pack(PACK_SEND_FAST_RETRY);
+	}
+}
+
+#if defined PACK_FEC
+// Correct byte errors of the fields from 'chksum' to 'len' of header 'pack'
+// in place by the parity of header, return the number of bytes corrected
+static U8 correct_head(struct pack_header* pack)
+{
+	U8 code[FEC_HEAD_LEN + PACK_FEC_LEN];
+	U8 count;
+
+	// The parity is before the fields, the codeword ends with it
+	memcpy(code, pack->chksum, FEC_HEAD_LEN);
+	memcpy(code + FEC_HEAD_LEN, pack->head_fec, PACK_FEC_LEN);
+	if (!fec_decode(code, sizeof(code), &count) || (count == 0)) {
+		return 0;
+	}
+	memcpy(pack->chksum, code, FEC_HEAD_LEN);
+
+	return count;
+}
+
+// Get the data length of header 'pack' as corrected by the parity of header,
+// for finding the end of package, the header is not changed
+static U16 get_fec_len(const struct pack_header* pack)
+{
+	struct pack_header head;
+
+	memcpy(&head, pack, sizeof(head));
+	correct_head(&head);
+
+	return get_pack_u16(head.len);
+}
+
+// Correct byte errors of the received package in place by its parity, the
+// header is corrected first by its own parity, so is the length that finds
+// the parity of package
+static void correct_pack(void)
+{
+	struct pack_header* pack = (struct pack_header*)recv_buf;
+	U16 len;
+	U8 head_count;
+	U8 count = 0;
+
+	head_count = correct_head(pack);
+	len = get_pack_u16(pack->len);
+
+	// Parity can't be found by a length broken beyond the parity of header,
+	// the package will be dropped
+	if ((len >= 1) && (len <= MAX_DATA_LEN)
+	&& !fec_decode(pack->chksum, len + FEC_HEAD_LEN + PACK_FEC_LEN, &count)) {
+		count = 0;
+	}
+
+	if (head_count + count > 0) {
+		// Count the corrected package and bytes
+		pack_count_info.fec_pack_count++;
+		pack_count_info.fec_byte_count += head_count + count;
+	}
 }
+#endif
 
-// Resend the last package
-static void resend_pack(void)
+// Check if a request with 'seqno' other than the last received is a delayed
+// duplicate for slave, whose seqno is shortly before the last received. The
+// first seqno of master is always new, for restart of master.
+static bool is_stale_seqno(pack_seqno seqno)
 {
-	_send_pack(0, false);
+	pack_seqno last = slave_recv_seqno_last;
+
+	return (last != 0) && (seqno != SEQNO_FIRST) && seqno_before(seqno, last)
+	&& ((pack_seqno)(last - seqno) <= SLAVE_SEQNO_WINDOW);
 }
 
 // Check validity of the received package
@@ -161,6 +483,16 @@ enum pack_recv_type_list check_pack(void)
 {
 	enum pack_recv_type_list ret = PACK_RECV_NEW;
 	struct pack_header* pack = (struct pack_header*)recv_buf;
+	pack_seqno seqno;
+	U16 len;
+
+#if defined PACK_FEC
+	// Correct the package before any field is believed
+	correct_pack();
+#endif
+	// Decode the multi-byte fields of header
+	seqno = get_pack_seqno(pack->seqno);
+	len = get_pack_u16(pack->len);
 
 	do {
 		// Check the premble
@@ -181,18 +513,19 @@ enum pack_recv_type_list check_pack(void)
 			break;
 		}
 
-		if (flag_is_master) {
+		if (IS_MASTER) {
 			// Master check if the seqno is same as the last sent
-			if (pack->seqno != master_send_seqno_last) {
+			if (seqno != master_send_seqno_last) {
 				// Count the seqno error package
 				pack_count_info.recv_pack_count[PACK_RECV_SEQNO_ERR]++;
 				ret = PACK_RECV_SEQNO_ERR;
+				check_fast_retry(pack, len);
 				break;
 			}
 		}
 
 		// Check the data length
-		if ((pack->len < 1) || (pack->len > MAX_DATA_LEN)) {
+		if ((len < 1) || (len > MAX_DATA_LEN)) {
 			// Count the data length error package
 			pack_count_info.recv_pack_count[PACK_RECV_LEN_ERR]++;
 			ret = PACK_RECV_LEN_ERR;
@@ -200,7 +533,7 @@ enum pack_recv_type_list check_pack(void)
 		}
 
 		// Check the checksum
-		if (pack->chksum != checksum((const U8*)&pack->seqno, pack->len + CHECKSUM_HEAD_LEN)) {
+		if (get_pack_u16(pack->chksum) != PACK_CHECKSUM(pack->seqno, len + CHECKSUM_HEAD_LEN)) {
 			// Count the checksum error package
 			pack_count_info.recv_pack_count[PACK_RECV_CHKSUM_ERR]++;
 			ret = PACK_RECV_CHKSUM_ERR;
@@ -208,52 +541,210 @@ enum pack_recv_type_list check_pack(void)
 		}
 
 		// If the seqno is same as the last received, slave will resend the last package
-		if (!flag_is_master) {
+		if (!IS_MASTER) {
 			// Check the seqno
-			if (pack->seqno == slave_recv_seqno_last) {
+			if (seqno == slave_recv_seqno_last) {
 				// Count the resend package that slave received
 				pack_count_info.recv_pack_count[PACK_RECV_RETRY]++;
-				// Resend the last package
-				resend_pack();
+				// Resend the ack, if the application has not acked yet, the
+				// sending buffer holds the ack of the request before, which
+				// would be a stale ack for master, the ack will be sent later
+				if (get_pack_seqno(((const struct pack_header*)send_buf)->seqno) == seqno) {
+					resend_pack(PACK_SEND_RETRY);
+				}
 				ret = PACK_RECV_RETRY;
 				break;
 			}
+			// A delayed duplicate must not be done again
+			if (is_stale_seqno(seqno)) {
+				// Count the seqno error package
+				pack_count_info.recv_pack_count[PACK_RECV_SEQNO_ERR]++;
+				ret = PACK_RECV_SEQNO_ERR;
+				break;
+			}
 		}
 
 		// Count the new package received
 		pack_count_info.recv_pack_count[PACK_RECV_NEW]++;
 
-		if (flag_is_master) {
+		if (IS_MASTER) {
 			// Ack package has received, clear the mark that master is waiting for ack
 			flag_master_need_ack = false;
 			// Set the resend times of master to zero
 			master_retry_times = 0;
 		} else {
 			// Slave record the last seqno that received
-			slave_recv_seqno_last = pack->seqno;
+			slave_recv_seqno_last = seqno;
 		}
 	} while (0);
 
 	return ret;
 }
 
+#if defined PACK_FRAMING_COBS
+// Decode the frame of 'len' bytes in recv_buf in place and check it, the
+// lower layer stores the bytes before delimiter to recv_buf
+enum pack_recv_type_list check_frame(U16 len)
+{
+	struct pack_header* pack = (struct pack_header*)recv_buf;
+
+	// The frame must hold a whole package, nothing more
+	len = cobs_decode(recv_buf, len);
+	if ((len < sizeof(struct pack_header))
+#if defined PACK_FEC
+	|| (len != sizeof(struct pack_header) + get_fec_len(pack) + PACK_FEC_LEN)) {
+#else
+	|| (len != sizeof(struct pack_header) + get_pack_u16(pack->len) + PACK_FEC_LEN)) {
+#endif
+		// Count the data length error package
+		pack_count_info.recv_pack_count[PACK_RECV_LEN_ERR]++;
+		return PACK_RECV_LEN_ERR;
+	}
+
+	return check_pack();
+}
+
+// Find and check the next frame in 'len' bytes of 'buf' from lower layer,
+// skipping line noise before it. Frames are found by the delimiter, so a
+// broken frame is checked as a broken package, and never hides the next.
+// Return true if a frame is decoded to recv_buf and checked, '*result' is
+// the verdict of check_frame(). '*used' is the number of bytes consumed,
+// the rest must be passed again with more bytes appended.
+bool scan_pack(const U8* buf, U16 len, U16* used, enum pack_recv_type_list* result)
+{
+	const U8* end;
+	U16 pos = 0;
+	U16 frame_len;
+
+	while (true) {
+		// Find the next delimiter, memchr() is the fastest byte search of libc
+		end = memchr(buf + pos, COBS_DELIMITER, len - pos);
+		if (end == NULL) {
+			// Bytes longer than a frame are noise
+			*used = (len - pos >= MAX_FRAME_SIZE) ? len : pos;
+			return false;
+		}
+		frame_len = (U16)(end - buf) - pos;
+
+		// Skip empty frames and frames too long
+		if ((frame_len == 0) || (frame_len >= MAX_FRAME_SIZE)) {
+			pos += frame_len + 1;
+			continue;
+		}
+
+		memcpy(recv_buf, buf + pos, frame_len);
+		*result = check_frame(frame_len);
+		*used = pos + frame_len + 1;
+		return true;
+	}
+}
+#else
+// Find and check the next package in 'len' bytes of 'buf' from lower layer,
+// skipping line noise before it. Candidates are found by the start code, and
+// a candidate with wrong length or checksum is taken as noise, then the scan
+// goes on from its next byte, so a package behind garbage is not lost.
+// Return true if a package is copied to recv_buf and checked, '*result' is
+// the verdict of check_pack(). '*used' is the number of bytes consumed, the
+// rest must be passed again with more bytes appended.
+bool scan_pack(const U8* buf, U16 len, U16* used, enum pack_recv_type_list* result)
+{
+	const struct pack_header* pack;
+	const U8* start;
+	U16 head = 0;
+	U16 pos = 0;
+	U16 data_len;
+
+	while (true) {
+		// Find the next start code, memchr() is the fastest byte search of libc
+		start = memchr(buf + pos, PACK_START, len - pos);
+		if (start == NULL) {
+			// Keep the bytes may be premble of the next package
+			*used = (len - pos > 3) ? len - 3 : pos;
+			return false;
+		}
+		pos = (U16)(start - buf) + 1;
+
+		// Check the premble before start code
+		if ((pos < sizeof(pack->premble) + 1)
+		|| (start[-1] != PACK_PREMBLE)
+		|| (start[-2] != PACK_PREMBLE)
+		|| (start[-3] != PACK_PREMBLE)) {
+			continue;
+		}
+		head = pos - sizeof(pack->premble) - 1;
+		pack = (const struct pack_header*)(buf + head);
+
+		// Wait for the rest of header
+		if (head + sizeof(struct pack_header) > len) {
+			break;
+		}
+
+		// Check the data length, a wrong one is noise
+#if defined PACK_FEC
+		data_len = get_fec_len(pack);
+#else
+		data_len = get_pack_u16(pack->len);
+#endif
+		if ((data_len < 1) || (data_len > MAX_DATA_LEN)) {
+			continue;
+		}
+
+		// Wait for the rest of package
+		if (head + sizeof(struct pack_header) + data_len + PACK_FEC_LEN > len) {
+			break;
+		}
+
+		memcpy(recv_buf, pack, sizeof(struct pack_header) + data_len + PACK_FEC_LEN);
+		*result = check_pack();
+		if (*result == PACK_RECV_CHKSUM_ERR) {
+			continue;
+		}
+		// Seqno is checked before checksum, so the package is only skipped
+		// as a whole if checksum is right
+		pack = (const struct pack_header*)recv_buf;
+		if ((*result == PACK_RECV_SEQNO_ERR)
+		&& (get_pack_u16(pack->chksum) != PACK_CHECKSUM(pack->seqno, data_len + CHECKSUM_HEAD_LEN))) {
+			continue;
+		}
+		*used = head + sizeof(struct pack_header) + data_len + PACK_FEC_LEN;
+		return true;
+	}
+
+	*used = head;
+	return false;
+}
+
+#endif
+
 // When ack timeout, master will resend the last package and return the resend times
 U16 master_check_ack_delay(void)
 {
 	// Check if master is waiting for ack
+#if defined PACK_TX_ASYNC
+	if (flag_master_need_ack && flag_master_tx_done) {
+#else
 	if (flag_master_need_ack) {
+#endif
 		// Check if ack timeout
 		if ((LOCAL_TIME() - master_send_time_last) > master_max_ack_delay) {
 			// Increment the resend times of master by 1
 			master_retry_times++;
 			// Resend the last sent package
-			resend_pack();
+			resend_pack(PACK_SEND_RETRY);
 		}
 	}
 
 	return master_retry_times;
 }
 
+// Master resends at once after receiving 'stale_acks' intact acks with wrong
+// seqno from the slave, instead of waiting for ack timeout, 0 to disable
+void master_set_fast_retry(U8 stale_acks)
+{
+	master_fast_retry_acks = stale_acks;
+	master_stale_ack_count = 0;
+}
+
 // Get statistics for sent and received package
 struct pack_count* get_pack_count_info(void)
 {
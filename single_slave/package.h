@@ -11,17 +11,30 @@
  *            6. Support variable-length data part.
  *            7. Application can define their own data structure.
  *            8. Statistics for every sent and received package.
+ *            9. Resynchronizes on the next package after line noise.
+ *           10. Optional COBS framing with unambiguous frame boundaries.
+ *           11. Optional forward error correction of received packages.
+ *           12. Fast resend of master on stale acks, before ack timeout.
+ *           13. Optional asynchronous sending with 2 buffers, for DMA or
+ *               interrupt-driven lower layer.
+ *           14. Master repeats a package with new seqno in constant time,
+ *               by patching the checksum incrementally.
+ *           15. Seqno compared by serial number arithmetic, slave drops
+ *               delayed duplicates, optional 32-bit seqno.
  * ======================================================================== */
 
 #ifndef _PACKAGE_H
 #define _PACKAGE_H
 
 #include <time.h>
+#include <string.h>
+#include <stddef.h>
 #include <stdbool.h>
 
 // Define CPU type
 #define X86
 //#define AVR
+//#define ARM
 
 // Definitions of basic type
 #if defined X86
@@ -29,46 +42,142 @@
 	typedef unsigned char  U8;
 	typedef unsigned short U16;
 	typedef unsigned int   U32;
+	#define PACK_LITTLE_ENDIAN
 #elif defined AVR
 	// AVR MCU
 	typedef unsigned char U8;
 	typedef unsigned int  U16;
 	typedef unsigned long U32;
+	#define PACK_LITTLE_ENDIAN
+#elif defined ARM
+	// ARM MCU
+	typedef unsigned char  U8;
+	typedef unsigned short U16;
+	typedef unsigned int   U32;
+	#define PACK_LITTLE_ENDIAN
 #endif
 
 // Function type of callback function for sending bytes
 typedef void (*send_bytes_func)(U8* buf, U16 count);
 
-// Get local time
-#define LOCAL_TIME() (clock())
+// Define PACK_WIDE_SEQNO for 32-bit seqno instead of 16-bit, so seqno won't
+// wrap in a long time on fast links, the header is 2 bytes longer
+//#define PACK_WIDE_SEQNO
+
+// Type of seqno
+#if defined PACK_WIDE_SEQNO
+	typedef U32 pack_seqno;
+	#define PACK_SEQNO_LEN 4
+#else
+	typedef U16 pack_seqno;
+	#define PACK_SEQNO_LEN 2
+#endif
+
+// Define role of the machine at compile time, so that the code for the other
+// role is removed, leave both undefined to select the role at runtime
+//#define PACK_ROLE_MASTER
+//#define PACK_ROLE_SLAVE
+
+// Define PACK_CHECKSUM to replace the checksum algorithm with a function of
+// application, its prototype is 'U16 func(const U8* addr, U16 count)'
+//#define PACK_CHECKSUM crc16
+
+// Frame packages by COBS with a zero delimiter instead of premble only, so
+// boundaries of frames are unambiguous, it needs cobs.c
+//#define PACK_FRAMING_COBS
 
-// Maximum buffer size
-#define MAX_BUF_SIZE 100
+// Correct byte errors of received packages by Reed-Solomon code, the value is
+// the maximum bytes corrected in a package, each costs 2 parity bytes that
+// appended to the package, and 2 more in the header, whose own parity
+// corrects the length before the parity of package is found by it. It needs
+// fec.c
+//#define PACK_FEC 2
+
+// Define PACK_TX_ASYNC if the lower layer sends bytes in background, e.g. by
+// DMA or interrupt of UART, then send_bytes_func returns at once and the
+// lower layer calls tx_complete() after the last byte is out. Frames take
+// turns in 2 buffers, and ack timeout of master starts from tx_complete().
+// PACK_TX_LOCK() and PACK_TX_UNLOCK() mask and unmask the interrupt that
+// calls tx_complete(), e.g. cli() and sei() on AVR
+//#define PACK_TX_ASYNC
+#if defined PACK_TX_ASYNC && !defined PACK_TX_LOCK
+	#define PACK_TX_LOCK()
+	#define PACK_TX_UNLOCK()
+#endif
+
+// Get local time, define PACK_CLOCK_EXTERN to use the time function of
+// application instead, e.g. a monotonic clock or a simulated clock
+#if defined PACK_CLOCK_EXTERN
+	U32 pack_local_time(void);
+	#define LOCAL_TIME() (pack_local_time())
+#else
+	#define LOCAL_TIME() (clock())
+#endif
+
+// Maximum buffer size, can be defined by compiler option
+#ifndef MAX_BUF_SIZE
+	#define MAX_BUF_SIZE 100
+#endif
+// Length of parity appended to package
+#if defined PACK_FEC
+	#define PACK_FEC_LEN (PACK_FEC * 2)
+	// A codeword begins from checksum, and it's 255 bytes at most
+	#if MAX_BUF_SIZE > 255 + 4 + PACK_FEC_LEN
+		#error "MAX_BUF_SIZE is too large for PACK_FEC"
+	#endif
+#else
+	#define PACK_FEC_LEN 0
+#endif
 // Maxinum size of data part
-#define MAX_DATA_LEN (MAX_BUF_SIZE - sizeof(struct pack_header))
+#define MAX_DATA_LEN (MAX_BUF_SIZE - sizeof(struct pack_header) - PACK_FEC_LEN)
+// Maximum size of frame on the bus, which is a package encoded by COBS with
+// the delimiter, or the package itself
+#if defined PACK_FRAMING_COBS
+	#define MAX_FRAME_SIZE (MAX_BUF_SIZE + MAX_BUF_SIZE / 254 + 2)
+#else
+	#define MAX_FRAME_SIZE MAX_BUF_SIZE
+#endif
+
+// The first seqno of master after it's initialized, the seqno skips it and 0
+// on wraparound, so slave always takes it as a new request, for restart of
+// master
+#define SEQNO_FIRST 1
+// Requests whose seqno is before the last one that slave received, by this
+// at most, are delayed duplicates, slave drops them
+#define SLAVE_SEQNO_WINDOW 256
 
 // Premble
 #define PACK_PREMBLE '-'
 // Start code
 #define PACK_START   '>'
 
-// The length for checksum computing before 'data' in struct pack_header
-#define CHECKSUM_HEAD_LEN 4
+// The length for checksum computing before 'data' in struct pack_header,
+// which is from 'seqno' to 'len'
+#define CHECKSUM_HEAD_LEN (PACK_SEQNO_LEN + 2)
+// The length for FEC before 'data' in struct pack_header, which is from
+// 'chksum' to 'len'
+#define FEC_HEAD_LEN (CHECKSUM_HEAD_LEN + 2)
 
-// Package header
+// Package header, it's made of bytes only, so the layout is same on every
+// CPU, multi-byte fields are little-endian and accessed by get_pack_u16()
+// and put_pack_u16()
 struct pack_header {
 	U8 premble[3]; // Premble
 	U8 start;      // Start code
-	U16 chksum;    // Checksum that computed from 'seqno' to the tail of 'data'
-	U16 seqno;     // Sequence number
-	U16 len;       // Length of data part
+#if defined PACK_FEC
+	U8 head_fec[PACK_FEC_LEN]; // Parity of the fields from 'chksum' to 'len', at a fixed place
+#endif
+	U8 chksum[2];  // Checksum that computed from 'seqno' to the tail of 'data'
+	U8 seqno[PACK_SEQNO_LEN]; // Sequence number
+	U8 len[2];     // Length of data part
 	U8 data[];     // Data part
 };
 
 // Type of sent package
 enum pack_send_type_list {
 	PACK_SEND_NEW,        // New package
-	PACK_SEND_RETRY,      // Resending package
+	PACK_SEND_RETRY,      // Resending package for ack timeout or duplicate request
+	PACK_SEND_FAST_RETRY, // Resending package at once for stale acks
 
 	PACK_SEND_TYPE_TOTAL, // Total type of sent package
 };
@@ -90,11 +199,72 @@ enum pack_recv_type_list {
 struct pack_count {
 	U32 send_pack_count[PACK_SEND_TYPE_TOTAL]; // Statistics for sent packages
 	U32 recv_pack_count[PACK_RECV_TYPE_TOTAL]; // Statistics for received packages
+#if defined PACK_FEC
+	U32 fec_pack_count;                        // Received packages corrected by FEC
+	U32 fec_byte_count;                        // Bytes corrected by FEC
+#endif
 };
 
+// Read a little-endian 16-bit field of package
+static inline U16 get_pack_u16(const U8* p)
+{
+#if defined PACK_LITTLE_ENDIAN
+	U16 value;
+
+	// memcpy() of a word is one load where unaligned access is allowed, and
+	// doesn't break strict aliasing as a cast does
+	memcpy(&value, p, sizeof(value));
+	return value;
+#else
+	return (U16)(p[0] | (p[1] << 8));
+#endif
+}
+
+// Write a little-endian 16-bit field of package
+static inline void put_pack_u16(U8* p, U16 value)
+{
+#if defined PACK_LITTLE_ENDIAN
+	// memcpy() of a word is one store where unaligned access is allowed
+	memcpy(p, &value, sizeof(value));
+#else
+	p[0] = (U8)value;
+	p[1] = (U8)(value >> 8);
+#endif
+}
+
+// Read the seqno field of package
+static inline pack_seqno get_pack_seqno(const U8* p)
+{
+#if defined PACK_WIDE_SEQNO
+	return get_pack_u16(p) | ((U32)get_pack_u16(p + 2) << 16);
+#else
+	return get_pack_u16(p);
+#endif
+}
+
+// Write the seqno field of package
+static inline void put_pack_seqno(U8* p, pack_seqno seqno)
+{
+#if defined PACK_WIDE_SEQNO
+	put_pack_u16(p, (U16)seqno);
+	put_pack_u16(p + 2, (U16)(seqno >> 16));
+#else
+	put_pack_u16(p, seqno);
+#endif
+}
+
+// Check if seqno 'a' is before 'b' by serial number arithmetic of RFC 1982,
+// which is right over wraparound, 'a' is before 'b' if 'b' is ahead of it
+// by less than half of the seqno space
+static inline bool seqno_before(pack_seqno a, pack_seqno b)
+{
+	return (a != b) && ((pack_seqno)(b - a) < ((pack_seqno)1 << (PACK_SEQNO_LEN * 8 - 1)));
+}
+
 // ============================ Global Variables ============================
-// Receiving buffer for lower layer to store received data
-extern U8 recv_buf[MAX_BUF_SIZE];
+// Receiving buffer for lower layer to store received data, a lower layer in
+// interrupt handler puts bytes to a ring of ring.h instead, which fills it
+extern U8 recv_buf[MAX_FRAME_SIZE];
 // Sending data address for application to store its sending data
 extern void* send_data;
 // Receiving data address for application to read its receiving data
@@ -105,10 +275,32 @@ extern const void* recv_data;
 void init_pack(bool is_master, U32 max_ack_delay, send_bytes_func func);
 // Send package
 void send_pack(U16 data_len);
+// Master sends the last package again as a new one, e.g. to repeat a command
+// that the slave would take as duplicate, the checksum is patched for the new
+// seqno instead of summed again
+void master_repeat_pack(void);
+#if defined PACK_TX_ASYNC
+// Lower layer tells that the bytes of the last send_bytes_func are out, the
+// next frame is sent from here if it's waiting, can be called in interrupt
+void tx_complete(void);
+#endif
 // Check validity of the received package
 enum pack_recv_type_list check_pack(void);
+#if defined PACK_FRAMING_COBS
+// Decode the frame of 'len' bytes in recv_buf in place and check it, the
+// lower layer stores the bytes before delimiter to recv_buf
+enum pack_recv_type_list check_frame(U16 len);
+#endif
+// Find and check the next package in bytes from lower layer, skipping line
+// noise, return true if a package is checked and '*result' is its verdict,
+// '*used' bytes are consumed, pass the rest again with more bytes appended
+bool scan_pack(const U8* buf, U16 len, U16* used, enum pack_recv_type_list* result);
 // When ack timeout, master will resend the last package and return the resend times
 U16 master_check_ack_delay(void);
+// Master resends at once after receiving 'stale_acks' intact acks with wrong
+// seqno from the slave, instead of waiting for ack timeout, 0 to disable,
+// which is the default
+void master_set_fast_retry(U8 stale_acks);
 // Get statistics for sent and received package
 struct pack_count* get_pack_count_info(void);
 
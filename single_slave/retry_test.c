@@ -0,0 +1,208 @@
+/* ==========================================================================
+ * retry_test.c: Test of Resending with a Slow Slave (POSIX)
+ *
+ * function:  1. Runs master and slave of package.c in 2 processes, as the
+ *               state of protocol is global, connected by 2 pipes.
+ *            2. Slave application acks every request much later than the
+ *               ack timeout of master, so master resends each request a few
+ *               times before the ack, with fast resend on a stale ack.
+ *            3. A resent request before the ack of application must not be
+ *               answered by the ack of the request before, or master and
+ *               slave resend to each other without limit. Resendings of
+ *               master are checked against the ack timeouts in the delay.
+ *            4. Every ack is checked against its request.
+ *
+ * usage:     retry_test
+ *
+ * build:     gcc -DPACK_CLOCK_EXTERN retry_test.c package.c
+ * ======================================================================== */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "package.h"
+
+// LOCAL_TIME() must be wall time of both processes
+#if !defined PACK_CLOCK_EXTERN
+	#error "retry_test.c needs PACK_CLOCK_EXTERN, LOCAL_TIME() is given by pack_local_time()"
+#endif
+
+// Requests of master
+#define TEST_REQUESTS 20
+// Ack timeout of master in milliseconds
+#define TEST_ACK_DELAY 10
+// Delay of slave application before it acks, in milliseconds
+#define TEST_SLAVE_DELAY 50
+// Resendings of master for a request at most, by ack timeout in the delay of
+// slave, and the stale acks of resendings that cross the ack
+#define TEST_MAX_RESENDS (TEST_SLAVE_DELAY / TEST_ACK_DELAY + 4)
+// Time of the test at most in milliseconds
+#define TEST_TIMEOUT 10000
+
+// ============================ Static Variables ============================
+static int send_fd;                       // Pipe to the other process
+static int recv_fd;                       // Pipe from the other process
+static U8 rx_buf[MAX_FRAME_SIZE * 4];     // Bytes received, not checked yet
+static U16 rx_len;                        // Length of bytes in 'rx_buf'
+
+// Local time, for LOCAL_TIME()
+U32 pack_local_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (U32)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+// Callback function for sending bytes to the other process
+static void send_bytes(U8* buf, U16 count)
+{
+	if (write(send_fd, buf, count) != count) {
+		printf("FAIL: write to pipe\n");
+	}
+#if defined PACK_TX_ASYNC
+	tx_complete();
+#endif
+}
+
+// Read bytes from the other process and check the next package, return
+// true if a package is checked and '*result' is its verdict
+static bool recv_pack(enum pack_recv_type_list* result)
+{
+	ssize_t ret;
+	U16 used;
+	bool flag_checked;
+
+	ret = read(recv_fd, rx_buf + rx_len, sizeof(rx_buf) - rx_len);
+	if (ret > 0) {
+		rx_len += (U16)ret;
+	}
+
+	flag_checked = scan_pack(rx_buf, rx_len, &used, result);
+	rx_len -= used;
+	memmove(rx_buf, rx_buf + used, rx_len);
+
+	return flag_checked;
+}
+
+// Slave acks every request with its data after TEST_SLAVE_DELAY, and takes
+// the resent requests meanwhile
+static void run_slave(void)
+{
+	enum pack_recv_type_list result;
+	U32 due = 0;
+	U16 len = 0;
+
+	init_pack(false, 0, send_bytes);
+	while (true) {
+		if (recv_pack(&result) && (result == PACK_RECV_NEW)) {
+			len = get_pack_u16(((const struct pack_header*)recv_buf)->len);
+			due = pack_local_time() + TEST_SLAVE_DELAY;
+		}
+		if ((len > 0) && ((U32)(pack_local_time() - due) < 0x80000000UL)) {
+			memcpy(send_data, recv_data, len);
+			send_pack(len);
+			len = 0;
+		}
+		usleep(100);
+	}
+}
+
+// Master sends the requests, and checks the acks and its resendings, return
+// the number of failed checks
+static U32 run_master(void)
+{
+	enum pack_recv_type_list result;
+	struct pack_count* count = get_pack_count_info();
+	U32 start = pack_local_time();
+	U32 sends = 0;
+	U32 resends;
+	U32 fail_count = 0;
+	U16 i;
+
+	init_pack(true, TEST_ACK_DELAY, send_bytes);
+	master_set_fast_retry(1);
+
+	for (i = 0; i < TEST_REQUESTS; i++) {
+		memset(send_data, (U8)i, i + 1);
+		send_pack(i + 1);
+
+		// Wait for the ack, resend on ack timeout
+		while (true) {
+			if ((U32)(pack_local_time() - start) > TEST_TIMEOUT) {
+				printf("FAIL: request %u is not acked in time\n", i);
+				return fail_count + 1;
+			}
+			if (recv_pack(&result) && (result == PACK_RECV_NEW)) {
+				break;
+			}
+			master_check_ack_delay();
+			usleep(100);
+		}
+
+		if ((get_pack_u16(((const struct pack_header*)recv_buf)->len) != i + 1)
+		|| (((const U8*)recv_data)[i] != (U8)i)) {
+			printf("FAIL: ack of request %u is wrong\n", i);
+			fail_count++;
+		}
+
+		resends = count->send_pack_count[PACK_SEND_RETRY] + count->send_pack_count[PACK_SEND_FAST_RETRY] - sends;
+		sends += resends;
+		if (resends > TEST_MAX_RESENDS) {
+			printf("FAIL: request %u is resent %u times\n", i, resends);
+			fail_count++;
+		}
+	}
+
+	printf("requests %u, resent %u by timeout and %u at once, stale acks %u\n", TEST_REQUESTS,
+	       count->send_pack_count[PACK_SEND_RETRY], count->send_pack_count[PACK_SEND_FAST_RETRY],
+	       count->recv_pack_count[PACK_RECV_SEQNO_ERR]);
+
+	return fail_count;
+}
+
+// Test of resending
+int main(void)
+{
+	int to_slave[2];
+	int to_master[2];
+	pid_t pid;
+	U32 fail_count;
+
+	if ((pipe(to_slave) < 0) || (pipe(to_master) < 0)) {
+		printf("FAIL: pipe\n");
+		return 1;
+	}
+	fcntl(to_slave[0], F_SETFL, O_NONBLOCK);
+	fcntl(to_master[0], F_SETFL, O_NONBLOCK);
+
+	pid = fork();
+	if (pid < 0) {
+		printf("FAIL: fork\n");
+		return 1;
+	}
+	if (pid == 0) {
+		send_fd = to_master[1];
+		recv_fd = to_slave[0];
+		run_slave();
+		return 0;
+	}
+
+	send_fd = to_slave[1];
+	recv_fd = to_master[0];
+	fail_count = run_master();
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	if (fail_count > 0) {
+		return 1;
+	}
+	printf("done\n");
+
+	return 0;
+}
@@ -0,0 +1,87 @@
+/* ==========================================================================
+ * ring.h: Receiving Ring of Bytes for Interrupt-driven Lower Layer
+ *
+ * function:  1. Lock-free ring with single producer and single consumer,
+ *               the producer may be an interrupt or signal handler.
+ *            2. The producer never waits, bytes are dropped and counted
+ *               if the ring is full.
+ *            3. The consumer finds packages in the bytes by scan_pack(),
+ *               so recv_buf is never written by the producer.
+ * ======================================================================== */
+
+#ifndef _RING_H
+#define _RING_H
+
+#include "package.h"
+
+// Number of bytes in ring, must be power of 2, one byte is always free
+#ifndef RING_SIZE
+	#define RING_SIZE 256
+#endif
+
+// Index of ring, it must be read and written at once by the CPU
+#if defined AVR
+	typedef U8 ring_index;
+	#if RING_SIZE > 256
+		#error "RING_SIZE is 256 at most on 8-bit CPU"
+	#endif
+#else
+	typedef U16 ring_index;
+#endif
+
+// Keep the order of memory access between bytes and index of ring, x86
+// never reorders stores with stores or loads with loads
+#if defined X86 && defined __GNUC__
+	#define RING_BARRIER() __asm__ __volatile__("" ::: "memory")
+#elif defined __GNUC__
+	#define RING_BARRIER() __sync_synchronize()
+#else
+	#define RING_BARRIER()
+#endif
+
+// Receiving ring
+struct byte_ring {
+	U8 buf[RING_SIZE];              // Bytes in ring
+	volatile ring_index head;       // Index to write, only written by producer
+	volatile ring_index tail;       // Index to read, only written by consumer
+	volatile U32 drop_count;        // Bytes dropped for full ring, only written by producer
+
+	U8 frame_buf[MAX_FRAME_SIZE * 2]; // Bytes taken out for scan_pack(), only used by consumer
+	U16 frame_len;                  // Length of bytes in frame_buf
+};
+
+// =========================== Interface Functions ==========================
+// Put a byte to ring, for the producer, e.g. in interrupt handler of UART,
+// return false if the ring is full and the byte is dropped
+static inline bool ring_put(struct byte_ring* ring, U8 byte)
+{
+	ring_index head = ring->head;
+	ring_index next = (ring_index)((head + 1) & (RING_SIZE - 1));
+
+	if (next == ring->tail) {
+		ring->drop_count++;
+		return false;
+	}
+
+	ring->buf[head] = byte;
+	// The byte is written before it's seen by consumer
+	RING_BARRIER();
+	ring->head = next;
+
+	return true;
+}
+
+// Initialize ring, before the producer starts
+void ring_init(struct byte_ring* ring);
+// Put 'count' bytes to ring, for the producer, return the number of bytes
+// put, the others are dropped
+U16 ring_write(struct byte_ring* ring, const U8* buf, U16 count);
+// Take at most 'count' bytes out of ring, for the consumer, return the
+// number of bytes taken
+U16 ring_read(struct byte_ring* ring, U8* buf, U16 count);
+// Find and check the next package in ring by scan_pack(), for the consumer,
+// return true if a package is checked in recv_buf, '*result' is its verdict
+bool ring_scan_pack(struct byte_ring* ring, enum pack_recv_type_list* result);
+
+
+#endif